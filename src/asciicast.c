@@ -0,0 +1,348 @@
+// asciicast.c (part of fatty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+#include "asciicast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* Length of a valid UTF-8 sequence at s, or 0 */
+static int
+utf8_valid(const uchar *s, int len)
+{
+  uchar c = s[0];
+  int n;
+  if (c >= 0xC2 && c <= 0xDF)
+    n = 2;
+  else if (c >= 0xE0 && c <= 0xEF)
+    n = 3;
+  else if (c >= 0xF0 && c <= 0xF4)
+    n = 4;
+  else
+    return 0;
+  if (n > len)
+    return 0;
+  for (int i = 1; i < n; i++)
+    if ((s[i] & 0xC0) != 0x80)
+      return 0;
+  // overlong forms, surrogates, beyond U+10FFFF
+  if ((c == 0xE0 && s[1] < 0xA0) || (c == 0xED && s[1] > 0x9F) ||
+      (c == 0xF0 && s[1] < 0x90) || (c == 0xF4 && s[1] > 0x8F))
+    return 0;
+  return n;
+}
+
+/* Escape output bytes into the contents of a JSON string */
+int
+cast_escape(const char *data, int len, char *out)
+{
+  static const char hex[] = "0123456789abcdef";
+  const uchar *s = (const uchar *)data;
+  char *o = out;
+  for (int i = 0; i < len;) {
+    uchar c = s[i];
+    if (c >= 0x20 && c < 0x80) {
+      if (c == '"' || c == '\\')
+        *o++ = '\\';
+      *o++ = c;
+      i++;
+      continue;
+    }
+    if (c >= 0x80) {
+      int n = utf8_valid(s + i, len - i);
+      if (n) {
+        memcpy(o, s + i, n);
+        o += n;
+        i += n;
+        continue;
+      }
+    }
+    *o++ = '\\';
+    switch (c) {
+      when '\b': *o++ = 'b';
+      when '\f': *o++ = 'f';
+      when '\n': *o++ = 'n';
+      when '\r': *o++ = 'r';
+      when '\t': *o++ = 't';
+      otherwise:
+        // control character, or a byte that is not part of valid UTF-8
+        memcpy(o, c < 0x80 ? "u00" : "udc", 3);
+        o += 3;
+        *o++ = hex[c >> 4];
+        *o++ = hex[c & 0xF];
+    }
+    i++;
+  }
+  return o - out;
+}
+
+static int
+hexval(const char *s)
+{
+  int v = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = s[i];
+    v <<= 4;
+    if (c >= '0' && c <= '9')
+      v |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      v |= c - 'A' + 10;
+    else
+      return -1;
+  }
+  return v;
+}
+
+static char *
+put_utf8(char *o, uint c)
+{
+  if (c < 0x80)
+    *o++ = c;
+  else if (c < 0x800) {
+    *o++ = 0xC0 | c >> 6;
+    *o++ = 0x80 | (c & 0x3F);
+  }
+  else if (c < 0x10000) {
+    *o++ = 0xE0 | c >> 12;
+    *o++ = 0x80 | ((c >> 6) & 0x3F);
+    *o++ = 0x80 | (c & 0x3F);
+  }
+  else {
+    *o++ = 0xF0 | c >> 18;
+    *o++ = 0x80 | ((c >> 12) & 0x3F);
+    *o++ = 0x80 | ((c >> 6) & 0x3F);
+    *o++ = 0x80 | (c & 0x3F);
+  }
+  return o;
+}
+
+/*
+   Decode the JSON string starting after the opening quote at s, in place.
+   Return its length and set *endp after the closing quote, or return -1.
+ */
+int
+cast_unescape(char *s, char **endp)
+{
+  char *start = s, *o = s;
+  for (;;) {
+    char c = *s++;
+    if (!c)
+      return -1;
+    if (c == '"')
+      break;
+    if (c != '\\') {
+      *o++ = c;
+      continue;
+    }
+    c = *s++;
+    switch (c) {
+      when 'b': *o++ = '\b';
+      when 'f': *o++ = '\f';
+      when 'n': *o++ = '\n';
+      when 'r': *o++ = '\r';
+      when 't': *o++ = '\t';
+      when '"' case_or '\\' case_or '/': *o++ = c;
+      when 'u': {
+        int u = hexval(s);
+        if (u < 0)
+          return -1;
+        s += 4;
+        if (u >= 0xDC80 && u <= 0xDCFF)
+          *o++ = u & 0xFF;  // raw byte
+        else if (u >= 0xD800 && u <= 0xDBFF && s[0] == '\\' && s[1] == 'u'
+                 && hexval(s + 2) >= 0xDC00 && hexval(s + 2) <= 0xDFFF) {
+          int l = hexval(s + 2);
+          s += 6;
+          o = put_utf8(o, 0x10000 + ((u - 0xD800) << 10) + (l - 0xDC00));
+        }
+        else if (u >= 0xD800 && u <= 0xDFFF)
+          o = put_utf8(o, 0xFFFD);
+        else
+          o = put_utf8(o, u);
+      }
+      otherwise:
+        return -1;
+    }
+  }
+  *endp = s;
+  return o - start;
+}
+
+
+static void
+put_all(const char *data, int len)
+{
+  while (len > 0) {
+    int ret = write(1, data, len);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return;
+    data += ret;
+    len -= ret;
+  }
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+   Play a recording to stdout, at speed percent of the original pace,
+   or as fast as possible with speed 0. Size changes are replayed as
+   window resize requests (CSI 8 t).
+   Closing stdout tells the terminal that the replay has ended.
+ */
+void
+cast_replay(const char *path, int speed)
+{
+  // coalesce output when not pacing it
+  static char buf[65536];
+  int buflen = 0;
+
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    char *msg = strerror(errno);
+    dprintf(1, "Cannot open recording %s: %s\r\n", path, msg);
+  }
+  else {
+    double start = now();
+    char *line = 0;
+    size_t size = 0;
+    int lineno = 0;
+    while (getline(&line, &size, f) >= 0) {
+      lineno++;
+      char *s = line;
+      while (*s == ' ' || *s == '\t')
+        s++;
+      if (*s == '{') {
+        char *w = strstr(s, "\"width\"");
+        char *h = strstr(s, "\"height\"");
+        if (w && h) {
+          w = strchr(w + 7, ':');
+          h = strchr(h + 8, ':');
+          if (w && h)
+            buflen += sprintf(buf + buflen, "\e[8;%d;%dt",
+                              atoi(h + 1), atoi(w + 1));
+        }
+        continue;
+      }
+      if (*s != '[')
+        continue;
+
+      char *p;
+      double t = strtod(s + 1, &p);
+      char *q = strchr(p, '"');
+      if (p == s + 1 || !q || !q[1] || q[2] != '"' || !(p = strchr(q + 3, '"'))) {
+        dprintf(1, "%s:%d: bad event\r\n", path, lineno);
+        continue;
+      }
+      char type = q[1];
+      char *data = p + 1, *end;
+      int len = cast_unescape(data, &end);
+      if (len < 0) {
+        dprintf(1, "%s:%d: bad string\r\n", path, lineno);
+        continue;
+      }
+
+      if (speed > 0) {
+        double wait = start + t * 100 / speed - now();
+        if (wait > 0) {
+          put_all(buf, buflen);
+          buflen = 0;
+          struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+          nanosleep(&ts, 0);
+        }
+      }
+
+      if (type == 'o') {
+        if (buflen + len > (int)sizeof buf) {
+          put_all(buf, buflen);
+          buflen = 0;
+        }
+        if (len > (int)sizeof buf)
+          put_all(data, len);
+        else {
+          memcpy(buf + buflen, data, len);
+          buflen += len;
+        }
+      }
+      else if (type == 'r') {
+        int cols, rows;
+        data[len] = 0;
+        if (sscanf(data, "%dx%d", &cols, &rows) == 2) {
+          if (buflen > (int)sizeof buf - 32) {
+            put_all(buf, buflen);
+            buflen = 0;
+          }
+          buflen += sprintf(buf + buflen, "\e[8;%d;%dt", rows, cols);
+        }
+      }
+    }
+    free(line);
+    fclose(f);
+  }
+  put_all(buf, buflen);
+
+  // signal the end by closing the terminal, but stay until the tab is closed
+  close(0);
+  close(1);
+  close(2);
+  for (;;)
+    pause();
+}
+
+
+#ifdef CAST_TEST
+
+#include <assert.h>
+
+int
+main(void)
+{
+  static char data[4096], esc[CAST_ESCAPE_SPACE(4096) + 2];
+  srand(1);
+  for (int round = 0; round < 2000; round++) {
+    int len = rand() % sizeof data;
+    for (int i = 0; i < len; i++) {
+      // mostly text, with UTF-8 sequences, controls, and stray bytes
+      switch (rand() % 8) {
+        when 0: data[i] = rand();
+        when 1: data[i] = rand() % 32;
+        when 2 case_or 3: {
+          static const char *seqs[] = {"\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\xED\xA0\x80", "\xC0\xAF"};
+          const char *seq = seqs[rand() % 5];
+          while (*seq && i < len)
+            data[i++] = *seq++;
+          i--;
+        }
+        otherwise: data[i] = ' ' + rand() % 95;
+      }
+    }
+    int elen = cast_escape(data, len, esc);
+    assert(elen <= CAST_ESCAPE_SPACE(len));
+    esc[elen] = '"';
+    esc[elen + 1] = 0;
+    for (int i = 0; i < elen; i++)
+      assert(esc[i] == '\\' ? esc[++i] != 0 : (uchar)esc[i] >= 0x20 && esc[i] != '"');
+    char *end;
+    int dlen = cast_unescape(esc, &end);
+    assert(dlen == len && end == esc + elen + 1);
+    assert(!memcmp(esc, data, len));
+  }
+  printf("ok\n");
+  return 0;
+}
+
+#endif
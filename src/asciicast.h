@@ -0,0 +1,21 @@
+#ifndef ASCIICAST_H
+#define ASCIICAST_H
+
+/*
+   Recordings in the asciicast v2 format of asciinema:
+   a JSON header line, then one JSON array per event,
+     [<seconds>, "o", "<output>"]  or  [<seconds>, "r", "<cols>x<rows>"]
+   Output that is not valid UTF-8 is stored byte by byte as lone
+   surrogates \udc80..\udcff, so that replay reproduces it exactly.
+ */
+
+/* Output space needed for escaping len bytes */
+#define CAST_ESCAPE_SPACE(len)	((len) * 6)
+
+extern int cast_escape(const char *data, int len, char *out);
+extern int cast_unescape(char *s, char **endp);
+
+/* Play a recording to stdout, then wait to be killed */
+extern void cast_replay(const char *path, int speed) __attribute__((noreturn));
+
+#endif
@@ -10,6 +10,11 @@
 #define uint32_t uint
 #endif
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define B64_SIMD
+#include <immintrin.h>
+#endif
+
 static const char base64_table[] = {
   'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
   'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
@@ -22,114 +27,364 @@ static const char base64_table[] = {
 };
 
 #define INVALID_CHAR	(-1)
+#define PAD_CHAR	(-2)
+
+/* Sextet values of input characters, or INVALID_CHAR or PAD_CHAR */
+static const signed char decode_table[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -2, -1, -1,
+  -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+  -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
 
 static inline char encode(uint32_t v)
 {
   return base64_table[v];
 }
 
-static inline int decode(char v)
+
+#ifdef B64_SIMD
+
+/*
+ * Vectorized codec, after the pshufb based algorithms by Wojciech Mula
+ * and Alfred Klomp (https://github.com/aklomp/base64).
+ * The SIMD loops only handle complete blocks of plain base64 characters;
+ * anything else (padding, invalid characters, short tails) is left to
+ * the scalar code, which also does the error reporting.
+ */
+
+static int simd_level = -1;  /* 0: none, 1: SSSE3, 2: AVX2 */
+
+static int get_simd_level(void)
 {
-  if (v >= 'A' && v <= 'Z') {
-    return v - 'A';
-  }
-  if (v >= 'a' && v <= 'z') {
-    return v - 'a' + 26;
-  }
-  if (v >= '0' && v <= '9') {
-    return v - '0' + 52;
+  if (simd_level < 0) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      simd_level = 2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+      simd_level = 1;
+    } else {
+      simd_level = 0;
+    }
   }
-  if (v == '+') {
-    return 62;
+  return simd_level;
+}
+
+__attribute__((target("ssse3")))
+static int encode_ssse3(const unsigned char **input, int *ilen, char **output)
+{
+  const __m128i shuf = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                    4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+                                    -4, -4, -4, -4, -19, -16, 0, 0);
+  int n = 0;
+
+  /* Each round reads 16 bytes but only consumes 12 of them */
+  while (*ilen >= 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *)*input);
+
+    /* Split 3 bytes into 4 sextets, one per output byte */
+    in = _mm_shuffle_epi8(in, shuf);
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003F03F0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    in = _mm_or_si128(t1, t3);
+
+    /* Translate sextets to characters */
+    __m128i idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    idx = _mm_sub_epi8(idx, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+    in = _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+
+    _mm_storeu_si128((__m128i *)*output, in);
+    *input += 12;
+    *ilen -= 12;
+    *output += 16;
+    n += 16;
   }
-  if (v == '/') {
-    return 63;
+  return n;
+}
+
+__attribute__((target("ssse3")))
+static int decode_ssse3(const unsigned char **input, int *ilen,
+                        char **out, int *olen)
+{
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+                                       0x1B, 0x1B, 0x1B, 0x1A);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                                       0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                       0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                         0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8(0x2F);
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                     14, 13, 12, -1, -1, -1, -1);
+  int n = 0;
+
+  /* Each round stores 16 bytes but only produces 12 of them */
+  while (*ilen >= 16 && *olen >= 16) {
+    __m128i str = _mm_loadu_si128((const __m128i *)*input);
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+    __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+
+    /* Leave invalid characters and padding to the scalar code */
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi),
+                                         _mm_setzero_si128()))) {
+      break;
+    }
+
+    __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+    str = _mm_add_epi8(str, roll);
+
+    /* Pack 4 sextets into 3 bytes */
+    str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+    str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+    str = _mm_shuffle_epi8(str, pack);
+
+    _mm_storeu_si128((__m128i *)*out, str);
+    *input += 16;
+    *ilen -= 16;
+    *out += 12;
+    *olen -= 12;
+    n += 12;
   }
-  return INVALID_CHAR;
+  return n;
+}
 
+__attribute__((target("avx2")))
+static int decode_avx2(const unsigned char **input, int *ilen,
+                       char **out, int *olen)
+{
+  const __m256i lut_lo = _mm256_setr_epi8(
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m256i lut_hi = _mm256_setr_epi8(
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+  const __m256i pack = _mm256_setr_epi8(
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+  int n = 0;
+
+  /* Each round stores 32 bytes but only produces 24 of them */
+  while (*ilen >= 32 && *olen >= 32) {
+    __m256i str = _mm256_loadu_si256((const __m256i *)*input);
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+
+    /* Leave invalid characters and padding to the scalar code */
+    if (!_mm256_testz_si256(lo, hi)) {
+      break;
+    }
+
+    __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    __m256i roll = _mm256_shuffle_epi8(lut_roll,
+                                       _mm256_add_epi8(eq_2f, hi_nibbles));
+    str = _mm256_add_epi8(str, roll);
+
+    /* Pack 4 sextets into 3 bytes, then the two lanes together */
+    str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+    str = _mm256_shuffle_epi8(str, pack);
+    str = _mm256_permutevar8x32_epi32(str, lanes);
+
+    _mm256_storeu_si256((__m256i *)*out, str);
+    *input += 32;
+    *ilen -= 32;
+    *out += 24;
+    *olen -= 24;
+    n += 24;
+  }
+  return n;
 }
 
+#endif
+
 int base64_encode(const char *input, int ilen, char *output, int olen)
 {
   int calc_len = (ilen + 2) / 3 * 4;
+  const unsigned char *in = (const unsigned char *)input;
   int i = 0;
 
   if (olen < calc_len) {
     return B64_OVERFLOW;
   }
+#ifdef B64_SIMD
+  if (get_simd_level() >= 1) {
+    i += encode_ssse3(&in, &ilen, &output);
+  }
+#endif
   while (ilen >= 3) {
-    uint32_t v = (((uint32_t)input[0]) << 16) +
-      (((uint32_t)input[1]) << 8) + input[2];
-    output[i] = encode(v >> 18);
-    output[i + 1] = encode((v >> 12) & 0x3f);
-    output[i + 2] = encode((v >> 6) & 0x3f);
-    output[i + 3] = encode(v & 0x3f);
+    uint32_t v = (((uint32_t)in[0]) << 16) +
+      (((uint32_t)in[1]) << 8) + in[2];
+    output[0] = encode(v >> 18);
+    output[1] = encode((v >> 12) & 0x3f);
+    output[2] = encode((v >> 6) & 0x3f);
+    output[3] = encode(v & 0x3f);
     i += 4;
-    input += 3;
+    output += 4;
+    in += 3;
     ilen -= 3;
   }
   if (ilen > 0) {
-    uint32_t v = ((uint32_t)input[0]) << 16;
+    uint32_t v = ((uint32_t)in[0]) << 16;
     if (ilen == 2) {
-      v += ((uint32_t)input[1]) << 8;
+      v += ((uint32_t)in[1]) << 8;
     }
-    output[i] = encode(v >> 18);
-    output[i + 1] = encode((v >> 12) & 0x3f);
+    output[0] = encode(v >> 18);
+    output[1] = encode((v >> 12) & 0x3f);
     if (ilen == 1) {
-      output[i + 2] = '=';
+      output[2] = '=';
     } else {
-      output[i + 2] = encode((v >> 6) & 0x3f);
+      output[2] = encode((v >> 6) & 0x3f);
     }
-    output[i+3] = '=';
+    output[3] = '=';
     i += 4;
   }
   return i;
 }
 
-static int decode_chars(const char *input, int num)
+/*
+ * Decode one complete quantum of 4 characters, which may end in
+ * padding; return the number of bytes written or an error.
+ */
+static int decode_quantum(base64_decoder *dec, const unsigned char *q,
+                          char *out, int olen)
 {
-  int i;
-  int dec_v = 0;
-  int step = 18;
+  int a = decode_table[q[0]];
+  int b = decode_table[q[1]];
+  int c = decode_table[q[2]];
+  int d = decode_table[q[3]];
+  int n;
+
+  if (dec->done || a < 0 || b < 0) {
+    /* no data may follow padding */
+    return B64_INVALID_CHAR;
+  }
+  if (c >= 0 && d >= 0) {
+    n = 3;
+  } else if (c >= 0 && d == PAD_CHAR) {
+    n = 2;
+  } else if (c == PAD_CHAR && d == PAD_CHAR) {
+    n = 1;
+  } else {
+    return B64_INVALID_CHAR;
+  }
+  if (olen < n) {
+    return B64_OVERFLOW;
+  }
 
-  for (i = 0; i < num; i += 1, step -= 6) {
-    int v = decode(input[i]);
-    if (v == INVALID_CHAR) {
-      return B64_INVALID_CHAR;
-    }
-    dec_v += v << step;
+  uint32_t v = (a << 18) | (b << 12) | ((c & 0x3f) << 6) | (d & 0x3f);
+  out[0] = v >> 16;
+  if (n > 1) {
+    out[1] = (v >> 8) & 0xff;
   }
-  return dec_v;
+  if (n > 2) {
+    out[2] = v & 0xff;
+  } else {
+    dec->done = 1;
+  }
+  return n;
+}
+
+void base64_decode_begin(base64_decoder *dec)
+{
+  dec->n = 0;
+  dec->done = 0;
+  dec->error = 0;
 }
 
-static int do_decode(const char *input, int ilen, char *out)
+/*
+ * Incremental decoding: input may be passed in arbitrary pieces.
+ * Returns the number of bytes written, or a (sticky) error.
+ * A trailing incomplete quantum is never decoded, like with
+ * base64_decode_clip.
+ */
+int base64_decode_update(base64_decoder *dec, const char *input, int ilen,
+                         char *out, int olen)
 {
+  const unsigned char *in = (const unsigned char *)input;
   int i = 0;
-  int dec_v;
 
-  while (ilen >= 4) {
-    dec_v = decode_chars(input, 4);
-    if (dec_v < 0) {
-      return dec_v;
-    }
-    out[i] = dec_v >> 16;
-    out[i + 1] = (dec_v >> 8) & 0xff;
-    out[i + 2] = dec_v & 0xff;
-    i += 3;
-    ilen -= 4;
-    input += 4;
+  if (dec->error) {
+    return dec->error;
   }
-  if (ilen >= 2) {
-    dec_v = decode_chars(input, ilen);
-    out[i] = dec_v >> 16;
-    i += 1;
-    if (ilen == 3) {
-      out[i] = dec_v >> 8;
-      i += 1;
+  while (ilen > 0) {
+    /* Fast paths, for complete quanta of plain characters */
+    if (dec->n == 0 && !dec->done) {
+#ifdef B64_SIMD
+      int level = get_simd_level();
+      if (level >= 2) {
+        i += decode_avx2(&in, &ilen, &out, &olen);
+      }
+      if (level >= 1) {
+        i += decode_ssse3(&in, &ilen, &out, &olen);
+      }
+#endif
+      while (ilen >= 4 && olen >= 3) {
+        int a = decode_table[in[0]];
+        int b = decode_table[in[1]];
+        int c = decode_table[in[2]];
+        int d = decode_table[in[3]];
+        if ((a | b | c | d) < 0) {
+          break;
+        }
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        out[0] = v >> 16;
+        out[1] = (v >> 8) & 0xff;
+        out[2] = v & 0xff;
+        in += 4;
+        ilen -= 4;
+        out += 3;
+        olen -= 3;
+        i += 3;
+      }
+      if (!ilen) {
+        break;
+      }
+    }
+
+    /* Collect a quantum that is split or contains special characters */
+    dec->quantum[dec->n++] = *in++;
+    ilen--;
+    if (dec->n == 4) {
+      int n = decode_quantum(dec, (unsigned char *)dec->quantum, out, olen);
+      if (n < 0) {
+        dec->error = n;
+        return n;
+      }
+      dec->n = 0;
+      out += n;
+      olen -= n;
+      i += n;
     }
-  } else if (ilen == 1) {
-    /* It is a bug */
-    return B64_INTERNAL_ERROR;
   }
   return i;
 }
@@ -144,9 +399,8 @@ int base64_decode_clip(const char *input, int ilen, char *out, int olen)
 
 int base64_decode(const char *input, int ilen, char *out, int olen)
 {
+  base64_decoder dec;
   int dec_len;
-  int encode_len;
-  int out_len;
 
   if (ilen == 0) {
     return 0;
@@ -155,23 +409,17 @@ int base64_decode(const char *input, int ilen, char *out, int olen)
     return B64_INVALID_LEN;
   }
   dec_len = ilen / 4 * 3;
-  encode_len = ilen;
   if (input[ilen - 1] == '=') {
     dec_len -= 1;
-    encode_len -= 1;
   }
   if (input[ilen - 2] == '=') {
     dec_len -= 1;
-    encode_len -= 1;
   }
   if (olen < dec_len) {
     return B64_INVALID_LEN;
   }
-  out_len = do_decode(input, encode_len, out);
-  if (out_len != dec_len) {
-    return B64_INTERNAL_INVALID_LEN;
-  }
-  return out_len;
+  base64_decode_begin(&dec);
+  return base64_decode_update(&dec, input, ilen, out, olen);
 }
 
 
@@ -263,13 +511,240 @@ static void test_decode(void)
   printf("Decode PASSED\n");
 }
 
+/*
+ * Reference: the previous, character by character decoder.
+ * Note that it did not validate the final group of padded input,
+ * so the fuzz test does not corrupt characters in that group.
+ */
+static int ref_decode_char(char v)
+{
+  if (v >= 'A' && v <= 'Z') {
+    return v - 'A';
+  }
+  if (v >= 'a' && v <= 'z') {
+    return v - 'a' + 26;
+  }
+  if (v >= '0' && v <= '9') {
+    return v - '0' + 52;
+  }
+  if (v == '+') {
+    return 62;
+  }
+  if (v == '/') {
+    return 63;
+  }
+  return INVALID_CHAR;
+}
+
+static int ref_decode_chars(const char *input, int num)
+{
+  int i;
+  int dec_v = 0;
+  int step = 18;
+
+  for (i = 0; i < num; i += 1, step -= 6) {
+    int v = ref_decode_char(input[i]);
+    if (v == INVALID_CHAR) {
+      return B64_INVALID_CHAR;
+    }
+    dec_v += v << step;
+  }
+  return dec_v;
+}
+
+static int ref_do_decode(const char *input, int ilen, char *out)
+{
+  int i = 0;
+  int dec_v;
+
+  while (ilen >= 4) {
+    dec_v = ref_decode_chars(input, 4);
+    if (dec_v < 0) {
+      return dec_v;
+    }
+    out[i] = dec_v >> 16;
+    out[i + 1] = (dec_v >> 8) & 0xff;
+    out[i + 2] = dec_v & 0xff;
+    i += 3;
+    ilen -= 4;
+    input += 4;
+  }
+  if (ilen >= 2) {
+    dec_v = ref_decode_chars(input, ilen);
+    out[i] = dec_v >> 16;
+    i += 1;
+    if (ilen == 3) {
+      out[i] = dec_v >> 8;
+      i += 1;
+    }
+  } else if (ilen == 1) {
+    return B64_INTERNAL_ERROR;
+  }
+  return i;
+}
+
+static int ref_decode_clip(const char *input, int ilen, char *out, int olen)
+{
+  int dec_len;
+  int encode_len;
+  int out_len;
+
+  ilen = ilen / 4 * 4;
+  if (ilen == 0) {
+    return 0;
+  }
+  dec_len = ilen / 4 * 3;
+  encode_len = ilen;
+  if (input[ilen - 1] == '=') {
+    dec_len -= 1;
+    encode_len -= 1;
+  }
+  if (input[ilen - 2] == '=') {
+    dec_len -= 1;
+    encode_len -= 1;
+  }
+  if (olen < dec_len) {
+    return B64_INVALID_LEN;
+  }
+  out_len = ref_do_decode(input, encode_len, out);
+  if (out_len != dec_len) {
+    return B64_INTERNAL_INVALID_LEN;
+  }
+  return out_len;
+}
+
+#define FUZZ_MAX 1000
+
+/*
+ * Compare base64_decode_clip and the incremental decoder, fed in
+ * random pieces, with the reference decoder, on random encodings
+ * that are randomly truncated and corrupted.
+ */
+static void test_fuzz(void)
+{
+  static char data[FUZZ_MAX], enc[FUZZ_MAX * 2], ref[FUZZ_MAX], out[FUZZ_MAX];
+  static const char bad[] = " \n\r.-_*=\x80\xff";
+  int round;
+
+  srand(4711);
+  for (round = 0; round < 200000; round += 1) {
+    int len = rand() % (round < 1000 ? 40 : FUZZ_MAX / 4 * 3);
+    int i;
+
+    for (i = 0; i < len; i += 1) {
+      data[i] = rand();
+    }
+    int elen = base64_encode(data, len, enc, sizeof(enc));
+    int intact = 1;
+    if (elen > 0 && rand() % 3 == 0) {
+      elen -= rand() % 4;
+      intact = 0;
+    }
+    int last = elen / 4 * 4 - 4;  /* start of the final decoded group */
+    if (last > 0 && rand() % 4 == 0) {
+      enc[rand() % last] = bad[rand() % (sizeof(bad) - 1)];
+      intact = 0;
+    }
+
+    int rlen = ref_decode_clip(enc, elen, ref, sizeof(ref));
+    int clen = base64_decode_clip(enc, elen, out, sizeof(out));
+    if ((rlen < 0) != (clen < 0) ||
+        (rlen >= 0 && (rlen != clen || memcmp(ref, out, rlen)))) {
+      error("Round %d: decode_clip %.*s returns %d, expect %d\n",
+            round, elen, enc, clen, rlen);
+    }
+    if (intact && (rlen != len || memcmp(ref, data, len))) {
+      error("Round %d: decode of %d bytes returns %d\n", round, len, rlen);
+    }
+
+    base64_decoder dec;
+    int ilen = 0, olen = 0, ret = 0;
+    base64_decode_begin(&dec);
+    while (ilen < elen && ret >= 0) {
+      int n = 1 + rand() % (rand() % 2 ? 8 : 100);
+      if (n > elen - ilen) {
+        n = elen - ilen;
+      }
+      ret = base64_decode_update(&dec, enc + ilen, n, out + olen,
+                                 BASE64_DECODE_SPACE(n));
+      ilen += n;
+      olen += ret;
+    }
+    if ((rlen < 0) != (ret < 0) ||
+        (rlen >= 0 && (rlen != olen || memcmp(ref, out, rlen)))) {
+      error("Round %d: incremental decode of %.*s returns %d, expect %d\n",
+            round, elen, enc, ret < 0 ? ret : olen, rlen);
+    }
+  }
+  printf("Fuzz PASSED\n");
+}
+
+#include <time.h>
+
+static double seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void benchmark(void)
+{
+  int len = 30 * 1024 * 1024;
+  char *data = malloc(len);
+  char *enc = malloc(len / 3 * 4 + 4);
+  char *out = malloc(len + 32);
+  int i, elen, olen;
+  double t;
+
+  for (i = 0; i < len; i += 1) {
+    data[i] = rand();
+  }
+
+  t = seconds();
+  elen = base64_encode(data, len, enc, len / 3 * 4 + 4);
+  printf("encode       %7.1f MB/s\n", len / (seconds() - t) / 1e6);
+
+  t = seconds();
+  olen = ref_decode_clip(enc, elen, out, len + 32);
+  printf("reference    %7.1f MB/s\n", elen / (seconds() - t) / 1e6);
+
+  t = seconds();
+  olen = base64_decode_clip(enc, elen, out, len + 32);
+  printf("decode       %7.1f MB/s\n", elen / (seconds() - t) / 1e6);
+  if (olen != len || memcmp(out, data, len)) {
+    error("Benchmark decode failed\n");
+  }
+
+  base64_decoder dec;
+  base64_decode_begin(&dec);
+  t = seconds();
+  olen = 0;
+  for (i = 0; i < elen; i += 4093) {
+    int n = elen - i < 4093 ? elen - i : 4093;
+    olen += base64_decode_update(&dec, enc + i, n, out + olen,
+                                 BASE64_DECODE_SPACE(n));
+  }
+  printf("incremental  %7.1f MB/s\n", elen / (seconds() - t) / 1e6);
+  if (olen != len || memcmp(out, data, len)) {
+    error("Benchmark incremental decode failed\n");
+  }
+
+  free(data);
+  free(enc);
+  free(out);
+}
+
 int main(int argc, char *argv[])
 {
-  (void)argc;
   (void)argv;
 
   test_encode();
   test_decode();
+  test_fuzz();
+  if (argc > 1) {
+    benchmark();
+  }
 
   return 0;
 }
@@ -15,4 +15,19 @@ int base64_encode(const char *input, int ilen, char *output, int olen);
 int base64_decode(const char *input, int ilen, char *out, int olen);
 int base64_decode_clip(const char *input, int ilen, char *out, int olen);
 
+/* Incremental decoding */
+typedef struct {
+  char quantum[4];  /* pending characters of an incomplete quantum */
+  int n;
+  int done;         /* padding seen, no more data may follow */
+  int error;
+} base64_decoder;
+
+/* Output space needed for decoding ilen more characters */
+#define BASE64_DECODE_SPACE(ilen)	(((ilen) + 3) / 4 * 3)
+
+void base64_decode_begin(base64_decoder *dec);
+int base64_decode_update(base64_decoder *dec, const char *input, int ilen,
+                         char *out, int olen);
+
 #endif
@@ -7,6 +7,7 @@
 
 #include "term.h"
 #include "charset.h"
+#include "asciicast.h"
 
 #include "winpriv.h"  /* win_prefix_title, win_update_now */
 
@@ -17,6 +18,7 @@
 #include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <poll.h>
 #ifdef __CYGWIN__
 #include <sys/cygwin.h>  // cygwin_internal
 #endif
@@ -99,46 +101,56 @@ childerror(struct term* term, char * action, bool from_fork, int errno_code, int
   }
 }
 
+/*
+   Expand a log file name setting: ~/ for home, %d for the process id,
+   or strftime(3) formats.
+ */
+static char *
+log_path(wstring name)
+{
+  // use cygwin conversion function to escape unencoded characters 
+  // and thus avoid the locale trick (2.2.3)
+  char * log;
+  if (*name == '~' && name[1] == '/') {
+    // substitute '~' -> home
+    char * path = cs__wcstombs(&name[2]);
+    log = asform("%s/%s", home, path);
+    free(path);
+  }
+  else
+    log = path_win_w_to_posix(name);
+#ifdef debug_logfilename
+  printf("<%ls> -> <%s>\n", name, log);
+#endif
+  char * format = strchr(log, '%');
+  if (format && * ++ format == 'd' && !strchr(format, '%')) {
+    char * logf = newn(char, strlen(log) + 20);
+    sprintf(logf, log, getpid());
+    free(log);
+    log = logf;
+  }
+  else if (format) {
+    struct timeval now;
+    gettimeofday(& now, 0);
+    char * logf = newn(char, MAX_PATH + 1);
+    strftime(logf, MAX_PATH, log, localtime (& now.tv_sec));
+    free(log);
+    log = logf;
+  }
+  return log;
+}
+
 void
 open_logfile(bool toggling)
 {
   // Open log file if any
   if (*cfg.log) {
-    // use cygwin conversion function to escape unencoded characters 
-    // and thus avoid the locale trick (2.2.3)
-
     if (0 == wcscmp(cfg.log, W("-"))) {
       child_log_fd = fileno(stdout);
       logging = true;
     }
     else {
-      char * log;
-      if (*cfg.log == '~' && cfg.log[1] == '/') {
-        // substitute '~' -> home
-        char * path = cs__wcstombs(&cfg.log[2]);
-        log = asform("%s/%s", home, path);
-        free(path);
-      }
-      else
-        log = path_win_w_to_posix(cfg.log);
-#ifdef debug_logfilename
-      printf("<%ls> -> <%s>\n", cfg.log, log);
-#endif
-      char * format = strchr(log, '%');
-      if (format && * ++ format == 'd' && !strchr(format, '%')) {
-        char * logf = newn(char, strlen(log) + 20);
-        sprintf(logf, log, getpid());
-        free(log);
-        log = logf;
-      }
-      else if (format) {
-        struct timeval now;
-        gettimeofday(& now, 0);
-        char * logf = newn(char, MAX_PATH + 1);
-        strftime(logf, MAX_PATH, log, localtime (& now.tv_sec));
-        free(log);
-        log = logf;
-      }
+      char * log = log_path(cfg.log);
 
       child_log_fd = open(log, O_WRONLY | O_CREAT | O_EXCL, 0600);
       if (child_log_fd < 0) {
@@ -163,14 +175,47 @@ open_logfile(bool toggling)
         free(upath);
         free(wpath);
       }
-      else
+      else {
         logging = true;
+        if (cfg.log_timing) {
+          // timing file for scriptreplay
+          char * timing = asform("%s.timing", log);
+          child_timing_fd = open(timing, O_WRONLY | O_CREAT | O_EXCL, 0600);
+          free(timing);
+        }
+      }
 
       free(log);
     }
   }
 }
 
+/*
+   Start an asciicast recording of a new tab; tabs after the first
+   get a number added to the file name.
+ */
+static void
+open_recording(struct child* child, struct winsize *winp)
+{
+  char * path = log_path(cfg.record);
+  char * ext = strrchr(path, '.');
+  if (!ext || strchr(ext, '/'))
+    ext = strchr(path, 0);
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  for (int n = 2; fd < 0 && errno == EEXIST && n < 1000; n++) {
+    char * numbered = asform("%.*s-%d%s", (int)(ext - path), path, n, ext);
+    fd = open(numbered, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    free(numbered);
+  }
+  if (fd < 0) {
+    childerror(child->term, _("Error: Could not open recording file"), false, errno, 0);
+    childerror(child->term, path, false, 0, 0);
+  }
+  else
+    child_record(child, fd, winp->ws_col, winp->ws_row);
+  free(path);
+}
+
 void
 toggle_logging()
 {
@@ -295,6 +340,14 @@ child_create(struct child* child, struct term* term,
     attr.c_lflag |= ECHOE | ECHOK | ECHOCTL | ECHOKE;
     tcsetattr(0, TCSANOW, &attr);
 
+    if (*cfg.replay) {
+      // Play back a recording instead of running a command;
+      // pass its output through unchanged
+      cfmakeraw(&attr);
+      tcsetattr(0, TCSANOW, &attr);
+      cast_replay(path_win_w_to_posix(cfg.replay), cfg.replay_speed);
+    }
+
     if (path)
       chdir(path);
 
@@ -329,6 +382,12 @@ child_create(struct child* child, struct term* term,
     child->pid = pid;
 
     fcntl(child->pty_fd, F_SETFL, O_NONBLOCK);
+    child_fds_changed();
+
+    if (*cfg.record)
+      open_recording(child, winp);
+    if (*cfg.replay)
+      child_replay(child);
 
     child_update_charset(child);
 
@@ -364,9 +423,16 @@ child_create(struct child* child, struct term* term,
 void
 child_free(struct child* child)
 {
-  if (child->pty_fd >= 0)
+  child_stop_reader(child);
+  child_close_log(child);
+  if (child->pty_fd >= 0) {
     close(child->pty_fd);
+    child_fds_changed();
+  }
   child->pty_fd = -1;
+  free(child->out);
+  child->out = 0;
+  child->out_len = child->out_pos = 0;
 }
 
 bool
@@ -406,11 +472,91 @@ child_is_parent(struct child* child)
   return res;
 }
 
+#define CHILD_OUT_MAX (1 << 20)
+
+/*
+  Write to the pty without blocking; what it does not take right away
+  is queued, and child_proc writes it out when the pty becomes writable.
+ */
 void
 child_write(struct child* child, const char *buf, uint len)
 {
-  if (child->pty_fd >= 0)
-    write(child->pty_fd, buf, len);
+  if (child->pty_fd < 0 || !len)
+    return;
+  if (!child->out) {
+    int n = child_try_write(child, buf, len);
+    if (n < 0)
+      return;
+    buf += n;
+    len -= n;
+    if (!len)
+      return;
+  }
+
+  uint queued = child->out_len - child->out_pos;
+  // the child does not read its input; drop rather than grow without limit
+  if (queued + len > CHILD_OUT_MAX)
+    return;
+  if (child->out_pos) {
+    memmove(child->out, child->out + child->out_pos, queued);
+    child->out_pos = 0;
+  }
+  child->out = renewn(child->out, queued + len);
+  memcpy(child->out + queued, buf, len);
+  child->out_len = queued + len;
+}
+
+/*
+  Write queued input, as much as the pty takes without blocking.
+  Return the number of bytes written, or -1 if the pty is gone.
+ */
+int
+child_flush(struct child* child)
+{
+  if (!child->out)
+    return 0;
+  int n = child_try_write(child, child->out + child->out_pos,
+                          child->out_len - child->out_pos);
+  if (n > 0)
+    child->out_pos += n;
+  if (n < 0 || child->out_pos == child->out_len) {
+    free(child->out);
+    child->out = 0;
+    child->out_len = child->out_pos = 0;
+  }
+  return n;
+}
+
+/*
+  Write as much as the pty takes without blocking.
+  Return the number of bytes written, or -1 if the pty is gone.
+ */
+int
+child_try_write(struct child* child, const char *buf, uint len)
+{
+  for (;;) {
+    if (child->pty_fd < 0)
+      return -1;
+    int n = write(child->pty_fd, buf, len);
+    if (n >= 0)
+      return n;
+    if (errno == EAGAIN)
+      return 0;
+    if (errno != EINTR)
+      return -1;
+  }
+}
+
+/*
+  Whether the pty would take input without blocking, with none queued.
+ */
+bool
+child_writable(struct child* child)
+{
+  if (child->pty_fd < 0 || child->out)
+    return false;
+  struct pollfd pfd = {child->pty_fd, POLLOUT, 0};
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLOUT);
 }
 
 /*
@@ -439,7 +585,7 @@ child_printf(struct child* child, const char *fmt, ...)
     int len = vasprintf(&s, fmt, va);
     va_end(va);
     if (len >= 0)
-      write(child->pty_fd, s, len);
+      child_write(child, s, len);
     free(s);
   }
 }
@@ -467,6 +613,7 @@ child_resize(struct child* child, struct winsize *winp)
 {
   if (child->pty_fd >= 0)
     ioctl(child->pty_fd, TIOCSWINSZ, winp);
+  child_record_resize(child, winp->ws_col, winp->ws_row);
 }
 
 static int
@@ -749,6 +896,8 @@ do_child_fork(struct child* child, int argc, char *argv[], int moni, bool launch
       close(child->pty_fd);
     if (child_log_fd >= 0)
       close(child_log_fd);
+    if (child_timing_fd >= 0)
+      close(child_timing_fd);
     close(child_win_fd);
 
     if (child->dir && *child->dir) {
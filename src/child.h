@@ -17,6 +17,13 @@ struct child
   pid_t pid;
   bool killed;
   int pty_fd;
+  char *out;     // input the pty has not taken yet, null if none
+  uint out_len, out_pos;
+  bool stalled;  // pty signalled writable but took nothing
+  void *reader;  // pty reader thread state
+  void *log;     // log sink
+  void *record;  // asciicast recording sink
+  void *replay;  // replay timing
   struct term* term;
 };
 
@@ -27,9 +34,22 @@ extern void open_logfile(bool toggling);
 extern void toggle_logging(void);
 extern void child_free(struct child* child);
 extern void child_proc(void);
+extern void child_fds_changed(void);
+extern void child_stop_reader(struct child* child);
+extern void child_wakeup(void);
+extern void child_close_log(struct child* child);
+extern void child_record(struct child* child, int fd, int cols, int rows);
+extern void child_record_resize(struct child* child, int cols, int rows);
+extern void child_replay(struct child* child);
+extern unsigned long long child_clock(void);
+extern void child_paint_timing(unsigned long long us);
+extern void child_startup_mark(const char * phase);
 extern void child_kill(void);
 extern void child_terminate(struct child* child);
 extern void child_write(struct child* child, const char *, uint len);
+extern int child_try_write(struct child* child, const char *, uint len);
+extern int child_flush(struct child* child);
+extern bool child_writable(struct child* child);
 extern void child_break(struct child* child);
 extern void child_printf(struct child* child, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
 extern void child_send(struct child* child, const char *, uint len);
@@ -50,6 +70,7 @@ void child_init();
 
 extern int child_win_fd;
 extern int child_log_fd;
+extern int child_timing_fd;
 
 //extern void child_kill(bool point_blank);
 //extern char * child_tty(void);
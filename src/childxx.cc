@@ -3,12 +3,19 @@
 #include <cstdlib>
 #include <stdio.h>
 #include <algorithm>
+#include <vector>
+#include <atomic>
 
 #include <cygwin/version.h>
 #include <sys/cygwin.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <errno.h>
 #include <cstring>
 #include <fcntl.h>
 #include <utmp.h>
@@ -18,10 +25,13 @@
 
 int child_win_fd;
 int child_log_fd = -1;
+int child_timing_fd = -1;
 
 extern "C" {
 #include "child.h"
+#include "asciicast.h"
 extern void exit_fatty(int exit_val);
+extern struct term* win_active_terminal();
 
 extern int cs_wcstombs(char *s, const wchar *ws, size_t len);
 
@@ -39,6 +49,20 @@ static void sigexit(int sig) {
     child_onexit(sig);
 }
 
+// Self-pipe that wakes up the child_proc loop when a child exits.
+static int sigchld_pipe[2] = {-1, -1};
+
+// Self-pipe that wakes up the child_proc loop when a reader has data.
+static int wake_pipe[2] = {-1, -1};
+static std::atomic<bool> wake_pending(false);
+
+static void sigchld(int) {
+    int err = errno;
+    if (sigchld_pipe[1] >= 0)
+        write(sigchld_pipe[1], "", 1);
+    errno = err;
+}
+
 void child_init() {
     // xterm and urxvt ignore SIGHUP, so let's do the same.
     signal(SIGHUP, SIG_IGN);
@@ -47,6 +71,26 @@ void child_init() {
     signal(SIGTERM, sigexit);
     signal(SIGQUIT, sigexit);
 
+    // Reap terminated children on notification rather than polling for them.
+    if (pipe(sigchld_pipe) == 0) {
+        for (int fd : sigchld_pipe) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        struct sigaction sa;
+        memset(&sa, 0, sizeof sa);
+        sa.sa_handler = sigchld;
+        sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        sigaction(SIGCHLD, &sa, 0);
+    }
+
+    if (pipe(wake_pipe) == 0) {
+        for (int fd : wake_pipe) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
     child_win_fd = open("/dev/windows", O_RDONLY);
 
     // Open log file if any
@@ -56,68 +100,839 @@ void child_init() {
     }
 }
 
-void child_proc() {
-    // this code is ripped from child.c
+// Pty reader threads.
+// Each open pty gets a thread that reads into a single-producer,
+// single-consumer ring. The window thread drains the rings and parses
+// the data with term_write, so a busy tab no longer blocks the input and
+// painting of the others while it waits for the pty.
+
+// Each reader owns a ring buffer that read() fills directly and that
+// term_write parses in place. Reads start small for interactive latency
+// and grow under sustained output; the ring follows the read size.
+#define READER_RING_MIN 16384    // ring sizes must be powers of 2
+#define READER_RING_MAX 524288
+#define READER_READ_MIN 4096
+#define READER_READ_MAX 262144
+
+struct pty_reader {
+    struct child* child;
+    int fd;
+    pthread_t thread;
+    int stop_pipe[2];
+    std::atomic<bool> stop;
+    std::atomic<bool> eof;
+    // The reader thread advances head, the window thread advances tail.
+    std::atomic<uint> head;
+    std::atomic<uint> tail;
+    // The reader thread sleeps on space while the ring is full,
+    // or until it is empty if it wants to resize the ring.
+    std::atomic<bool> waiting;
+    pthread_mutex_t mutex;
+    pthread_cond_t space;
+    // Only replaced by the reader thread while the ring is empty,
+    // and published to the window thread with the next head update.
+    char* ring;
+    uint size;
+    uint chunk;  // current read size
+    // Flow control: the reader stops reading while this much output is
+    // waiting to be parsed, so the kernel holds up the program.
+    std::atomic<uint> limit;
+    uint rate;   // parse rate estimate, bytes per ms
+};
+
+// Space the reader may fill in its ring.
+static uint reader_cap(pty_reader* r) {
+    return std::min(r->size, r->limit.load(std::memory_order_relaxed));
+}
+
+static void reader_notify() {
+    if (!wake_pending.exchange(true))
+        write(wake_pipe[1], "", 1);
+}
+
+// Wait until the window thread has freed space in the ring, or emptied it.
+static void reader_wait(pty_reader* r, uint head, bool empty) {
+    pthread_mutex_lock(&r->mutex);
+    r->waiting.store(true);
+    while (!r->stop.load()) {
+        uint used = head - r->tail.load();
+        if (empty ? !used : used < reader_cap(r))
+            break;
+        pthread_cond_wait(&r->space, &r->mutex);
+    }
+    r->waiting.store(false);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+static void* reader_thread(void* arg) {
+    pty_reader* r = (pty_reader*)arg;
+
+    // Signals are for the window thread.
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, 0);
+
+    struct pollfd fds[2] = {{r->fd, POLLIN, 0}, {r->stop_pipe[0], POLLIN, 0}};
+    while (!r->stop.load()) {
+        uint head = r->head.load(std::memory_order_relaxed);
+        uint used = head - r->tail.load();
+
+        // Fit the ring to the read size; only an empty ring is replaced.
+        uint want = std::max(2 * r->chunk, (uint)READER_RING_MIN);
+        bool resize = want > r->size || (r->size > READER_RING_MIN && r->size >= 8 * r->chunk);
+        if (resize && !used) {
+            free(r->ring);
+            r->size = std::min(want, (uint)READER_RING_MAX);
+            r->ring = (char*)malloc(r->size);
+            continue;
+        }
+        uint cap = reader_cap(r);
+        if (used >= cap) {
+            reader_wait(r, head, resize);
+            continue;
+        }
+
+        uint pos = head & (r->size - 1);
+        uint len = std::min(cap - used, r->size - pos);
+        len = std::min(len, r->chunk);
+        int ret = read(r->fd, r->ring + pos, len);
+        if (ret > 0) {
+            r->head.store(head + ret, std::memory_order_release);
+            reader_notify();
+            // Sustained output fills whole reads; interactive output does not.
+            if ((uint)ret == r->chunk && r->chunk < READER_READ_MAX)
+                r->chunk *= 2;
+            else if ((uint)ret < r->chunk / 4 && r->chunk > READER_READ_MIN)
+                r->chunk /= 2;
+        }
+        else if (ret < 0 && errno == EAGAIN) {
+            // Drained; sleep until the pty has more, or we are stopped.
+            if (poll(fds, 2, -1) < 0 && errno != EINTR)
+                break;
+            if (fds[1].revents)
+                break;
+        }
+        else if (ret < 0 && errno == EINTR)
+            continue;
+        else
+            break;
+    }
+    r->eof.store(true);
+    reader_notify();
+    return 0;
+}
+
+static pty_reader* reader_start(struct child* child) {
+    pty_reader* r = new pty_reader;
+    r->child = child;
+    r->fd = child->pty_fd;
+    r->stop = false;
+    r->eof = false;
+    r->head = 0;
+    r->tail = 0;
+    r->waiting = false;
+    r->size = READER_RING_MIN;
+    r->ring = (char*)malloc(r->size);
+    r->chunk = READER_READ_MIN;
+    r->limit = READER_RING_MAX;
+    r->rate = 0;
+    pthread_mutex_init(&r->mutex, 0);
+    pthread_cond_init(&r->space, 0);
+    if (pipe(r->stop_pipe) == 0) {
+        fcntl(r->stop_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(r->stop_pipe[1], F_SETFD, FD_CLOEXEC);
+        if (pthread_create(&r->thread, 0, reader_thread, r) == 0) {
+            child->reader = r;
+            return r;
+        }
+        close(r->stop_pipe[0]);
+        close(r->stop_pipe[1]);
+    }
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->space);
+    free(r->ring);
+    delete r;
+    return 0;
+}
+
+static void reader_stop(pty_reader* r) {
+    r->stop.store(true);
+    write(r->stop_pipe[1], "", 1);
+    pthread_mutex_lock(&r->mutex);
+    pthread_cond_signal(&r->space);
+    pthread_mutex_unlock(&r->mutex);
+    pthread_join(r->thread, 0);
+
+    close(r->stop_pipe[0]);
+    close(r->stop_pipe[1]);
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->space);
+    free(r->ring);
+    r->child->reader = 0;
+    delete r;
+}
+
+// Stop reading from the pty before child_free closes it.
+void child_stop_reader(struct child* child) {
+    if (child->reader) {
+        reader_stop((pty_reader*)child->reader);
+        child_fds_changed();
+    }
+}
+
+// Readers in round-robin order. The list is only rebuilt when a pty is
+// opened or closed.
+static std::vector<pty_reader*> readers;
+static bool readers_changed = true;
+static bool reap_pending = true;
+
+void child_fds_changed() {
+    readers_changed = true;
+    reap_pending = true;
+}
+
+static void readers_rebuild() {
+    readers.clear();
+    for (Tab& t : win_tabs()) {
+        struct child* child = t.chld.get();
+        if (child->pty_fd >= 0 && !child->reader)
+            reader_start(child);
+        if (child->reader)
+            readers.push_back((pty_reader*)child->reader);
+    }
+    readers_changed = false;
+}
+
+// Collect exited children of tabs whose pty is gone.
+static void reap_children() {
+    reap_pending = false;
+    for (Tab& t : win_tabs()) {
+        if (t.chld->pty_fd < 0 && t.chld->pid) {
+            int status;
+            if (waitpid(t.chld->pid, &status, WNOHANG) == t.chld->pid)
+                t.chld->pid = 0;
+        }
+    }
+}
+
+// Session logging.
+// Logged output goes into a bounded ring per tab, which a writer thread
+// empties into the log file every LogFlushInterval, so a slow disk no
+// longer holds up the terminal. When a ring is full, the tab waits for
+// the writer, or with LogDropOverflow its output is not logged.
+// With LogTiming, the writer also produces a scriptreplay timing file.
+// A recording (Record option) is a sink of its own per tab that the
+// writer stores in asciicast format, with size changes.
+
+#define LOG_RING_SIZE 1048576  // must be a power of 2
+
+struct log_record {
+    uint len;
+    char type;  // 'o' output, 'r' resize
+    unsigned long long time;  // microseconds
+};
+
+struct log_sink {
+    // The window thread advances head, the writer thread advances tail.
+    std::atomic<uint> head;
+    std::atomic<uint> tail;
+    std::atomic<bool> closed;
+    std::atomic<bool> blocked;  // output is waiting for space
+    int fd;
+    bool cast;                  // asciicast recording
+    unsigned long long start;   // time of the recording header
+    log_sink* next;
+    char ring[LOG_RING_SIZE];
+};
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static log_sink* log_sinks = 0;  // guarded by log_mutex
+static bool log_kicked = false;  // guarded by log_mutex
+static bool log_started = false;
+// The process that started the writer; forked children inherit the
+// exit handler, but must neither write the logs again nor take the locks.
+static pid_t log_pid = 0;
+// Held while writing, by the writer thread or the final flush at exit.
+static pthread_mutex_t log_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long log_last = 0;  // time of the previous record
+
+static void log_ring_put(char* ring, uint pos, const void* data, uint len) {
+    pos &= LOG_RING_SIZE - 1;
+    uint n = std::min(len, LOG_RING_SIZE - pos);
+    memcpy(ring + pos, data, n);
+    memcpy(ring, (const char*)data + n, len - n);
+}
+
+static void log_ring_get(const char* ring, uint pos, void* data, uint len) {
+    pos &= LOG_RING_SIZE - 1;
+    uint n = std::min(len, LOG_RING_SIZE - pos);
+    memcpy(data, ring + pos, n);
+    memcpy((char*)data + n, ring, len - n);
+}
+
+static void log_write(int fd, const char* data, uint len) {
+    while (len) {
+        int ret = write(fd, data, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return;  // nothing sensible to do about a failing log
+        data += ret;
+        len -= ret;
+    }
+}
+
+static unsigned long long log_time() {
+    struct timeval now;
+    gettimeofday(&now, 0);
+    return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+// Write a record as an asciicast event line.
+static void log_cast(log_sink* s, log_record* rec, uint pos) {
+    static std::vector<char> data, line;
+    data.resize(rec->len + 1);
+    line.resize(48 + CAST_ESCAPE_SPACE(rec->len));
+    log_ring_get(s->ring, pos, &data[0], rec->len);
+
+    unsigned long long t = rec->time > s->start ? rec->time - s->start : 0;
+    int len = sprintf(&line[0], "[%llu.%06llu, \"%c\", \"",
+                      t / 1000000, t % 1000000, rec->type);
+    len += cast_escape(&data[0], rec->len, &line[len]);
+    len += sprintf(&line[len], "\"]\n");
+    log_write(s->fd, &line[0], len);
+}
+
+// Write out the records of a sink; called with log_write_mutex held.
+static void log_flush_sink(log_sink* s) {
+    char timing[4096];
+    uint tlen = 0;
+    uint tail = s->tail.load(std::memory_order_relaxed);
+    uint head = s->head.load(std::memory_order_acquire);
+    while (head != tail) {
+        log_record rec;
+        log_ring_get(s->ring, tail, &rec, sizeof rec);
+        uint pos = (tail + sizeof rec) & (LOG_RING_SIZE - 1);
+        tail += sizeof rec + rec.len;
+        if (s->cast) {
+            log_cast(s, &rec, pos);
+            continue;
+        }
+
+        uint n = std::min(rec.len, LOG_RING_SIZE - pos);
+        log_write(s->fd, s->ring + pos, n);
+        log_write(s->fd, s->ring, rec.len - n);
+
+        if (child_timing_fd >= 0) {
+            if (tlen > sizeof timing - 40) {
+                log_write(child_timing_fd, timing, tlen);
+                tlen = 0;
+            }
+            // tabs are written one after the other, so times may go back
+            unsigned long long delay = 0;
+            if (log_last && rec.time > log_last)
+                delay = rec.time - log_last;
+            log_last = std::max(log_last, rec.time);
+            tlen += sprintf(timing + tlen, "%llu.%06llu %u\n",
+                            delay / 1000000, delay % 1000000, rec.len);
+        }
+    }
+    if (tlen)
+        log_write(child_timing_fd, timing, tlen);
+    s->tail.store(tail);
+    if (s->blocked.exchange(false))
+        child_wakeup();
+}
+
+static void log_flush_all() {
+    if (getpid() != log_pid)
+        return;
+    pthread_mutex_lock(&log_write_mutex);
+    pthread_mutex_lock(&log_mutex);
+    for (log_sink* s = log_sinks; s; s = s->next)
+        log_flush_sink(s);
+    pthread_mutex_unlock(&log_mutex);
+    pthread_mutex_unlock(&log_write_mutex);
+}
+
+static void* log_thread(void*) {
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, 0);
+
+    std::vector<log_sink*> sinks;
     for (;;) {
-        for (Tab& t : win_tabs()) {
-            if (t.terminal->paste_buffer)
-                term_send_paste(t.terminal.get());
+        pthread_mutex_lock(&log_mutex);
+        if (!log_kicked) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            long ms = std::max(cfg.log_flush, 1);
+            until.tv_sec += ms / 1000;
+            until.tv_nsec += (ms % 1000) * 1000000;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&log_cond, &log_mutex, &until);
+        }
+        log_kicked = false;
+        // Take the sinks to write, and free the closed ones that are done.
+        sinks.clear();
+        for (log_sink** pp = &log_sinks; *pp;) {
+            log_sink* s = *pp;
+            if (s->closed.load() && s->head.load() == s->tail.load()) {
+                *pp = s->next;
+                if (s->cast)
+                    close(s->fd);
+                delete s;
+            }
+            else {
+                sinks.push_back(s);
+                pp = &s->next;
+            }
+        }
+        pthread_mutex_unlock(&log_mutex);
+
+        pthread_mutex_lock(&log_write_mutex);
+        for (log_sink* s : sinks)
+            log_flush_sink(s);
+        pthread_mutex_unlock(&log_write_mutex);
+    }
+    return 0;
+}
+
+static void log_kick() {
+    pthread_mutex_lock(&log_mutex);
+    log_kicked = true;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_mutex);
+}
+
+static log_sink* log_open(int fd, bool cast) {
+    log_sink* s = new log_sink;
+    s->head = 0;
+    s->tail = 0;
+    s->closed = false;
+    s->blocked = false;
+    s->fd = fd;
+    s->cast = cast;
+    s->start = log_time();
+    pthread_mutex_lock(&log_mutex);
+    s->next = log_sinks;
+    log_sinks = s;
+    pthread_mutex_unlock(&log_mutex);
+
+    if (!log_started) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, log_thread, 0) == 0) {
+            pthread_detach(thread);
+            log_pid = getpid();
+            atexit(log_flush_all);
+        }
+        log_started = true;
+    }
+    return s;
+}
+
+static void log_close(log_sink* s) {
+    if (s) {
+        s->closed.store(true);
+        log_kick();
+    }
+}
+
+// Hand the sinks of a closing tab to the writer, which frees them when done.
+void child_close_log(struct child* child) {
+    log_close((log_sink*)child->log);
+    log_close((log_sink*)child->record);
+    child->log = 0;
+    child->record = 0;
+}
+
+// Space for output in a sink; if there is none, have the writer wake up
+// child_proc when it has made some.
+static uint log_room(log_sink* s) {
+    uint head = s->head.load(std::memory_order_relaxed);
+    uint used = head - s->tail.load();
+    if (used + sizeof(log_record) < LOG_RING_SIZE)
+        return LOG_RING_SIZE - used - sizeof(log_record);
+    // check again in case the writer has just finished
+    s->blocked.store(true);
+    used = head - s->tail.load();
+    if (used + sizeof(log_record) < LOG_RING_SIZE) {
+        s->blocked.store(false);
+        return LOG_RING_SIZE - used - sizeof(log_record);
+    }
+    log_kick();
+    return 0;
+}
+
+static void log_put(log_sink* s, char type, const char* data, uint len) {
+    uint head = s->head.load(std::memory_order_relaxed);
+    uint used = head - s->tail.load();
+    log_record rec;
+    rec.len = len;
+    rec.type = type;
+    rec.time = log_time();
+    log_ring_put(s->ring, head, &rec, sizeof rec);
+    log_ring_put(s->ring, head + sizeof rec, data, len);
+    s->head.store(head + sizeof rec + len, std::memory_order_release);
+
+    // Do not wait for the flush interval with a filling ring.
+    if (used < LOG_RING_SIZE / 2 && used + sizeof rec + len >= LOG_RING_SIZE / 2)
+        log_kick();
+}
+
+// Log and record pty output of a tab; return how much of it was taken,
+// which is less than len only while a sink is full and must not drop.
+static uint log_output(struct child* child, const char* data, uint len) {
+    log_sink* sinks[2] = {0, (log_sink*)child->record};
+    if (logging && child_log_fd >= 0) {
+        if (!child->log)
+            child->log = log_open(child_log_fd, false);
+        sinks[0] = (log_sink*)child->log;
+    }
+
+    bool skip[2] = {false, false};
+    for (int i = 0; i < 2; i++) {
+        if (!sinks[i])
+            continue;
+        uint room = log_room(sinks[i]);
+        if (room >= len)
+            continue;
+        if (cfg.log_drop)
+            skip[i] = true;
+        else
+            len = room;
+    }
+    if (!len)
+        return 0;
+    for (int i = 0; i < 2; i++) {
+        if (sinks[i] && !skip[i])
+            log_put(sinks[i], 'o', data, len);
+    }
+    return len;
+}
+
+// Start an asciicast recording of a tab into fd.
+void child_record(struct child* child, int fd, int cols, int rows) {
+    char header[200];
+    int len = sprintf(header,
+        "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %ld, "
+        "\"env\": {\"TERM\": \"%s\"}}\n",
+        cols, rows, (long)time(0), cfg.term);
+    log_write(fd, header, len);
+    child->record = log_open(fd, true);
+}
+
+// Note a size change in the recording of a tab.
+void child_record_resize(struct child* child, int cols, int rows) {
+    log_sink* s = (log_sink*)child->record;
+    if (s) {
+        char size[24];
+        int len = sprintf(size, "%dx%d", cols, rows);
+        // a full recording loses the size change rather than wait
+        if (log_room(s) >= (uint)len)
+            log_put(s, 'r', size, len);
+    }
+}
+
+// Replay timing.
+// A tab replaying a recording (Replay option) measures the time spent
+// parsing its output; painting is measured while any replay is running.
+// The totals are shown when the replay ends.
+
+struct replay_stats {
+    unsigned long long start;
+    unsigned long long parse;
+    unsigned long long bytes;
+    unsigned long long paint;
+    uint paints;
+};
+
+static uint replaying = 0;
+static unsigned long long paint_time = 0;
+static uint paint_count = 0;
+
+// Monotonic clock in microseconds.
+unsigned long long child_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// Startup timing, reported with FATTY_DEBUG containing "s": the time
+// of each phase since launch, up to the first output of a shell.
+static unsigned long long startup_start = 0, startup_last = 0;
+static bool startup_done = false;
+
+void child_startup_mark(const char* phase) {
+    if (startup_done)
+        return;
+    unsigned long long now = child_clock();
+    if (!startup_start) {
+        const char* debug = getenv("FATTY_DEBUG");
+        if (!debug || !strchr(debug, 's')) {
+            startup_done = true;
+            return;
+        }
+        startup_start = startup_last = now;
+    }
+    printf("startup: %-14s %8.1f ms  +%.1f ms\n", phase,
+           (now - startup_start) / 1e3, (now - startup_last) / 1e3);
+    fflush(stdout);
+    startup_last = now;
+    if (!strcmp(phase, "first output"))
+        startup_done = true;
+}
+
+void child_paint_timing(unsigned long long us) {
+    if (replaying) {
+        paint_time += us;
+        paint_count++;
+    }
+}
+
+void child_replay(struct child* child) {
+    replay_stats* st = new replay_stats;
+    st->start = child_clock();
+    st->parse = 0;
+    st->bytes = 0;
+    st->paint = paint_time;
+    st->paints = paint_count;
+    child->replay = st;
+    replaying++;
+}
+
+static void replay_report(struct child* child) {
+    replay_stats* st = (replay_stats*)child->replay;
+    double total = (child_clock() - st->start) / 1e6;
+    double parse = st->parse / 1e6;
+    char report[300];
+    int len = sprintf(report,
+        "\r\n\e[1mReplay:\e[m %llu bytes in %.3f s, parse %.3f s (%.1f MB/s), "
+        "%u paints %.3f s\r\n",
+        st->bytes, total, parse, parse > 0 ? st->bytes / parse / 1e6 : 0.0,
+        paint_count - st->paints, (paint_time - st->paint) / 1e6);
+    term_write(child->term, report, len);
+    fputs(report + 2, stdout);
+    fflush(stdout);
+
+    delete st;
+    child->replay = 0;
+    replaying--;
+}
+
+// Maximum bytes parsed from one tab per round, so that a flooding tab
+// cannot starve the others; anything left over is taken next round.
+#define CHILD_READ_BUDGET 65536
+
+// Flow control.
+// A round of parsing takes about FLOW_FRAME, then window messages are
+// handled, so that typing and painting keep going during a flood.
+// The focused tab gets half of a round, the others share the rest,
+// taking output in pieces until their time is up.
+// Each tab may have FLOW_BACKLOG worth of parsing waiting in its ring;
+// beyond that, its reader stops reading from the pty.
+#define FLOW_FRAME 20000      // microseconds
+#define FLOW_SLICE_MIN 1000   // microseconds
+#define FLOW_PIECE 16384
+#define FLOW_BACKLOG 100      // ms
+
+#define PASTE_RETRY 10        // ms
+
+// Hand buffered pty output to the terminal for about slice microseconds;
+// return whether more is left.
+static bool reader_drain(pty_reader* r, unsigned long long slice) {
+    struct child* child = r->child;
+    uint tail = r->tail.load(std::memory_order_relaxed);
+    uint head = r->head.load(std::memory_order_acquire);
+
+    // While selecting, hold output back in the ring instead of having
+    // term_write copy it aside, up to the SuspendWhileSelecting size.
+    // Leave the reader room, so that a full ring goes to term_write,
+    // which holds the output back further as before.
+    uint hold = term_suspend_size(child->term);
+    uint cap = reader_cap(r);
+    hold = std::min(hold, cap - cap / 4);
+    if (hold && head - tail <= hold)
+        return false;
+
+    uint total = 0;
+    bool log_full = false;
+    unsigned long long start = child_clock(), elapsed = 0;
+    while (head != tail && total < CHILD_READ_BUDGET && elapsed < slice) {
+        uint pos = tail & (r->size - 1);
+        uint len = std::min(head - tail, r->size - pos);
+        len = std::min(len, std::min(CHILD_READ_BUDGET - total, (uint)FLOW_PIECE));
+        len = log_output(child, r->ring + pos, len);
+        if (!len) {
+            // the log writer wakes us up when it has space again
+            log_full = true;
+            break;
         }
+        term_write(child->term, r->ring + pos, len);
+        tail += len;
+        total += len;
+        elapsed = child_clock() - start;
+    }
+    r->tail.store(tail);
+    if (total)
+        child_startup_mark("first output");
 
-        struct timeval timeout = {0, 100000}, *timeout_p = 0;
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(child_win_fd, &fds);  
-        int highfd = child_win_fd;
+    if (child->replay) {
+        replay_stats* st = (replay_stats*)child->replay;
+        st->parse += elapsed;
+        st->bytes += total;
+    }
+    // Follow the parse rate of the tab, and allow a backlog to match.
+    if (total >= FLOW_PIECE && elapsed) {
+        uint rate = std::min(total * 1000ULL / elapsed, 1ULL << 30);
+        r->rate = r->rate ? (r->rate * 3 + rate) / 4 : rate;
+        uint limit = std::min((unsigned long long)r->rate * FLOW_BACKLOG, (unsigned long long)READER_RING_MAX);
+        r->limit.store(std::max(limit, (uint)READER_RING_MIN));
+    }
+    if (r->waiting.load()) {
+        pthread_mutex_lock(&r->mutex);
+        pthread_cond_signal(&r->space);
+        pthread_mutex_unlock(&r->mutex);
+    }
+    return head != tail && !log_full;
+}
+
+// Have child_proc look at held back output again.
+void child_wakeup() {
+    reader_notify();
+}
+
+// Serve one reader for a slice of time; return whether more is left.
+static bool reader_serve(pty_reader* r, unsigned long long slice) {
+    if (reader_drain(r, slice))
+        return true;
+    if (r->eof.load() && r->head.load() == r->tail.load()) {
+        struct child* child = r->child;
+        reader_stop(r);
+        close(child->pty_fd);
+        child->pty_fd = -1;
+        if (child->replay)
+            replay_report(child);
+        term_hide_cursor(child->term);
+        child_fds_changed();
+    }
+    return false;
+}
+
+void child_proc() {
+    // Tabs are served round-robin, starting one further on each round.
+    static uint rr_start = 0;
+    // Output left over after a round, also when we return for messages.
+    static bool more = false;
+
+    // Tabs with queued input or a paste in progress, with their entry
+    // in fds or -1.
+    static std::vector<std::pair<struct term*, int>> pending;
+    static std::vector<struct pollfd> fds;
+
+    for (;;) {
+        if (reap_pending)
+            reap_children();
+        if (readers_changed)
+            readers_rebuild();
+
+        fds.assign({
+            {child_win_fd, POLLIN, 0},
+            {sigchld_pipe[0], POLLIN, 0},
+            {wake_pipe[0], POLLIN, 0},
+        });
+        int timeout = more ? 0 : -1;
+
+        // Queued input, then any paste, continue when their pty is
+        // writable. Where the pty claims to be writable without taking
+        // anything, retry later.
+        pending.clear();
         for (Tab& t : win_tabs()) {
-            if (t.chld->pty_fd > highfd) highfd = t.chld->pty_fd;
-            if (t.chld->pty_fd >= 0) {
-                FD_SET(t.chld->pty_fd, &fds);
-            } else if (t.chld->pid) {
-                int status;
-                if (waitpid(t.chld->pid, &status, WNOHANG) == t.chld->pid) {
-                    t.chld->pid = 0;
-                }
-                else {// Pty gone, but process still there: keep checking
-                    timeout_p = &timeout;
-                }
+            struct term* term = t.terminal.get();
+            struct child* chld = t.chld.get();
+            if (!chld->out && !term->paste_out) {
+                chld->stalled = false;
+                continue;
+            }
+            if (chld->pty_fd < 0) {
+                // drop them
+                child_flush(chld);
+                term_send_paste(term);
+            }
+            else if (chld->stalled) {
+                pending.push_back({term, -1});
+                if (timeout < 0 || timeout > PASTE_RETRY)
+                    timeout = PASTE_RETRY;
+            }
+            else {
+                pending.push_back({term, (int)fds.size()});
+                fds.push_back({chld->pty_fd, POLLOUT, 0});
             }
         }
 
-        if (select(highfd + 1, &fds, 0, 0, timeout_p) > 0) {
-            for (Tab& t : win_tabs()) {
-                struct child* child = t.chld.get();
-                if (child->pty_fd >= 0 && FD_ISSET(child->pty_fd, &fds)) {
-#if CYGWIN_VERSION_DLL_MAJOR >= 1005
-                    static char buf[4096];
-                    int len = read(child->pty_fd, buf, sizeof buf);
-#else
-                    // Pty devices on old Cygwin version deliver only 4 bytes at a time,
-                    // so call read() repeatedly until we have a worthwhile haul.
-                    static char buf[512];
-                    uint len = 0;
-                    do {
-                        int ret = read(child->pty_fd, buf + len, sizeof buf - len);
-                        if (ret > 0)
-                            len += ret;
-                        else
-                            break;
-                    } while (len < sizeof buf);
-#endif
-                    if (len > 0) {
-                        term_write(child->term, buf, len);
-                        if (child_log_fd >= 0)
-                            write(child_log_fd, buf, len);
-                    } else {
-                        child->pty_fd = -1;
-                        term_hide_cursor(child->term);
-                    }
-                }
-                if (FD_ISSET(child_win_fd, &fds)) {
-                    return;
-                }
+        if (poll(fds.data(), fds.size(), timeout) < 0)
+            continue;
+
+        for (auto& p : pending) {
+            if (p.second >= 0 && !fds[p.second].revents)
+                continue;
+            struct child* chld = p.first->child;
+            int n = child_flush(chld);
+            if (!chld->out && p.first->paste_out)
+                n += term_send_paste(p.first);
+            chld->stalled = n <= 0 && (chld->out || p.first->paste_out);
+        }
+
+        if (fds[1].revents) {
+            char drain[64];
+            while (read(sigchld_pipe[0], drain, sizeof drain) > 0)
+                ;
+            reap_pending = true;
+        }
+
+        if (fds[2].revents || more) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof drain) > 0)
+                ;
+            wake_pending.store(false);
+
+            more = false;
+            uint n = readers.size();
+            if (n)
+                rr_start = (rr_start + 1) % n;
+
+            // The focused tab comes first.
+            struct term* active = win_active_terminal();
+            pty_reader* focus = 0;
+            for (pty_reader* r : readers) {
+                if (r->child->term == active)
+                    focus = r;
             }
+            unsigned long long start = child_clock();
+            if (focus && reader_serve(focus, n > 1 ? FLOW_FRAME / 2 : FLOW_FRAME))
+                more = true;
+
+            uint left = n - (focus ? 1 : 0);
+            for (uint k = 0; k < n; k++) {
+                pty_reader* r = readers[(rr_start + k) % n];
+                if (r == focus)
+                    continue;
+                unsigned long long elapsed = child_clock() - start;
+                unsigned long long slice = elapsed < FLOW_FRAME ? (FLOW_FRAME - elapsed) / left : 0;
+                left--;
+                if (reader_serve(r, std::max(slice, (unsigned long long)FLOW_SLICE_MIN)))
+                    more = true;
+            }
+            if (readers_changed)
+                readers_rebuild();
         }
+
+        if (fds[0].revents)
+            return;
     }
 }
 
@@ -156,6 +156,12 @@ const config default_cfg = {
   .icon = W(""),
   .log = W(""),
   .logging = true,
+  .log_timing = false,
+  .log_flush = 200,
+  .log_drop = false,
+  .record = W(""),
+  .replay = W(""),
+  .replay_speed = 100,
   .create_utmp = false,
   .title =  W(""),
   .title_settable = true,
@@ -228,6 +234,9 @@ const config default_cfg = {
     [BOLD_WHITE_I]   = RGB(0xFF, 0xFF, 0xFF)
   },
   .sixel_clip_char = W(" "),
+  .image_memory = 64,
+  .image_disk = 256,
+  .hibernate_after = 600,
   .baud = 0
 };
 
@@ -406,6 +415,12 @@ options[] = {
   {"Icon", OPT_WSTRING, offcfg(icon)},
   {"Log", OPT_WSTRING, offcfg(log)},
   {"Logging", OPT_BOOL, offcfg(logging)},
+  {"LogTiming", OPT_BOOL, offcfg(log_timing)},
+  {"LogFlushInterval", OPT_INT, offcfg(log_flush)},
+  {"LogDropOverflow", OPT_BOOL, offcfg(log_drop)},
+  {"Record", OPT_WSTRING, offcfg(record)},
+  {"Replay", OPT_WSTRING, offcfg(replay)},
+  {"ReplaySpeed", OPT_INT, offcfg(replay_speed)},
   {"Title", OPT_WSTRING, offcfg(title)},
   {"TitleSettable", OPT_BOOL, offcfg(title_settable)},
   {"Utmp", OPT_BOOL, offcfg(create_utmp)},
@@ -456,6 +471,9 @@ options[] = {
   {"WordCharsExcl", OPT_STRING, offcfg(word_chars_excl)},
   {"IMECursorColour", OPT_COLOUR, offcfg(ime_cursor_colour)},
   {"SixelClipChars", OPT_WSTRING, offcfg(sixel_clip_char)},
+  {"ImageMemory", OPT_INT, offcfg(image_memory)},
+  {"ImageDiskCache", OPT_INT, offcfg(image_disk)},
+  {"HibernateAfter", OPT_INT, offcfg(hibernate_after)},
   {"OldBold", OPT_BOOL, offcfg(old_bold)},
   {"ShortLongOpts", OPT_BOOL, offcfg(short_long_opts)},
   {"BoldAsRainbowSparkles", OPT_BOOL, offcfg(bold_as_special)},
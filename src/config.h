@@ -152,6 +152,12 @@ typedef struct {
   wstring icon;
   wstring log;
   bool logging;
+  bool log_timing;  // also write a scriptreplay timing file
+  int log_flush;    // ms
+  bool log_drop;    // drop log output rather than slow down
+  wstring record;   // asciicast recording file
+  wstring replay;   // recording to play instead of a command
+  int replay_speed; // percent, 0 = as fast as possible
   wstring title;
   bool title_settable;
   bool create_utmp;
@@ -202,6 +208,9 @@ typedef struct {
   colour ime_cursor_colour;
   colour ansi_colours[16];
   wstring sixel_clip_char;
+  int image_memory;  // MB
+  int image_disk;    // MB
+  int hibernate_after;  // seconds, 0 = never
   bool short_long_opts;
   bool bold_as_special;
   int selection_show_size;
@@ -6,6 +6,12 @@
 #include <stdio.h>
 #include <ctype.h>   /* isdigit */
 #include <string.h>  /* memcpy */
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define SIXEL_SIMD
+#include <immintrin.h>
+#endif
 
 #include "sixel.h"
 #include "sixel_hls.h"
@@ -34,8 +40,119 @@ static colour const sixel_default_color_table[] = {
     SIXEL_XRGB(80, 80, 80),  /* 15 Gray 75% */
 };
 
+/*
+ * The rows painted by each of the 64 sixel patterns, as runs of
+ * adjacent bits, so that a repeated sixel is painted as a few row spans
+ * instead of being tested bit by bit for every pixel.
+ */
+typedef struct {
+  unsigned char nruns;
+  unsigned char top;        /* lowest row painted */
+  unsigned char run[3][2];  /* first row, number of rows */
+} sixel_pattern_t;
+
+static sixel_pattern_t sixel_patterns[64];
+
+static void
+init_sixel_patterns(void)
+{
+  static int initialized = 0;
+  int bits;
+  int i;
+  sixel_pattern_t * pat;
+
+  if (initialized)
+    return;
+
+  for (bits = 1; bits < 64; bits++) {
+    pat = &sixel_patterns[bits];
+    for (i = 0; i < 6; i++) {
+      if (bits & (1 << i)) {
+        if (i > 0 && (bits & (1 << (i - 1)))) {
+          pat->run[pat->nruns - 1][1]++;
+        } else {
+          pat->run[pat->nruns][0] = i;
+          pat->run[pat->nruns][1] = 1;
+          pat->nruns++;
+        }
+        pat->top = i;
+      }
+    }
+  }
+  initialized = 1;
+}
+
+static inline void
+fill_span(sixel_color_no_t * dst, sixel_color_no_t color, int n)
+{
+#ifdef __SSE2__
+  __m128i v = _mm_set1_epi16((short)color);
+  for (; n >= 8; n -= 8, dst += 8)
+    _mm_storeu_si128((__m128i *)dst, v);
+#endif
+  while (n-- > 0)
+    *dst++ = color;
+}
+
+#ifdef SIXEL_SIMD
+__attribute__((target("avx2")))
+static void
+gather_pixels_avx2(uint32_t const * pal, sixel_color_no_t const * src,
+                   uint32_t * dst, int n)
+{
+  __m128i idx;
+  for (; n >= 8; n -= 8, src += 8, dst += 8) {
+    idx = _mm_loadu_si128((__m128i const *)src);
+    _mm256_storeu_si256((__m256i *)dst,
+                        _mm256_i32gather_epi32((int const *)pal,
+                                               _mm256_cvtepu16_epi32(idx), 4));
+  }
+  while (n-- > 0)
+    *dst++ = pal[*src++];
+}
+#endif
+
+/* map colour numbers to pixel values of the 32-bit DIB */
+static void
+gather_pixels(uint32_t const * pal, sixel_color_no_t const * src,
+              uint32_t * dst, int n)
+{
+#ifdef SIXEL_SIMD
+  static int avx2 = -1;
+  if (avx2 < 0) {
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+  }
+  if (avx2) {
+    gather_pixels_avx2(pal, src, dst, n);
+    return;
+  }
+#endif
+  for (; n >= 4; n -= 4, src += 4, dst += 4) {
+    dst[0] = pal[src[0]];
+    dst[1] = pal[src[1]];
+    dst[2] = pal[src[2]];
+    dst[3] = pal[src[3]];
+  }
+  while (n-- > 0)
+    *dst++ = pal[*src++];
+}
+
+/* BGRX pixel values of the palette, as laid out in a 32-bit DIB */
+static void
+pixel_palette(colour const * palette, uint32_t * pal)
+{
+  int n;
+  colour color;
+
+  for (n = 0; n < DECSIXEL_PALETTE_MAX; n++) {
+    color = palette[n];
+    pal[n] = (color >> 16 & 0xff) | (color & 0xff00) | (color & 0xff) << 16;
+  }
+}
+
 static int
-set_default_color(sixel_image_t * image)
+set_default_color(colour * palette)
 {
   int i;
   int n;
@@ -45,25 +162,25 @@ set_default_color(sixel_image_t * image)
 
   /* palette initialization */
   for (n = 1; n < 17; n++) {
-    image->palette[n] = sixel_default_color_table[n - 1];
+    palette[n] = sixel_default_color_table[n - 1];
   }
 
   /* colors 17-232 are a 6x6x6 color cube */
   for (r = 0; r < 6; r++) {
     for (g = 0; g < 6; g++) {
       for (b = 0; b < 6; b++) {
-        image->palette[n++] = make_colour(r * 51, g * 51, b * 51);
+        palette[n++] = make_colour(r * 51, g * 51, b * 51);
       }
     }
   }
 
   /* colors 233-256 are a grayscale ramp, intentionally leaving out */
   for (i = 0; i < 24; i++) {
-    image->palette[n++] = make_colour(i * 11, i * 11, i * 11);
+    palette[n++] = make_colour(i * 11, i * 11, i * 11);
   }
 
   for (; n < DECSIXEL_PALETTE_MAX; n++) {
-    image->palette[n] = make_colour(255, 255, 255);
+    palette[n] = make_colour(255, 255, 255);
   }
 
   return 0;
@@ -197,6 +314,8 @@ sixel_parser_init(sixel_state_t * st,
   st->nparams = 0;
   st->param = 0;
 
+  init_sixel_patterns();
+
   /* buffer initialization */
   status = sixel_image_init(&st->image, 1, 1, fgcolor, bgcolor, use_private_register);
 
@@ -207,7 +326,7 @@ sixel_parser_init(sixel_state_t * st,
 int
 sixel_parser_set_default_color(sixel_state_t * st)
 {
-  return set_default_color(&st->image);
+  return set_default_color(st->image.palette);
 }
 
 
@@ -218,10 +337,7 @@ sixel_parser_finalize(sixel_state_t * st, unsigned char * pixels)
   int sx;
   int sy;
   sixel_image_t * image = &st->image;
-  int x, y;
-  sixel_color_no_t * src;
-  unsigned char * dst;
-  colour color;
+  uint32_t pal[DECSIXEL_PALETTE_MAX];
   int size_pixels = st->image.width * st->image.height * 4;
 
   if (++st->max_x < st->attributed_ph) {
@@ -243,60 +359,69 @@ sixel_parser_finalize(sixel_state_t * st, unsigned char * pixels)
   }
 
   if (image->use_private_register && image->ncolors > 2 && !image->palette_modified) {
-    status = set_default_color(image);
+    status = set_default_color(image->palette);
     if (status < 0) {
       goto end;
     }
   }
 
-  src = st->image.data;
-  dst = pixels;
-  for (y = 0; y < st->image.height; ++y) {
-    for (x = 0; x < st->image.width; ++x) {
-      if (dst + 4 > pixels + size_pixels) {
-        status = -1;
-        goto end;
-      }
-      color = st->image.palette[*src++];
-      *dst++ = color >> 16 & 0xff;   /* b */
-      *dst++ = color >> 8 & 0xff;    /* g */
-      *dst++ = color >> 0 & 0xff;    /* r */
-      dst++;                         /* a */
-    }
-    /* fill right padding with bgcolor */
-    for (; x < st->image.width; ++x) {
-      if (dst + 4 > pixels + size_pixels) {
-        status = -1;
-        goto end;
-      }
-      color = st->image.palette[0];  /* bgcolor */
-      *dst++ = color >> 16 & 0xff;   /* b */
-      *dst++ = color >> 8 & 0xff;    /* g */
-      *dst++ = color >> 0 & 0xff;    /* r */
-      dst++;                         /* a */
-    }
-  }
-  /* fill bottom padding with bgcolor */
-  for (; y < st->image.height; ++y) {
-    for (x = 0; x < st->image.width; ++x) {
-      if (dst + 4 > pixels + size_pixels) {
-        status = -1;
-        goto end;
-      }
-      color = st->image.palette[0];  /* bgcolor */
-      *dst++ = color >> 16 & 0xff;   /* b */
-      *dst++ = color >> 8 & 0xff;    /* g */
-      *dst++ = color >> 0 & 0xff;    /* r */
-      dst++;                         /* a */
-    }
+  /* the pixel buffer was sized for the image before trimming */
+  if (image->width * image->height * 4 > size_pixels) {
+    status = -1;
+    goto end;
   }
 
+  pixel_palette(image->palette, pal);
+  gather_pixels(pal, image->data, (uint32_t *)pixels,
+                image->width * image->height);
+
   status = 0;
 
 end:
   return status;
 }
 
+/*
+ * Render the top left width x height pixels of the image decoded so far,
+ * padded with the background colour, without finalizing the image;
+ * used to show an image while it is still being received.
+ */
+int
+sixel_parser_render(sixel_state_t * st, unsigned char * pixels,
+                    int width, int height)
+{
+  sixel_image_t * image = &st->image;
+  colour defaults[DECSIXEL_PALETTE_MAX];
+  colour * palette = image->palette;
+  uint32_t pal[DECSIXEL_PALETTE_MAX];
+  uint32_t * dst = (uint32_t *)pixels;
+  int w = width < image->width ? width: image->width;
+  int x;
+  int y;
+
+  if (!image->data)
+    return -1;
+
+  if (image->use_private_register && image->ncolors > 2 && !image->palette_modified) {
+    memcpy(defaults, palette, sizeof defaults);
+    set_default_color(defaults);
+    palette = defaults;
+  }
+  pixel_palette(palette, pal);
+
+  for (y = 0; y < height; y++, dst += width) {
+    x = 0;
+    if (y < image->height) {
+      gather_pixels(pal, image->data + image->width * y, dst, w);
+      x = w;
+    }
+    for (; x < width; x++)
+      dst[x] = pal[0];
+  }
+
+  return 0;
+}
+
 /* convert sixel data into indexed pixel bytes and palette data */
 int
 sixel_parser_parse(sixel_state_t * st, unsigned char * p, int len)
@@ -307,11 +432,11 @@ sixel_parser_parse(sixel_state_t * st, unsigned char * p, int len)
   int x;
   int y;
   int bits;
-  int sixel_vertical_mask;
   int sx;
   int sy;
-  int c;
-  int pos;
+  sixel_pattern_t const * pat;
+  sixel_color_no_t * band;
+  sixel_color_no_t * dst;
   unsigned char * p0 = p;
   sixel_image_t * image = &st->image;
 
@@ -391,52 +516,41 @@ sixel_parser_parse(sixel_state_t * st, unsigned char * p, int len)
             st->repeat_count = image->width - st->pos_x;
           }
 
-          if (st->repeat_count > 0 && st->pos_y - 5 < image->height) {
+          if (st->repeat_count > 0 && st->pos_y < image->height) {
             bits = *p - '?';
             if (bits != 0) {
-              sixel_vertical_mask = 0x01;
-              if (st->repeat_count <= 1) {
-                for (i = 0; i < 6; i++) {
-                  if ((bits & sixel_vertical_mask) != 0) {
-                    pos = image->width * (st->pos_y + i) + st->pos_x;
-                    image->data[pos] = st->color_index;
-                    if (st->max_x < st->pos_x) {
-                      st->max_x = st->pos_x;
-                    }
-                    if (st->max_y < (st->pos_y + i)) {
-                      st->max_y = st->pos_y + i;
-                    }
-                  }
-                  sixel_vertical_mask <<= 1;
-                }
-              } else {
-                /* st->repeat_count > 1 */
-                for (i = 0; i < 6; i++) {
-                  if ((bits & sixel_vertical_mask) != 0) {
-                    c = sixel_vertical_mask << 1;
-                    for (n = 1; (i + n) < 6; n++) {
-                      if ((bits & c) == 0) {
-                        break;
-                      }
-                      c <<= 1;
-                    }
-                    for (y = st->pos_y + i; y < st->pos_y + i + n; ++y) {
-                      for (x = st->pos_x; x < st->pos_x + st->repeat_count; ++x) {
-                        image->data[image->width * y + x] = st->color_index;
-                      }
-                    }
-                    if (st->max_x < (st->pos_x + st->repeat_count - 1)) {
-                      st->max_x = st->pos_x + st->repeat_count - 1;
-                    }
-                    if (st->max_y < (st->pos_y + i + n - 1)) {
-                      st->max_y = st->pos_y + i + n - 1;
-                    }
-                    i += (n - 1);
-                    sixel_vertical_mask <<= (n - 1);
-                  }
-                  sixel_vertical_mask <<= 1;
+              /* paint the pattern as vertical runs of the band,
+                 each run as row spans of repeat_count pixels */
+              pat = &sixel_patterns[bits];
+              band = image->data + image->width * st->pos_y + st->pos_x;
+              for (i = 0; i < pat->nruns; i++) {
+                y = st->pos_y + pat->run[i][0];
+                n = pat->run[i][1];
+                if (y + n > image->height)
+                  n = image->height - y;
+                if (n <= 0)
+                  break;
+                dst = band + image->width * pat->run[i][0];
+                if (st->repeat_count == 1) {
+                  for (; n > 0; n--, dst += image->width)
+                    *dst = st->color_index;
+                } else {
+                  for (; n > 0; n--, dst += image->width)
+                    fill_span(dst, st->color_index, st->repeat_count);
                 }
               }
+              /* track the painted extent once per sixel, not per pixel */
+              x = st->pos_x + st->repeat_count - 1;
+              if (st->max_x < x) {
+                st->max_x = x;
+              }
+              y = st->pos_y + pat->top;
+              if (y >= image->height) {
+                y = image->height - 1;
+              }
+              if (st->max_y < y) {
+                st->max_y = y;
+              }
             }
           }
           if (st->repeat_count > 0)
@@ -662,3 +776,272 @@ sixel_parser_deinit(sixel_state_t * st)
     sixel_image_deinit(&st->image);
 }
 
+
+#ifdef SIXEL_TEST
+#include <time.h>
+
+#warning compiling test code
+#define error(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__); exit(1)
+
+int cell_width = 8, cell_height = 16;
+
+/* an indexed image and the sixel stream encoding it, img2sixel style:
+   one pass per colour and band, with repeat introducers */
+struct sample {
+  const char * name;
+  int width, height, ncolors;
+  unsigned short * index;
+  int rgb[256][3];
+  char * stream;
+  int len;
+};
+
+static void
+put(struct sample * s, int * cap, const char * str, int n)
+{
+  if (s->len + n > *cap) {
+    *cap = (s->len + n) * 2;
+    s->stream = realloc(s->stream, *cap);
+  }
+  memcpy(s->stream + s->len, str, n);
+  s->len += n;
+}
+
+static void
+put_run(struct sample * s, int * cap, char ch, int run)
+{
+  char buf[16];
+  if (run >= 3)
+    put(s, cap, buf, sprintf(buf, "!%d%c", run, ch));
+  else
+    while (run--)
+      put(s, cap, &ch, 1);
+}
+
+static void
+encode_sample(struct sample * s)
+{
+  char buf[64];
+  char * row = malloc(s->width);
+  int cap = 0;
+  int x, y, i, c;
+
+  s->stream = NULL;
+  s->len = 0;
+  put(s, &cap, buf, sprintf(buf, "\"1;1;%d;%d", s->width, s->height));
+  for (c = 0; c < s->ncolors; c++)
+    put(s, &cap, buf, sprintf(buf, "#%d;2;%d;%d;%d",
+                             c, s->rgb[c][0], s->rgb[c][1], s->rgb[c][2]));
+  for (y = 0; y < s->height; y += 6) {
+    int first = 1;
+    for (c = 0; c < s->ncolors; c++) {
+      int used = 0, end = 0;
+      for (x = 0; x < s->width; x++) {
+        int bits = 0;
+        for (i = 0; i < 6 && y + i < s->height; i++)
+          if (s->index[(y + i) * s->width + x] == c)
+            bits |= 1 << i;
+        row[x] = '?' + bits;
+        if (bits) {
+          used = 1;
+          end = x + 1;
+        }
+      }
+      if (!used)
+        continue;
+      if (!first)
+        put(s, &cap, "$", 1);
+      first = 0;
+      put(s, &cap, buf, sprintf(buf, "#%d", c));
+      for (x = 0; x < end; ) {
+        int run = 1;
+        while (x + run < end && row[x + run] == row[x])
+          run++;
+        put_run(s, &cap, row[x], run);
+        x += run;
+      }
+    }
+    put(s, &cap, "-", 1);
+  }
+  free(row);
+}
+
+static void
+make_sample(struct sample * s, const char * name, int w, int h, int photo)
+{
+  int x, y, c;
+
+  s->name = name;
+  s->width = w;
+  s->height = h;
+  s->ncolors = photo ? 256 : 8;
+  s->index = malloc(sizeof(unsigned short) * w * h);
+  for (c = 0; c < s->ncolors; c++) {
+    s->rgb[c][0] = c * 37 % 101;
+    s->rgb[c][1] = c * 59 % 101;
+    s->rgb[c][2] = c * 83 % 101;
+  }
+  for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++) {
+      if (photo)
+        /* smooth gradient with dithering noise: short runs */
+        c = ((x + y) / 6 + ((x * 7 ^ y * 13) & 7)) & 255;
+      else {
+        /* bar chart on a flat background: long runs */
+        int bar = x / (w / 16);
+        c = (h - y < (bar * 37 % 16 + 1) * h / 17) ? 1 + bar % 7 : 0;
+        if (y % 60 == 0)
+          c = 7;
+      }
+      s->index[y * w + x] = c;
+    }
+  encode_sample(s);
+}
+
+static unsigned char *
+decode_sample(struct sample * s, sixel_state_t * st)
+{
+  unsigned char * pixels;
+
+  if (sixel_parser_init(st, 0xFFFFFF, 0, 0) < 0) {
+    error("%s: init failed\n", s->name);
+  }
+  if (sixel_parser_parse(st, (unsigned char *)s->stream, s->len) < 0) {
+    error("%s: parse failed\n", s->name);
+  }
+  pixels = malloc(st->image.width * st->image.height * 4);
+  if (sixel_parser_finalize(st, pixels) < 0) {
+    error("%s: finalize failed\n", s->name);
+  }
+  return pixels;
+}
+
+static void
+test_sample(struct sample * s)
+{
+  sixel_state_t st;
+  unsigned char * pixels = decode_sample(s, &st);
+  int x, y, c;
+
+  if (st.image.width < s->width || st.image.height < s->height) {
+    error("%s: decoded %dx%d, expected %dx%d\n", s->name,
+          st.image.width, st.image.height, s->width, s->height);
+  }
+  for (y = 0; y < s->height; y++)
+    for (x = 0; x < s->width; x++) {
+      unsigned char * px = pixels + (y * st.image.width + x) * 4;
+      c = s->index[y * s->width + x];
+      if (px[2] != PALVAL(s->rgb[c][0], 255, 100) ||
+          px[1] != PALVAL(s->rgb[c][1], 255, 100) ||
+          px[0] != PALVAL(s->rgb[c][2], 255, 100)) {
+        error("%s: pixel %d,%d mismatch\n", s->name, x, y);
+      }
+    }
+  free(pixels);
+  sixel_parser_deinit(&st);
+  printf("%s: %dx%d, %d bytes: PASS\n", s->name, s->width, s->height, s->len);
+}
+
+/* the rows completed so far can be shown while the rest streams in */
+static void
+test_render(struct sample * s)
+{
+  sixel_state_t st;
+  unsigned char * pixels;
+  int x, y, c, rows;
+
+  sixel_parser_init(&st, 0xFFFFFF, 0, 0);
+  sixel_parser_parse(&st, (unsigned char *)s->stream, s->len / 2);
+  rows = st.pos_y;
+  pixels = malloc(s->width * rows * 4);
+  if (sixel_parser_render(&st, pixels, s->width, rows) < 0) {
+    error("%s: render failed\n", s->name);
+  }
+  for (y = 0; y < rows; y++)
+    for (x = 0; x < s->width; x++) {
+      unsigned char * px = pixels + (y * s->width + x) * 4;
+      c = s->index[y * s->width + x];
+      if (px[2] != PALVAL(s->rgb[c][0], 255, 100) ||
+          px[1] != PALVAL(s->rgb[c][1], 255, 100) ||
+          px[0] != PALVAL(s->rgb[c][2], 255, 100)) {
+        error("%s: partial pixel %d,%d mismatch\n", s->name, x, y);
+      }
+    }
+  free(pixels);
+  sixel_parser_deinit(&st);
+  printf("%s: %d rows rendered from half the stream: PASS\n", s->name, rows);
+}
+
+/* garbage must never write outside the image */
+static void
+test_fuzz(void)
+{
+  static const char alphabet[] = "?@ABO_`o~!#$-\";0123456789";
+  unsigned char buf[1024];
+  sixel_state_t st;
+  unsigned char * pixels;
+  int round, i;
+
+  srand(1);
+  for (round = 0; round < 500; round++) {
+    if (round == 0) {
+      /* run past the maximum height, then paint a full sixel */
+      for (i = 0; i < 700; i++)
+        buf[i] = '-';
+      memcpy(buf + i, "!9999~", 6);
+      memset(buf + i + 6, '$', sizeof buf - i - 6);
+    }
+    else
+      for (i = 0; i < (int)sizeof buf; i++)
+        buf[i] = alphabet[rand() % (sizeof alphabet - 1)];
+    sixel_parser_init(&st, 0xFFFFFF, 0, 0);
+    sixel_parser_parse(&st, buf, sizeof buf);
+    pixels = malloc(st.image.width * st.image.height * 4);
+    sixel_parser_finalize(&st, pixels);
+    free(pixels);
+    sixel_parser_deinit(&st);
+  }
+  printf("fuzz: PASS\n");
+}
+
+static void
+benchmark(struct sample * s)
+{
+  sixel_state_t st;
+  clock_t start = clock();
+  int iterations = 0;
+  double secs;
+
+  do {
+    free(decode_sample(s, &st));
+    sixel_parser_deinit(&st);
+    iterations++;
+  } while ((secs = (double)(clock() - start) / CLOCKS_PER_SEC) < 1.0);
+
+  printf("%s: %.2f ms/image, %.1f MB/s\n", s->name,
+         secs * 1000 / iterations, (double)s->len * iterations / secs / 1e6);
+}
+
+int
+main(int argc, char * argv[])
+{
+  static struct sample photo, chart;
+
+  (void)argv;
+  make_sample(&photo, "photo", 800, 480, 1);
+  make_sample(&chart, "chart", 800, 480, 0);
+  test_sample(&photo);
+  test_sample(&chart);
+  test_render(&photo);
+  test_render(&chart);
+  test_fuzz();
+
+  if (argc > 1) {
+    benchmark(&photo);
+    benchmark(&chart);
+  }
+
+  return 0;
+}
+
+#endif
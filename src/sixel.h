@@ -54,6 +54,7 @@ int sixel_parser_init(sixel_state_t * st, colour fgcolor, colour bgcolor, int us
 int sixel_parser_parse(sixel_state_t * st, unsigned char * p, int len);
 int sixel_parser_set_default_color(sixel_state_t * st);
 int sixel_parser_finalize(sixel_state_t * st, unsigned char * pixels);
+int sixel_parser_render(sixel_state_t * st, unsigned char * pixels, int width, int height);
 void sixel_parser_deinit(sixel_state_t * st);
 
 #endif
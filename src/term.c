@@ -41,12 +41,98 @@ termchar basic_erase_char =
 
 #define dont_debug_hyperlinks
 
-static char * * links = 0;
-static int nlinks = 0;
-static int linkid = 0;
+/*
+ * Hyperlink table.
+ * Links are interned in a hash table per terminal, so that repeated
+ * OSC 8 sequences with the same link (e.g. from ls --hyperlink) reuse
+ * their entry. Entries that are neither referenced from the scrollback
+ * nor used on the screens are reclaimed by an occasional sweep.
+ */
+
+static uint
+link_hash(char * link)
+{
+  // FNV-1a
+  uint h = 2166136261u;
+  for (uchar * p = (uchar *)link; *p; p++)
+    h = (h ^ *p) * 16777619u;
+  return h;
+}
+
+static void
+links_rehash(termlinks * tl, int nbuckets)
+{
+  tl->buckets = renewn(tl->buckets, nbuckets);
+  tl->nbuckets = nbuckets;
+  for (int i = 0; i < nbuckets; i++)
+    tl->buckets[i] = -1;
+  tl->free = -1;
+  for (int i = tl->len; i--;) {
+    termlink * l = &tl->links[i];
+    if (!l->link) {
+      l->next = tl->free;
+      tl->free = i;
+    }
+    else if (*l->link != '=') {
+      int b = l->hash & (nbuckets - 1);
+      l->next = tl->buckets[b];
+      tl->buckets[b] = i;
+    }
+    // anonymous links ("=n;url") are unique and never looked up
+  }
+}
+
+static void
+link_mark(uchar * live, int len, int link)
+{
+  if (link >= 0 && link < len)
+    live[link] = 1;
+}
+
+/*
+ * Free all links that are neither referenced from the scrollback
+ * nor in use on the screens or in cursor attributes.
+ */
+static void
+links_sweep(struct term* term)
+{
+  termlinks * tl = &term->links;
+  uchar * live = newn(uchar, tl->len);
+
+  termlines * screens[] = {term->lines, term->other_lines};
+  for (uint s = 0; s < lengthof(screens); s++)
+    if (screens[s])
+      for (int y = 0; y < term->rows; y++) {
+        termline * line = screens[s][y];
+        //! Note: line->chars is based @ index -1
+        for (int x = -1; x < line->size; x++)
+          link_mark(live, tl->len, line->chars[x].attr.link);
+      }
+  link_mark(live, tl->len, term->curs.attr.link);
+  link_mark(live, tl->len, term->saved_cursors[0].attr.link);
+  link_mark(live, tl->len, term->saved_cursors[1].attr.link);
+  link_mark(live, tl->len, term->erase_char.attr.link);
+  link_mark(live, tl->len, term->hoverlink);
+
+  for (int i = 0; i < tl->len; i++) {
+    termlink * l = &tl->links[i];
+    if (l->link && !l->refs && !live[i]) {
+#ifdef debug_hyperlinks
+      printf("[%d] drop <%s>\n", i, l->link);
+#endif
+      free(l->link);
+      l->link = 0;
+      tl->count--;
+    }
+  }
+  free(live);
+
+  links_rehash(tl, tl->nbuckets);
+  tl->sweep_at = max(64, tl->count * 2);
+}
 
 int
-putlink(char * link)
+putlink(struct term* term, char * link)
 {
 #if CYGWIN_VERSION_API_MINOR >= 66
   bool utf8 = strcmp(nl_langinfo(CODESET), "UTF-8") == 0;
@@ -59,9 +145,18 @@ putlink(char * link)
     free(wlink);
   }
 
+  termlinks * tl = &term->links;
+  if (!tl->buckets) {
+    tl->free = -1;
+    links_rehash(tl, 64);
+    tl->sweep_at = 64;
+  }
+
+  uint hash = link_hash(link);
   if (*link != ';')
-    for (int i = 0; i < nlinks; i++)
-      if (0 == strcmp(link, links[i])) {
+    for (int i = tl->buckets[hash & (tl->nbuckets - 1)]; i >= 0;
+         i = tl->links[i].next)
+      if (tl->links[i].hash == hash && 0 == strcmp(link, tl->links[i].link)) {
         if (!utf8)
           free(link);
         return i;
@@ -69,30 +164,55 @@ putlink(char * link)
 
   char * link1;
   if (*link == ';')
-    link1 = asform("=%d%s", ++linkid, link);
+    link1 = asform("=%d%s", ++tl->anonid, link);
   else
     link1 = strdup(link);
-#ifdef debug_hyperlinks
-  printf("[%d] link <%s>\n", nlinks, link1);
-#endif
   if (!utf8)
     free(link);
 
-  nlinks++;
-  links = renewn(links, nlinks);
-  links[nlinks - 1] = link1;
-  return nlinks - 1;
+  if (tl->count >= tl->sweep_at)
+    links_sweep(term);
+  if (tl->count >= tl->nbuckets)
+    links_rehash(tl, tl->nbuckets * 2);
+
+  int n = tl->free;
+  if (n >= 0)
+    tl->free = tl->links[n].next;
+  else {
+    if (tl->len == tl->capacity) {
+      tl->capacity = tl->capacity * 2 + 64;
+      tl->links = renewn(tl->links, tl->capacity);
+    }
+    n = tl->len++;
+  }
+#ifdef debug_hyperlinks
+  printf("[%d] link <%s>\n", n, link1);
+#endif
+
+  termlink * l = &tl->links[n];
+  l->link = link1;
+  l->hash = hash;
+  l->refs = 0;
+  l->next = -1;
+  if (*link1 != '=') {
+    int b = hash & (tl->nbuckets - 1);
+    l->next = tl->buckets[b];
+    tl->buckets[b] = n;
+  }
+  tl->count++;
+  return n;
 }
 
 char *
-geturl(int n)
+geturl(struct term* term, int n)
 {
-  if (n >= 0 && n < nlinks) {
-    char * url = strchr(links[n], ';');
+  termlinks * tl = &term->links;
+  if (n >= 0 && n < tl->len && tl->links[n].link) {
+    char * url = strchr(tl->links[n].link, ';');
     if (url) {
       url++;
 #ifdef debug_hyperlinks
-      printf("[%d] url <%s> link <%s>\n", n, url, links[n]);
+      printf("[%d] url <%s> link <%s>\n", n, url, tl->links[n].link);
 #endif
       return url;
     }
@@ -100,6 +220,46 @@ geturl(int n)
   return 0;
 }
 
+/*
+ * Add (delta 1) or drop (delta -1) the scrollback references
+ * of the links used in a line; return whether there are any.
+ * Each run of cells with the same link counts once.
+ */
+static bool
+links_ref_line(struct term* term, termline * line, int delta)
+{
+  termlinks * tl = &term->links;
+  bool linked = false;
+  int prev = -1;
+  //! Note: line->chars is based @ index -1
+  for (int x = -1; x < line->cols; x++) {
+    termchar * c = &line->chars[x];
+    while (1) {
+      int link = c->attr.link;
+      if (link != prev && link >= 0 && link < tl->len) {
+        tl->links[link].refs += delta;
+        linked = true;
+      }
+      prev = link;
+      if (!c->cc_next)
+        break;
+      c += c->cc_next;
+    }
+  }
+  return linked;
+}
+
+static void
+links_free(struct term* term)
+{
+  termlinks * tl = &term->links;
+  for (int i = 0; i < tl->len; i++)
+    free(tl->links[i].link);
+  free(tl->links);
+  free(tl->buckets);
+  memset(tl, 0, sizeof(*tl));
+}
+
 
 static bool
 vt220(string term)
@@ -125,7 +285,9 @@ tblink_cb(void* data)
 {
   struct term* term = (struct term*)data;
   term->tblinker = !term->tblinker;
-  term_schedule_tblink(term);
+  // in the background, stop; term_set_background starts it again
+  if (!term->background)
+    term_schedule_tblink(term);
   win_update_term(term, false);
 }
 
@@ -143,7 +305,8 @@ tblink2_cb(void* data)
 {
   struct term* term = (struct term*)data;
   term->tblinker2 = !term->tblinker2;
-  term_schedule_tblink2(term);
+  if (!term->background)
+    term_schedule_tblink2(term);
   win_update_term(term, false);
 }
 
@@ -255,10 +418,13 @@ term_cursor_reset(term_cursor *curs)
 void
 term_reset(struct term* term, bool full)
 {
+  // the first reset comes from setting up the zeroed terminal
+  bool initial = term->cmd_buf == NULL;
   if (term->cmd_buf == NULL) {
     term->cmd_buf = newn(char, 128);
     term->cmd_buf_cap = 128;
   }
+  term_cancel_cmd(term);
 
   term->state = NORMAL;
   term->vt52_mode = 0;
@@ -332,11 +498,16 @@ term_reset(struct term* term, bool full)
 
   term->virtuallines = 0;
   term->altvirtuallines = 0;
+  // release the images, with their shared picture data
+  if (!initial)
+    winimgs_clear(term);
   term->imgs.parser_state = NULL;
   term->imgs.first = NULL;
   term->imgs.last = NULL;
   term->imgs.altfirst = NULL;
   term->imgs.altlast = NULL;
+  term->imgs.preview = NULL;
+  term->imgs.nindex = -1;
   term->sixel_display = 0;
   term->sixel_scrolls_right = 0;
   term->sixel_scrolls_left = 0;
@@ -389,14 +560,51 @@ static void freelines(termlines* lines, int rows) {
   }
 }
 
+/* Release buffers and caches that are rebuilt on demand when painting */
+static void
+term_free_caches(struct term* term)
+{
+  free(term->ltemp);
+  term->ltemp = 0;
+  term->ltemp_size = 0;
+  free(term->wcFrom);
+  free(term->wcTo);
+  term->wcFrom = term->wcTo = 0;
+  term->wcFromTo_size = 0;
+  for (int i = 0; i < term->bidi_cache_size; i++) {
+    free(term->pre_bidi_cache[i].chars);
+    free(term->pre_bidi_cache[i].forward);
+    free(term->pre_bidi_cache[i].backward);
+    free(term->post_bidi_cache[i].chars);
+    free(term->post_bidi_cache[i].forward);
+    free(term->post_bidi_cache[i].backward);
+  }
+  free(term->pre_bidi_cache);
+  free(term->post_bidi_cache);
+  term->pre_bidi_cache = term->post_bidi_cache = 0;
+  term->bidi_cache_size = 0;
+}
+
 void
 term_free(struct term* term)
 {
   freelines(term->displines, term->rows);
   freelines(term->lines, term->rows);
   freelines(term->other_lines, term->rows);
+  if (term->hib_lines) {
+    for (int i = 0; i < 2 * term->rows; i++)
+      free(term->hib_lines[i]);
+    free(term->hib_lines);
+  }
 
   term_clear_scrollback(term);
+  links_free(term);
+
+  term_cancel_cmd(term);
+  free(term->cmd_buf);
+
+  // release images, and their share of the image store
+  winimgs_clear(term);
 
   free(term->suspbuf);
 
@@ -405,20 +613,11 @@ term_free(struct term* term)
   free(term->tabs);
 
   free(term->paste_buffer);
+  free(term->paste_out);
+  if (term->paste_shown)
+    win_show_paste_progress(-1);
 
-  free(term->ltemp);
-  free(term->wcFrom);
-  free(term->wcTo);
-  for (int i = 0; i < term->bidi_cache_size; i++) {
-    free(term->pre_bidi_cache[i].chars);
-    free(term->pre_bidi_cache[i].forward);
-    free(term->pre_bidi_cache[i].backward);
-    free(term->post_bidi_cache[i].chars);
-    free(term->post_bidi_cache[i].forward);
-    free(term->post_bidi_cache[i].backward);
-  }
-  free(term->pre_bidi_cache);
-  free(term->post_bidi_cache);
+  term_free_caches(term);
   free(term->mode_stack);
   memset(term, 0, sizeof(*term));
 }
@@ -478,45 +677,64 @@ term_reconfig(struct term* term)
     term->vt220_keys = vt220(new_cfg.term);
 }
 
-static bool
-in_result(struct term* term, pos abspos, result run)
+/*
+ * Highlights of the logical columns of a displayed row, determined
+ * once per row by term_paint rather than for each cell.
+ */
+enum {
+  RM_SELECTED = 1, RM_HOVER = 2, RM_RESULT = 4, RM_CURRESULT = 8
+};
+
+static void
+mark_span(uchar * marks, int cols, int x0, int x1, uchar mark)
 {
-  return
-    (abspos.x + abspos.y * term->cols >= run.x + run.y * term->cols) &&
-    (abspos.x + abspos.y * term->cols <  run.x + run.y * term->cols + run.len);
+  x0 = max(x0, 0);
+  x1 = min(x1, cols);
+  for (int x = x0; x < x1; x++)
+    marks[x] |= mark;
 }
 
-static bool
-in_results_recurse(struct term* term, pos abspos, int lo, int hi)
+/* Mark the columns of row y within the range from start to before end */
+static void
+mark_range(struct term* term, uchar * marks, int y, pos start, pos end, uchar mark)
 {
-  if (hi - lo == 0) {
-    return false;
-  }
-  int mid = (lo + hi) / 2;
-  result run = term->results.results[mid];
-  if (run.x + run.y * term->cols > abspos.x + abspos.y * term->cols) {
-    return in_results_recurse(term, abspos, lo, mid);
-  } else if (run.x + run.y * term->cols + run.len <= abspos.x + abspos.y * term->cols) {
-    return in_results_recurse(term, abspos, mid + 1, hi);
-  }
-  return true;
+  int x0 = start.y < y ? 0 : start.y == y ? start.x : term->cols;
+  int x1 = y < end.y ? term->cols : y == end.y ? end.x : 0;
+  mark_span(marks, term->cols, x0, x1, mark);
 }
 
-static int
-in_results(struct term* term, pos scrpos)
+/* Mark the search results on screen row y */
+static void
+mark_results(struct term* term, uchar * marks, int y)
 {
-  if (term->results.length == 0) {
-    return 0;
-  }
+  termresults * res = &term->results;
+  if (res->length == 0)
+    return;
 
-  pos abspos = {
-    .x = scrpos.x,
-    .y = scrpos.y + term->sblines
-  };
+  int cols = term->cols;
+  int row = (y + term->sblines) * cols;
+  // results are sorted and disjoint; find the first one ending after
+  // the start of the row
+  int lo = 0, hi = res->length;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    result run = res->results[mid];
+    if (run.x + run.y * cols + run.len <= row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (int k = lo; k < res->length; k++) {
+    result run = res->results[k];
+    int x = run.x + run.y * cols - row;
+    if (x >= cols)
+      break;
+    mark_span(marks, cols, x, x + run.len, RM_RESULT);
+  }
 
-  int match = in_results_recurse(term, abspos, 0, term->results.length);
-  match += in_result(term, abspos, term->results.results[term->results.current]);
-  return match;
+  result run = res->results[res->current];
+  int x = run.x + run.y * cols - row;
+  mark_span(marks, cols, x, x + run.len, RM_CURRESULT);
 }
 
 static void
@@ -837,8 +1055,22 @@ term_clear_search(struct term* term)
   term->results.xquery_length = 0;
 }
 
+/*
+ * Free a compressed scrollback line, dropping its link references.
+ */
+static void
+scrollback_free(struct term* term, uchar *cline)
+{
+  if (compressed_lattr(cline) & LATTR_LINKED) {
+    termline *line = decompressline(cline, null);
+    links_ref_line(term, line, -1);
+    freeline(line);
+  }
+  free(cline);
+}
+
 static void
-scrollback_push(struct term* term, uchar *line)
+scrollback_push(struct term* term, termline *line)
 {
   if (term->sblines == term->sblen) {
     // Need to make space for the new line.
@@ -852,7 +1084,7 @@ scrollback_push(struct term* term, uchar *line)
     }
     else if (term->sblines) {
       // Throw away the oldest line
-      free(term->scrollback[term->sbpos]);
+      scrollback_free(term, term->scrollback[term->sbpos]);
       term->sblines--;
     }
     else
@@ -860,7 +1092,11 @@ scrollback_push(struct term* term, uchar *line)
   }
   assert(term->sblines < term->sblen);
   assert(term->sbpos < term->sblen);
-  term->scrollback[term->sbpos++] = line;
+  ushort lattr = line->lattr;
+  if (links_ref_line(term, line, 1))
+    line->lattr |= LATTR_LINKED;
+  term->scrollback[term->sbpos++] = compressline(line);
+  line->lattr = lattr;
   if (term->sbpos == term->sblen)
     term->sbpos = 0;
   term->sblines++;
@@ -889,6 +1125,9 @@ term_clear_scrollback(struct term* term)
 {
   while (term->sblines)
     free(scrollback_pop(term));
+  // no line remains in the scrollback to refer to a link
+  for (int i = 0; i < term->links.len; i++)
+    term->links.links[i].refs = 0;
   free(term->scrollback);
   term->scrollback = 0;
   term->sblen = term->sblines = term->sbpos = 0;
@@ -899,10 +1138,26 @@ term_clear_scrollback(struct term* term)
 /*
  * Set up the terminal for a given size.
  */
+/* Fill the displayed text buffer with cells that need painting */
+static void
+init_displines(struct term* term, int rows, int cols)
+{
+  for (int i = 0; i < rows; i++) {
+    termline *line = newline(cols, basic_erase_char);
+    term->displines[i] = line;
+    for (int j = 0; j < cols; j++) {
+      line->chars[j].attr = CATTR_DEFAULT;
+      line->chars[j].attr.attr = ATTR_INVALID;
+    }
+  }
+}
+
 void
 term_resize(struct term* term, int newrows, int newcols)
 {
   trace_resize(("--- term_resize %d %d\n", newrows, newcols));
+  if (term->hibernated)
+    term_rehydrate(term);
   bool on_alt_screen = term->on_alt_screen;
   term_switch_screen(term, 0, false);
 
@@ -946,7 +1201,7 @@ term_resize(struct term* term, int newrows, int newcols)
     // Push removed lines into scrollback
     for (int i = 0; i < store; i++) {
       termline *line = lines[i];
-      scrollback_push(term, compressline(line));
+      scrollback_push(term, line);
       term->virtuallines++;
       freeline(line);
     }
@@ -986,6 +1241,11 @@ term_resize(struct term* term, int newrows, int newcols)
       uchar *cline = scrollback_pop(term);
       termline *line = decompressline(cline, null);
       free(cline);
+      if (line->lattr & LATTR_LINKED) {
+        // links on the screen are tracked by sweeping
+        links_ref_line(term, line, -1);
+        line->lattr &= ~LATTR_LINKED;
+      }
       line->temporary = false;  /* reconstituted line is now real */
       lines[i] = line;
     }
@@ -1008,14 +1268,7 @@ term_resize(struct term* term, int newrows, int newcols)
       freeline(term->displines[i]);
   }
   term->displines = renewn(term->displines, newrows);
-  for (int i = 0; i < newrows; i++) {
-    termline *line = newline(newcols, basic_erase_char);
-    term->displines[i] = line;
-    for (int j = 0; j < newcols; j++) {
-      line->chars[j].attr = CATTR_DEFAULT;
-      line->chars[j].attr.attr = ATTR_INVALID;
-    }
-  }
+  init_displines(term, newrows, newcols);
 
   // Make a new alternate screen.
   lines = term->other_lines;
@@ -1079,6 +1332,7 @@ term_switch_screen(struct term* term, bool to_alt, bool reset)
   term->virtuallines = term->altvirtuallines;
   term->imgs.altfirst = first;
   term->imgs.altlast = last;
+  term->imgs.nindex = -1;
   term->altvirtuallines = offset;
 
   if (to_alt && reset)
@@ -1284,7 +1538,7 @@ term_do_scroll(struct term* term, int topline, int botline, int lines, bool sb)
     // normal screen and scrollback is actually enabled.
     if (sb && topline == 0 && !term->on_alt_screen && cfg.scrollback_lines) {
       for (int i = 0; i < lines; i++)
-        scrollback_push(term, compressline(term->lines[i]));
+        scrollback_push(term, term->lines[i]);
 
       // Shift viewpoint accordingly if user is looking at scrollback
       if (term->disptop < 0)
@@ -1955,6 +2209,24 @@ term_paint(struct term* term)
     termchar *dispchars = displine->chars;
     termchar newchars[term->cols];
 
+   /* Selection, link hovering and search results of this row */
+    uchar marks[term->cols];
+    memset(marks, 0, term->cols);
+    if (term->selected) {
+      if (term->sel_rect) {
+        if (term->sel_start.y <= scrpos.y && scrpos.y <= term->sel_end.y)
+          mark_span(marks, term->cols, term->sel_start.x, term->sel_end.x,
+                    RM_SELECTED);
+      }
+      else
+        mark_range(term, marks, scrpos.y, term->sel_start, term->sel_end,
+                   RM_SELECTED);
+    }
+    if (term->hovering && term->hoverlink < 0)
+      mark_range(term, marks, scrpos.y, term->hover_start, term->hover_end,
+                 RM_HOVER);
+    mark_results(term, marks, scrpos.y);
+
    /*
     * First loop: work along the line deciding what we want
     * each character cell to look like.
@@ -1975,14 +2247,8 @@ term_paint(struct term* term)
         tattr.attr |= ATTR_WIDE;
 
      /* Video reversing things */
-      bool selected =
-        term->selected &&
-        ( term->sel_rect
-          ? posPle(term->sel_start, scrpos) && posPlt(scrpos, term->sel_end)
-          : posle(term->sel_start, scrpos) && poslt(scrpos, term->sel_end)
-        );
-
-      if (selected) {
+      uchar mark = marks[scrpos.x];
+      if (mark & RM_SELECTED) {
         tattr.attr |= TATTR_SELECTED;
 
         colour bg = win_get_colour(SEL_COLOUR_I);
@@ -2007,7 +2273,7 @@ term_paint(struct term* term)
       if (term->hovering &&
           (term->hoverlink >= 0
            ? term->hoverlink == tattr.link
-           : posle(term->hover_start, scrpos) && poslt(scrpos, term->hover_end)
+           : mark & RM_HOVER
           )
          )
       {
@@ -2038,7 +2304,7 @@ term_paint(struct term* term)
         }
       }
 
-      int match = in_results(term, scrpos);
+      int match = !!(mark & RM_RESULT) + !!(mark & RM_CURRESULT);
       if (match > 0) {
         tattr.attr |= TATTR_RESULT;
         if (match > 1) {
@@ -2709,6 +2975,128 @@ term_set_focus(struct term* term, bool has_focus, bool may_report)
   }
 }
 
+/*
+ * Hibernation of idle tabs: after a tab has been in the background
+ * without output for HibernateAfter seconds, its screens are kept
+ * compressed like scrollback lines, and the display buffer, render
+ * caches and image bitmaps are released. They are restored when the
+ * tab is shown again or receives output.
+ */
+static int hibernate_at;  // tick count of the next check, 0 if none
+
+static void schedule_hibernate(int due);
+
+static void
+hibernate_check(struct term* term)
+{
+  if (!term->background || term->hibernated || !term->lines
+      || cfg.hibernate_after <= 0)
+    return;
+
+  int due = term->idle_since + cfg.hibernate_after * 1000;
+  if (due - get_tick_count() > 0) {
+    schedule_hibernate(due);
+    return;
+  }
+
+  int rows = term->rows;
+  uchar ** hib = newn(uchar *, 2 * rows);
+  for (int i = 0; i < rows; i++) {
+    hib[i] = compressline(term->lines[i]);
+    hib[rows + i] = compressline(term->other_lines[i]);
+  }
+  freelines(term->lines, rows);
+  freelines(term->other_lines, rows);
+  freelines(term->displines, rows);
+  term->lines = term->other_lines = term->displines = 0;
+  term->hib_lines = hib;
+  term->hibernated = true;
+
+  term_free_caches(term);
+  winimgs_hibernate(term);
+}
+
+static void
+hibernate_cb(void* data)
+{
+  (void)data;
+  hibernate_at = 0;
+  win_for_each_term(hibernate_check);
+}
+
+static void
+schedule_hibernate(int due)
+{
+  if (cfg.hibernate_after <= 0)
+    return;
+  if (hibernate_at && due - hibernate_at >= 0)
+    return;  // an earlier check is pending
+  int now = get_tick_count();
+  hibernate_at = due ?: 1;
+  win_set_timer(hibernate_cb, 0, max(due - now, 1000));
+}
+
+void
+term_rehydrate(struct term* term)
+{
+  int rows = term->rows;
+  uchar ** hib = term->hib_lines;
+  term->lines = newn(termline *, rows);
+  term->other_lines = newn(termline *, rows);
+  for (int i = 0; i < rows; i++) {
+    term->lines[i] = decompressline(hib[i], null);
+    term->lines[i]->temporary = false;
+    term->other_lines[i] = decompressline(hib[rows + i], null);
+    term->other_lines[i]->temporary = false;
+    free(hib[i]);
+    free(hib[rows + i]);
+  }
+  free(hib);
+  term->hib_lines = 0;
+  term->hibernated = false;
+
+  term->displines = newn(termline *, rows);
+  init_displines(term, rows, term->cols);
+  term->bg_stale = true;
+
+  term->idle_since = get_tick_count();
+  if (term->background)
+    schedule_hibernate(term->idle_since + cfg.hibernate_after * 1000);
+}
+
+/*
+ * A terminal in a tab that is not shown runs in background mode:
+ * output is parsed, but display updates, cursor and text blinking and
+ * search highlighting are left until the tab is activated again.
+ */
+void
+term_set_background(struct term* term, bool background)
+{
+  if (background == term->background)
+    return;
+  term->background = background;
+  if (background) {
+    term->idle_since = get_tick_count();
+    schedule_hibernate(term->idle_since + cfg.hibernate_after * 1000);
+  }
+  else {
+    if (term->hibernated)
+      term_rehydrate(term);
+    // text blinking stopped in the background
+    term_schedule_tblink(term);
+    term_schedule_tblink2(term);
+  }
+  if (!background && term->bg_stale) {
+    // catch up on the display work skipped in the background
+    term->bg_stale = false;
+    term->cblinker = 1;
+    term_schedule_cblink(term);
+    term_schedule_search_update(term);
+    term_invalidate(term, 0, 0, term->cols - 1, term->rows - 1);
+    win_schedule_update();
+  }
+}
+
 void
 term_update_cs(struct term* term)
 {
@@ -194,8 +194,9 @@ enum {
   LATTR_AUTORTL   = 0x0800u, /* direction after autodetection */
   // presentational bidi flag
   LATTR_PRESRTL   = 0x1000u,
+  // scrollback storage flag
+  LATTR_LINKED    = 0x0010u, /* compressed line holds hyperlink references */
   // unassigned bits:
-  //                0x0010u
   //                0x0020u
 };
 
@@ -348,28 +349,60 @@ typedef struct {
 } termresults;
 
 
+/* Hyperlinks (OSC 8), interned per terminal.
+ * Cells refer to a link by its index into the table (cattr.link).
+ * refs counts the link runs in lines stored in the scrollback;
+ * links used on the screens are found by sweeping, which also
+ * reclaims entries that are no longer referenced anywhere.
+ */
 typedef struct {
-  void *fp;
-  uint ref_counter;
-  uint amount;
-} tempfile_t;
+  char * link;    /* "params;url", or null if the slot is free */
+  uint hash;
+  uint refs;      /* scrollback references */
+  int next;       /* hash chain, or free list */
+} termlink;
 
 typedef struct {
-  tempfile_t *tempfile;
-  size_t position;
-} temp_strage_t;
-
-typedef struct imglist {
+  termlink * links;
+  int len, capacity;  /* slots in use (incl. free ones), allocated */
+  int * buckets;
+  int nbuckets;
+  int free;           /* head of free slot list, or -1 */
+  int count;          /* number of live links */
+  int sweep_at;       /* count at which to sweep unused links */
+  int anonid;         /* serial number for links without id */
+} termlinks;
+
+// picture of an image, shared by identical images
+typedef struct imgdata {
   unsigned char *pixels;
   void *hdc;
   void *hbmp;
-  temp_strage_t *strage;
+  struct imgseg *seg;  // image store segment holding the pixels
+  unsigned long segpos;
+  unsigned long seglen;
+  bool packed;         // stored pixels are compressed
+  bool lost;           // pixels dropped for lack of space
+  int pixelwidth;
+  int pixelheight;
+  uint hash;
+  uint refs;
+  struct imgdata *hnext;                // same hash bucket
+  struct imgdata *lru_prev, *lru_next;  // image data in memory, or
+                                        // else in the store
+  unsigned long lru_stamp;
+} imgdata;
+
+typedef struct imglist {
+  imgdata *data;
   int top;
   int left;
   int width;
   int height;
   int pixelwidth;
   int pixelheight;
+  unsigned long seq;  // painting order
+  bool graphics;      // placed through the graphics protocol
   struct imglist *next;
 } imglist;
 
@@ -379,6 +412,16 @@ typedef struct {
   imglist *last;
   imglist *altfirst;
   imglist *altlast;
+  imglist *preview;  // sixel image still being received
+  unsigned long preview_time;
+  // images of the current screen by top line, for painting
+  imglist **index;
+  int nindex;        // -1 if to be sorted again
+  int indexcap;
+  int maxheight;
+  unsigned long seq;
+  unsigned long lost_seen;  // pictures dropped when last collected
+  void *graphics;    // graphics protocol state
 } termimgs;
 
 struct mode_entry {
@@ -462,6 +505,11 @@ struct term {
   int  rows0, cols0;
   bool has_focus;
   bool focus_reported;
+  bool background;  // not the active tab: parse output without display work
+  bool bg_stale;    // display work skipped in the background
+  bool hibernated;  // screens compressed after idling in the background
+  uchar ** hib_lines;  // compressed screen, then alternate screen lines
+  int idle_since;   // tick count of last output or deactivation
   bool in_vbell;
 
   bool vt220_keys;
@@ -518,6 +566,8 @@ struct term {
   uint cmd_buf_cap;
   uint cmd_len;
   int dcs_cmd;
+  const struct cmd_sink * cmd_sink;  // streaming consumer of the string
+  void * cmd_sink_state;
 
   uchar *tabs;
   bool newtab;
@@ -529,6 +579,7 @@ struct term {
     OSC_NUM,
     OSC_PALETTE,
     DCS_START,
+    APC_START,
     DCS_PARAM,
     DCS_INTERMEDIATE,
     DCS_PASSTHROUGH,
@@ -579,8 +630,24 @@ struct term {
   int sel_scroll;
   pos sel_pos;
 
-  wchar *paste_buffer;
-  int paste_len, paste_pos;
+ /* Mouse motion not reported yet; only the latest position is kept
+    while the application is behind or within a frame of the last report. */
+  bool mouse_move_pending;
+  mouse_button mouse_move_button;
+  mod_keys mouse_move_mods;
+  pos mouse_move_pos;
+  int mouse_move_sent;     // tick count of the last motion report
+
+  /* Paste in progress: text is converted a chunk at a time,
+     and written as fast as the pty takes it. */
+  char *paste_out;         // converted output, null when not pasting
+  uint paste_out_len, paste_out_pos;
+  wchar *paste_buffer;     // text still to convert, null when done
+  uint paste_len, paste_pos;
+  bool paste_all;          // not subject to FilterPasteControls
+  bool paste_bracketed;    // closing bracket still to send
+  int paste_start;         // tick count, for the progress display
+  int paste_shown;         // percentage shown + 1, 0 if none
 
  /* True when we've seen part of a multibyte input char */
   bool in_mb_char;
@@ -601,6 +668,8 @@ struct term {
   // Search results
   termresults results;
 
+  termlinks links;
+
   termimgs imgs;
 
   bool search_window_visible;
@@ -632,15 +701,19 @@ extern void term_open(struct term* term);
 extern void term_copy(struct term* term);
 extern void term_copy_as(struct term* term, char what);
 extern void term_paste(struct term* term, wchar *, uint len, bool all);
-extern void term_send_paste(struct term* term);
+extern uint term_send_paste(struct term* term);
 extern void term_cancel_paste(struct term* term);
 extern void term_cmd(struct term* term, char * cmdpat);
 extern void term_reconfig(struct term* term);
+extern void term_word_chars_changed(void);
 extern void term_flip_screen(struct term* term);
 extern void term_reset_screen(struct term* term);
 extern void term_write(struct term* term, const char *, uint len);
 extern void term_flush(struct term* term);
+extern uint term_suspend_size(struct term* term);
 extern void term_set_focus(struct term* term, bool has_focus, bool may_report);
+extern void term_set_background(struct term* term, bool background);
+extern void term_rehydrate(struct term* term);
 extern int  term_cursor_type(struct term* term);
 extern void term_hide_cursor(struct term* term);
 
@@ -15,6 +15,7 @@ typedef struct {
   size_t len;    // number of actual items at text/cattrs (inc. null terminator)
   wchar *text;   // text to copy (eventually null terminated)
   cattr *cattrs; // matching cattr for each wchar of text
+  bool textonly; // do not collect cattrs
 } clip_workbuf;
 
 static void
@@ -33,130 +34,244 @@ clip_addchar(clip_workbuf * b, wchar chr, cattr * ca)
   if (b->len >= b->capacity) {
     b->capacity = b->len ? b->len * 2 : 1024;  // x2 strategy, 1K chars initially
     b->text = renewn(b->text, b->capacity);
-    b->cattrs = renewn(b->cattrs, b->capacity);
+    if (!b->textonly)
+      b->cattrs = renewn(b->cattrs, b->capacity);
   }
 
   b->text[b->len] = chr;
-  b->cattrs[b->len] = ca ? *ca : CATTR_DEFAULT;
+  if (!b->textonly)
+    b->cattrs[b->len] = ca ? *ca : CATTR_DEFAULT;
   b->len++;
 }
 
+/* Append the selected part of a line, from start */
+static void
+get_line_selection(struct term* term, termline *line, pos start, pos end,
+                   bool rect, bool allinline, clip_workbuf *buf)
+{
+  bool nl = false;
+  pos nlpos;
+  wchar * sixel_clipp = (wchar *)cfg.sixel_clip_char;
+
+ /*
+  * nlpos will point at the maximum position on this line we
+  * should copy up to. So we start it at the end of the line...
+  */
+  nlpos.y = start.y;
+  nlpos.x = term->cols;
+  nlpos.r = false;
+
+ /*
+  * ... move it backwards if there's unused space at the end
+  * of the line (and also set `nl' if this is the case,
+  * because in normal selection mode this means we need a
+  * newline at the end)...
+  */
+  if (allinline) {
+    if (poslt(nlpos, end))
+      nl = true;
+  }
+  else if (!(line->lattr & LATTR_WRAPPED)) {
+    //printf("pos %d\n", nlpos.x);
+    while (nlpos.x && line->chars[nlpos.x - 1].chr == ' ' &&
+           (cfg.trim_selection ||
+            (line->chars[nlpos.x - 1].attr.attr & TATTR_CLEAR)) &&
+           !line->chars[nlpos.x - 1].cc_next && poslt(start, nlpos))
+      decpos(nlpos);
+    if (poslt(nlpos, end))
+      nl = true;
+    //printf("pos %d nl %d\n", nlpos.x, nl);
+  }
+  else {
+   /* Strip added space in wrapped line after window resizing */
+    //printf("wr x %d w %d\n", nlpos.x, line->wrappos);
+    while (nlpos.x > line->wrappos + !(line->lattr & LATTR_WRAPPED2) &&
+           line->chars[nlpos.x - 1].chr == ' ' &&
+           (cfg.trim_selection ||
+            (line->chars[nlpos.x - 1].attr.attr & TATTR_CLEAR)) &&
+           !line->chars[nlpos.x - 1].cc_next && poslt(start, nlpos))
+      decpos(nlpos);
+    //printf("-> x %d w %d\n", nlpos.x, line->wrappos);
+  }
+
+ /*
+  * ... and then clip it to the terminal x coordinate if
+  * we're doing rectangular selection. (In this case we
+  * still did the above, so that copying e.g. the right-hand
+  * column from a table doesn't fill with spaces on the right.)
+  */
+  if (rect) {
+    if (nlpos.x > end.x)
+      nlpos.x = end.x;
+    nl = (start.y < end.y);
+  }
+
+  while (poslt(start, end) && poslt(start, nlpos)) {
+    wchar cbuf[16], *p;
+    int x = start.x;
+
+    if (line->chars[x].chr == UCSWIDE) {
+      start.x++;
+      continue;
+    }
+
+    while (1) {
+      wchar c = line->chars[x].chr;
+      cattr *pca = &line->chars[x].attr;
+      if (c == SIXELCH && *cfg.sixel_clip_char) {
+        // copy replacement into clipboard
+        if (!*sixel_clipp)
+          sixel_clipp = (wchar *)cfg.sixel_clip_char;
+        c = *sixel_clipp++;
+      }
+      else
+        sixel_clipp = (wchar *)cfg.sixel_clip_char;
+      cbuf[0] = c;
+      cbuf[1] = 0;
+
+      for (p = cbuf; *p; p++)
+        clip_addchar(buf, *p, pca);
+
+      if (line->chars[x].cc_next)
+        x += line->chars[x].cc_next;
+      else
+        break;
+    }
+    start.x++;
+  }
+  if (nl) {
+    clip_addchar(buf, '\r', 0);
+    clip_addchar(buf, '\n', 0);
+  }
+}
+
 // except OOM, guaranteed at least emtpy null terminated wstring and one cattr
 static clip_workbuf *
 get_selection(struct term* term, pos start, pos end, bool rect, bool allinline)
 {
   int old_top_x = start.x;    /* needed for rect==1 */
   clip_workbuf *buf = newn(clip_workbuf, 1);
-  *buf = (clip_workbuf){0, 0, 0, 0};  // all members to 0 initially
+  *buf = (clip_workbuf){0, 0, 0, 0, false};  // all members to 0 initially
 
   while (poslt(start, end)) {
-    bool nl = false;
     termline *line = fetch_line(term, start.y);
 
     if (start.y == term->curs.y) {
       line->chars[term->curs.x].attr.attr |= TATTR_ACTCURS;
     }
 
-    pos nlpos;
-    wchar * sixel_clipp = (wchar *)cfg.sixel_clip_char;
-
-   /*
-    * nlpos will point at the maximum position on this line we
-    * should copy up to. So we start it at the end of the line...
-    */
-    nlpos.y = start.y;
-    nlpos.x = term->cols;
-    nlpos.r = false;
-
-   /*
-    * ... move it backwards if there's unused space at the end
-    * of the line (and also set `nl' if this is the case,
-    * because in normal selection mode this means we need a
-    * newline at the end)...
-    */
-    if (allinline) {
-      if (poslt(nlpos, end))
-        nl = true;
-    }
-    else if (!(line->lattr & LATTR_WRAPPED)) {
-      //printf("pos %d\n", nlpos.x);
-      while (nlpos.x && line->chars[nlpos.x - 1].chr == ' ' &&
-             (cfg.trim_selection ||
-              (line->chars[nlpos.x - 1].attr.attr & TATTR_CLEAR)) &&
-             !line->chars[nlpos.x - 1].cc_next && poslt(start, nlpos))
-        decpos(nlpos);
-      if (poslt(nlpos, end))
-        nl = true;
-      //printf("pos %d nl %d\n", nlpos.x, nl);
-    }
-    else {
-     /* Strip added space in wrapped line after window resizing */
-      //printf("wr x %d w %d\n", nlpos.x, line->wrappos);
-      while (nlpos.x > line->wrappos + !(line->lattr & LATTR_WRAPPED2) &&
-             line->chars[nlpos.x - 1].chr == ' ' &&
-             (cfg.trim_selection ||
-              (line->chars[nlpos.x - 1].attr.attr & TATTR_CLEAR)) &&
-             !line->chars[nlpos.x - 1].cc_next && poslt(start, nlpos))
-        decpos(nlpos);
-      //printf("-> x %d w %d\n", nlpos.x, line->wrappos);
-    }
+    get_line_selection(term, line, start, end, rect, allinline, buf);
+    start.y++;
+    start.x = rect ? old_top_x : 0;
 
-   /*
-    * ... and then clip it to the terminal x coordinate if
-    * we're doing rectangular selection. (In this case we
-    * still did the above, so that copying e.g. the right-hand
-    * column from a table doesn't fill with spaces on the right.)
-    */
-    if (rect) {
-      if (nlpos.x > end.x)
-        nlpos.x = end.x;
-      nl = (start.y < end.y);
-    }
+    release_line(line);
+  }
+  clip_addchar(buf, 0, 0);
+  return buf;
+}
 
-    while (poslt(start, end) && poslt(start, nlpos)) {
-      wchar cbuf[16], *p;
-      int x = start.x;
 
-      if (line->chars[x].chr == UCSWIDE) {
-        start.x++;
-        continue;
-      }
+/*
+ * Streaming text export, for copying or passing on large parts of the
+ * scrollback without building the whole text first.
+ * Scrollback lines are decompressed and extracted in batches, which are
+ * shared out among worker threads and then handed to the sink in order.
+ */
+#include <pthread.h>
+#include <unistd.h>
 
-      while (1) {
-        wchar c = line->chars[x].chr;
-        cattr *pca = &line->chars[x].attr;
-        if (c == SIXELCH && *cfg.sixel_clip_char) {
-          // copy replacement into clipboard
-          if (!*sixel_clipp)
-            sixel_clipp = (wchar *)cfg.sixel_clip_char;
-          c = *sixel_clipp++;
-        }
-        else
-          sixel_clipp = (wchar *)cfg.sixel_clip_char;
-        cbuf[0] = c;
-        cbuf[1] = 0;
+#define EXPORT_BATCH 4096   // lines per worker and round
+#define EXPORT_THREADS 8
 
-        for (p = cbuf; *p; p++)
-          clip_addchar(buf, *p, pca);
+typedef void (*text_sink)(void *ctx, const wchar *text, int len);
 
-        if (line->chars[x].cc_next)
-          x += line->chars[x].cc_next;
-        else
-          break;
-      }
-      start.x++;
+typedef struct {
+  struct term* term;
+  pos start, end;
+  bool rect;
+  int rect_x;
+  int y0, y1;   // lines to extract
+  clip_workbuf buf;
+} export_part;
+
+static void *
+export_lines(void *arg)
+{
+  export_part *part = arg;
+  part->buf.len = 0;
+  for (int y = part->y0; y < part->y1; y++) {
+    pos start = y == part->start.y ? part->start
+                : (pos){y, part->rect ? part->rect_x : 0, false};
+    if (!poslt(start, part->end))
+      break;
+    termline *line = fetch_line(part->term, y);
+    get_line_selection(part->term, line, start, part->end, part->rect, false,
+                       &part->buf);
+    release_line(line);
+  }
+  return 0;
+}
+
+static void
+export_text(struct term* term, pos start, pos end, bool rect,
+            text_sink sink, void *ctx)
+{
+  static int nthreads;
+  if (!nthreads)
+    nthreads = max(1, min(EXPORT_THREADS, (int)sysconf(_SC_NPROCESSORS_ONLN)));
+
+  export_part parts[EXPORT_THREADS];
+  for (int i = 0; i < nthreads; i++)
+    parts[i] = (export_part){
+      .term = term, .start = start, .end = end,
+      .rect = rect, .rect_x = start.x,
+      .buf = (clip_workbuf){0, 0, 0, 0, true}
+    };
+
+  int y = start.y;
+  while (y <= end.y) {
+    // share out scrollback lines; screen lines are done in one go,
+    // as fetching them is cheap
+    int n = 0;
+    if (y < 0) {
+      int lines = min(end.y + 1, 0) - y;
+      n = min(nthreads, (lines + EXPORT_BATCH - 1) / EXPORT_BATCH);
     }
-    if (nl) {
-      clip_addchar(buf, '\r', 0);
-      clip_addchar(buf, '\n', 0);
+    else
+      n = 1;
+    pthread_t threads[EXPORT_THREADS];
+    bool started[EXPORT_THREADS];
+    for (int i = 0; i < n; i++) {
+      parts[i].y0 = y;
+      parts[i].y1 = y < 0 ? min(y + EXPORT_BATCH, min(end.y + 1, 0)) : end.y + 1;
+      y = parts[i].y1;
+      started[i] = i && !pthread_create(&threads[i], 0, export_lines, &parts[i]);
+    }
+    for (int i = 0; i < n; i++) {
+      if (!started[i])
+        export_lines(&parts[i]);
+    }
+    for (int i = 0; i < n; i++) {
+      if (started[i])
+        pthread_join(threads[i], 0);
+      if (parts[i].buf.len)
+        sink(ctx, parts[i].buf.text, parts[i].buf.len);
     }
-    start.y++;
-    start.x = rect ? old_top_x : 0;
-
-    release_line(line);
   }
-  clip_addchar(buf, 0, 0);
-  return buf;
+
+  for (int i = 0; i < nthreads; i++)
+    free(parts[i].buf.text);
+}
+
+// with CopyAsRTF or CopyAsHTML, selections spanning more lines are
+// copied as plain text only; an explicitly requested format is kept
+#define COPY_RICH_LINES 10000
+
+static void
+clip_sink(void *ctx, const wchar *text, int len)
+{
+  (void)ctx;
+  win_copy_text_add(text, len);
 }
 
 void
@@ -165,6 +280,17 @@ term_copy_as(struct term* term, char what)
   if (!term->selected)
     return;
 
+  bool rich = what ? what != 't'
+                   : (cfg.copy_as_rtf || cfg.copy_as_html)
+                     && term->sel_end.y - term->sel_start.y <= COPY_RICH_LINES;
+  if (!rich) {
+    win_copy_text_begin();
+    export_text(term, term->sel_start, term->sel_end, term->sel_rect,
+                clip_sink, 0);
+    win_copy_text_end();
+    return;
+  }
+
   clip_workbuf *buf = get_selection(term, term->sel_start, term->sel_end, term->sel_rect, false);
   win_copy_as(buf->text, buf->cattrs, buf->len, what);
   destroy_clip_workbuf(buf);
@@ -217,75 +343,178 @@ contains(string s, wchar c)
   // a bit simplistic, we should probably properly parse...
 }
 
+#define PASTE_CHUNK 16384     // characters converted at a time
+#define PASTE_BUDGET (1 << 20) // bytes written per call
+#define PASTE_PROGRESS 500     // ms before showing progress
+
+/* Convert the next chunk of the paste, or queue the closing bracket */
+static void
+paste_convert(struct term* term)
+{
+  static wchar wbuf[PASTE_CHUNK + 1];
+  uint n = 0;
+  if (term->paste_buffer) {
+    wchar *data = term->paste_buffer;
+    uint i = term->paste_pos;
+    uint end = min(i + PASTE_CHUNK, term->paste_len);
+    if (end < term->paste_len && is_high_surrogate(data[end - 1]))
+      end++;
+
+    // Convert both Windows-style \r\n and Unix-style \n line endings
+    // to \r, because that's what the Enter key sends.
+    for (; i < end; i++) {
+      wchar wc = data[i];
+      if (wc == '\n') {
+        if (i > 0 && data[i - 1] == '\r')
+          continue;
+        wc = '\r';
+      }
+      if (!term->paste_all && *cfg.filter_paste && contains(cfg.filter_paste, wc))
+        wc = ' ';
+      wbuf[n++] = wc;
+    }
+    term->paste_pos = end;
+    if (end == term->paste_len) {
+      free(term->paste_buffer);
+      term->paste_buffer = 0;
+    }
+  }
+
+  uint size = n * cs_cur_max + 6;
+  term->paste_out = renewn(term->paste_out, size);
+  int len = n ? cs_wcntombn(term->paste_out, wbuf, size, n) : 0;
+  if (len < 0)
+    len = 0;
+  if (len && term->echoing)
+    term_write(term, term->paste_out, len);
+  if (!term->paste_buffer && term->paste_bracketed) {
+    memcpy(term->paste_out + len, "\e[201~", 6);
+    len += 6;
+  }
+  term->paste_out_len = len;
+  term->paste_out_pos = 0;
+}
+
+static void
+paste_progress(struct term* term)
+{
+  int shown = 0;
+  if (term->paste_out && term == win_active_terminal()
+      && get_tick_count() - term->paste_start >= PASTE_PROGRESS)
+    shown = (term->paste_buffer
+             ? (unsigned long long)term->paste_pos * 100 / term->paste_len
+             : 100) + 1;
+  if (shown != term->paste_shown)
+    win_show_paste_progress(shown - 1);
+  term->paste_shown = shown;
+}
+
 void
 term_paste(struct term* term, wchar *data, uint len, bool all)
 {
+  // a previous paste is cut short, but still gets its closing bracket
   term_cancel_paste(term);
 
   term->paste_buffer = newn(wchar, len);
-  term->paste_len = term->paste_pos = 0;
-
-  // Copy data to the paste buffer, converting both Windows-style \r\n and
-  // Unix-style \n line endings to \r, because that's what the Enter key sends.
-  for (uint i = 0; i < len; i++) {
-    wchar wc = data[i];
-    if (wc == '\n')
-      wc = '\r';
-    if (!all && *cfg.filter_paste && contains(cfg.filter_paste, wc))
-      wc = ' ';
-
-    if (data[i] != '\n')
-      term->paste_buffer[term->paste_len++] = wc;
-    else if (i == 0 || data[i - 1] != '\r')
-      term->paste_buffer[term->paste_len++] = wc;
+  memcpy(term->paste_buffer, data, len * sizeof(wchar));
+  term->paste_len = len;
+  term->paste_pos = 0;
+  term->paste_all = all;
+  term->paste_start = get_tick_count();
+
+  term->paste_bracketed = term->bracketed_paste;
+  char *out = newn(char, 12);
+  uint rest = 0;
+  if (term->paste_bracketed) {
+    memcpy(out, "\e[200~", 6);
+    rest = 6;
   }
+  if (!len) {
+    free(term->paste_buffer);
+    term->paste_buffer = 0;
+    if (term->paste_bracketed) {
+      memcpy(out + rest, "\e[201~", 6);
+      rest += 6;
+    }
+  }
+  term->paste_out = out;
+  term->paste_out_pos = 0;
+  term->paste_out_len = rest;
 
-  if (term->bracketed_paste)
-    child_write(term->child, "\e[200~", 6);
+  term_reset_screen(term);
   term_send_paste(term);
 }
 
+/* Stop the paste: drop converted output the pty has not taken yet,
+   and queue what is needed to close the bracket ahead of further input */
 void
 term_cancel_paste(struct term* term)
 {
-  if (term->paste_buffer) {
-    free(term->paste_buffer);
-    term->paste_buffer = 0;
-    if (term->bracketed_paste)
-      child_write(term->child, "\e[201~", 6);
+  if (!term->paste_out)
+    return;
+  if (term->paste_bracketed) {
+    uint rest = term->paste_out_len - term->paste_out_pos;
+    if (!term->paste_pos) {
+      // still at the brackets only; nothing to close if none went out
+      if (rest < term->paste_out_len) {
+        child_write(term->child, term->paste_out + term->paste_out_pos, rest);
+        if (term->paste_buffer)
+          child_write(term->child, "\e[201~", 6);
+      }
+    }
+    else {
+      // the closing bracket ends the last chunk, once all is converted
+      uint n = term->paste_buffer ? 6 : min(rest, 6);
+      child_write(term->child, "\e[201~" + 6 - n, n);
+    }
   }
+  free(term->paste_buffer);
+  term->paste_buffer = 0;
+  free(term->paste_out);
+  term->paste_out = 0;
+  term->paste_bracketed = false;
+  paste_progress(term);
 }
 
-void
+/*
+   Write the paste to the pty, as much as it takes without blocking,
+   but behind input queued by child_write; child_proc calls again when
+   the pty becomes writable.
+   Return the number of bytes written.
+ */
+uint
 term_send_paste(struct term* term)
 {
-  int i = term->paste_pos;
-  /* We must not feed more than MAXPASTEMAX bytes into the pty in one chunk 
-     or it will block on the receiving side (write() does not return).
-   */
-#define MAXPASTEMAX 7819
-#define PASTEMAX 2222
-  while (i < term->paste_len && i - term->paste_pos < PASTEMAX
-         && term->paste_buffer[i++] != '\r'
-        )
-    ;
-  if (i < term->paste_len && is_high_surrogate(term->paste_buffer[i]))
-    i++;
-  //printf("term_send_paste pos %d @ %d (len %d)\n", term->paste_pos, i, term->paste_len);
-  child_sendw(term->child, term->paste_buffer + term->paste_pos, i - term->paste_pos);
-  if (i < term->paste_len) {
-    term->paste_pos = i;
-    // if only part of the paste buffer has been written to the child,
-    // the current strategy is to leave the rest pending for on-demand 
-    // invocation of term_send_paste from child_proc within the main loop,
-    // however, that causes partial loss of large paste contents;
-    // worse, without the PASTEMAX limitation, if long contents without 
-    // lineends is pasted, the terminal stalls (#810);
-    // attempts to replace the pending strategy with looping here (to 
-    // paste the whole contents) were not successful to solve the stalling
-  }
-  else
-    term_cancel_paste(term);
+  uint total = 0;
+  while (term->paste_out && !term->child->out && total < PASTE_BUDGET) {
+    if (term->paste_out_pos == term->paste_out_len) {
+      if (!term->paste_buffer) {
+        // the last chunk, with any closing bracket, is out
+        free(term->paste_out);
+        term->paste_bracketed = false;
+        term->paste_out = 0;
+        break;
+      }
+      paste_convert(term);
+      continue;
+    }
+    int n = child_try_write(term->child, term->paste_out + term->paste_out_pos,
+                            term->paste_out_len - term->paste_out_pos);
+    if (n < 0) {
+      // the child is gone
+      free(term->paste_buffer);
+      term->paste_buffer = 0;
+      free(term->paste_out);
+      term->paste_out = 0;
+      break;
+    }
+    if (!n)
+      break;
+    term->paste_out_pos += n;
+    total += n;
+  }
+  paste_progress(term);
+  return total;
 }
 
 void
@@ -300,7 +529,28 @@ term_select_all(struct term* term)
 
 #define dont_debug_user_cmd_clip
 
-static wchar *
+typedef struct {
+  char *s;
+  int len, size;
+} mb_text;
+
+static void
+mb_sink(void *ctx, const wchar *text, int len)
+{
+  mb_text *mb = ctx;
+  // leave room for cs_wcntombn, which may stop short of its buffer size
+  int need = mb->len + len * cs_cur_max + 16;
+  if (need > mb->size) {
+    mb->size = max(need, mb->size * 2);
+    mb->s = renewn(mb->s, mb->size);
+  }
+  int n = cs_wcntombn(mb->s + mb->len, text, mb->size - mb->len - 1, len);
+  if (n > 0)
+    mb->len += n;
+}
+
+/* Get text in the terminal character set */
+static char *
 term_get_text(struct term* term, bool all, bool screen, bool command)
 {
   pos start;
@@ -368,7 +618,7 @@ term_get_text(struct term* term, bool all, bool screen, bool command)
     end = (pos){term_last_nonempty_line(term), term->cols, false};
   }
   else if (!term->selected) {
-    return wcsdup(W(""));
+    return strdup("");
   }
   else {
     start = term->sel_start;
@@ -376,37 +626,29 @@ term_get_text(struct term* term, bool all, bool screen, bool command)
     rect = term->sel_rect;
   }
 
-  clip_workbuf *buf = get_selection(term, start, end, rect, false);
-  wchar * tbuf = wcsdup(buf->text);
-  destroy_clip_workbuf(buf);
-  return tbuf;
+  mb_text mb = {newn(char, 1), 0, 1};
+  export_text(term, start, end, rect, mb_sink, &mb);
+  mb.s[mb.len] = 0;
+  return mb.s;
 }
 
 void
 term_cmd(struct term * term, char * cmd)
 {
   // provide scrollback buffer
-  wchar * wsel = term_get_text(term, true, false, false);
-  char * sel = cs__wcstombs(wsel);
-  free(wsel);
+  char * sel = term_get_text(term, true, false, false);
   setenv("FATTY_BUFFER", sel, true);
   free(sel);
   // provide current selection
-  wsel = term_get_text(term, false, false, false);
-  sel = cs__wcstombs(wsel);
-  free(wsel);
+  sel = term_get_text(term, false, false, false);
   setenv("FATTY_SELECT", sel, true);
   free(sel);
   // provide current screen
-  wsel = term_get_text(term, false, true, false);
-  sel = cs__wcstombs(wsel);
-  free(wsel);
+  sel = term_get_text(term, false, true, false);
   setenv("FATTY_SCREEN", sel, true);
   free(sel);
   // provide last command output
-  wsel = term_get_text(term, false, false, true);
-  sel = cs__wcstombs(wsel);
-  free(wsel);
+  sel = term_get_text(term, false, false, true);
   setenv("FATTY_OUTPUT", sel, true);
   free(sel);
   // provide window title
@@ -455,26 +697,409 @@ term_cmd(struct term * term, char * cmd)
 #include <fcntl.h>
 #include "winpriv.h"  // PADDING
 
-static char *
-term_create_html(struct term * term, FILE * hf, int level)
+/*
+ * Append-only buffer for building HTML; with a file, it is written out
+ * whenever full, otherwise it grows to hold the whole result.
+ */
+typedef struct {
+  FILE * hf;
+  char * s;
+  uint len, size;
+} hbuilder;
+
+#define HB_FLUSH 65536
+
+static void
+hb_reserve(hbuilder * hb, uint n)
 {
-  char * hbuf = hf ? 0 : strdup("");
-  void
-  hprintf(FILE * hf, const char * fmt, ...)
-  {
-    char * buf;
-    va_list va;
+  if (hb->len + n <= hb->size)
+    return;
+  if (hb->hf && hb->len) {
+    fwrite(hb->s, 1, hb->len, hb->hf);
+    hb->len = 0;
+  }
+  if (hb->len + n > hb->size) {
+    hb->size = max(max(hb->size * 2, hb->len + n), (uint)HB_FLUSH);
+    hb->s = renewn(hb->s, hb->size);
+  }
+}
+
+static void
+hb_put(hbuilder * hb, const char * s, uint n)
+{
+  hb_reserve(hb, n);
+  memcpy(hb->s + hb->len, s, n);
+  hb->len += n;
+}
+
+static void
+hprintf(hbuilder * hb, const char * fmt, ...)
+{
+  va_list va;
+  hb_reserve(hb, 256);
+  va_start(va, fmt);
+  uint len = vsnprintf(hb->s + hb->len, hb->size - hb->len, fmt, va);
+  va_end(va);
+  if (len >= hb->size - hb->len) {
+    hb_reserve(hb, len + 1);
     va_start(va, fmt);
-    int len = vasprintf(&buf, fmt, va);
+    vsnprintf(hb->s + hb->len, hb->size - hb->len, fmt, va);
     va_end(va);
-    if (hf)
-      fprintf(hf, "%s", buf);
+  }
+  hb->len += len;
+}
+
+/* Append text as UTF-8, with HTML escapes */
+static void
+hb_put_text(hbuilder * hb, const wchar * ws, uint n)
+{
+  hb_reserve(hb, n * 5);  // "&amp;" is the longest expansion
+  char * o = hb->s + hb->len;
+  for (uint i = 0; i < n; i++) {
+    uint c = ws[i];
+    if (c == '<') {
+      memcpy(o, "&lt;", 4);
+      o += 4;
+    }
+    else if (c == '&') {
+      memcpy(o, "&amp;", 5);
+      o += 5;
+    }
+    else if (c < 0x80)
+      *o++ = c;
+    else if (c < 0x800) {
+      *o++ = 0xC0 | c >> 6;
+      *o++ = 0x80 | (c & 0x3F);
+    }
     else {
-      hbuf = renewn(hbuf, strlen(hbuf) + len + 1);
-      strcat(hbuf, buf);
+      if (is_high_surrogate(c) && i + 1 < n && is_low_surrogate(ws[i + 1])) {
+        c = combine_surrogates(c, ws[++i]);
+        *o++ = 0xF0 | c >> 18;
+        *o++ = 0x80 | ((c >> 12) & 0x3F);
+      }
+      else {
+        if (is_high_surrogate(c) || is_low_surrogate(c))
+          c = 0xFFFD;
+        *o++ = 0xE0 | c >> 12;
+      }
+      *o++ = 0x80 | ((c >> 6) & 0x3F);
+      *o++ = 0x80 | (c & 0x3F);
     }
-    free(buf);
   }
+  hb->len = o - hb->s;
+}
+
+static void
+hb_finish(hbuilder * hb)
+{
+  if (hb->hf) {
+    fwrite(hb->s, 1, hb->len, hb->hf);
+    free(hb->s);
+    hb->s = 0;
+  }
+  else {
+    hb_reserve(hb, 1);
+    hb->s[hb->len] = 0;
+  }
+}
+
+/* Append the class and style attributes of a span, after its od/ev class */
+static void
+html_style(struct term * term, cattr * ca, bool enhtml, hbuilder * hb)
+{
+  colour fg_colour = win_get_colour(FG_COLOUR_I);
+  colour bg_colour = win_get_colour(BG_COLOUR_I);
+  colour bold_colour = win_get_colour(BOLD_COLOUR_I);
+
+  int fgi = (ca->attr & ATTR_FGMASK) >> ATTR_FGSHIFT;
+  int bgi = (ca->attr & ATTR_BGMASK) >> ATTR_BGSHIFT;
+  bool dim = ca->attr & ATTR_DIM;
+  bool rev = ca->attr & ATTR_REVERSE;
+
+  // colour setup preparations;
+  // we could perhaps reuse apply_attr_colour here, but again 
+  // the situation is specific: some terminal handling (manual bolding) 
+  // is not applicable in HTML export, and we do not want to simply 
+  // always retrieve a plain colour value because we want to specify 
+  // colour style or class only if the respective default is overridden
+  colour fg = fgi >= TRUE_COLOUR ? ca->truefg : win_get_colour(fgi);
+  colour bg = bgi >= TRUE_COLOUR ? ca->truebg : win_get_colour(bgi);
+  // separate ANSI values subject to BoldAsColour
+  int fga = fgi >= ANSI0 ? fgi & 0xFF : 999;
+  int bga = bgi >= ANSI0 ? bgi & 0xFF : 999;
+  if ((ca->attr & ATTR_BOLD) && fga < 8 && term->enable_bold_colour && !rev) {
+    if (bold_colour != (colour)-1)
+      fg = bold_colour;
+  }
+  if (dim) {
+    fg = ((fg & 0xFEFEFEFE) >> 1)
+         // dim against terminal bg (as in apply_attr_colour)
+         + ((win_get_colour(BG_COLOUR_I) & 0xFEFEFEFE) >> 1);
+  }
+  if (rev) {
+    fgi ^= bgi; fga ^= bga; fg ^= bg;
+    bgi ^= fgi; bga ^= fga; bg ^= fg;
+    fgi ^= bgi; fga ^= bga; fg ^= bg;
+  }
+  cattr ac = apply_attr_colour(*ca, ACM_TERM);
+  fg = ac.truefg;
+  bg = ac.truebg;
+
+  // add marker classes
+  if (ca->attr & ATTR_FRAMED)
+    hprintf(hb, " emoji");  // mark emoji style
+
+  // style adding function
+  bool with_style = false;
+  void add_style(char * s) {
+    if (!with_style) {
+      hprintf(hb, "' style='%s", s);
+      with_style = true;
+    }
+    else
+      hprintf(hb, " %s", s);
+  }
+  void add_color(char * pre, int col) {
+    colour ansii = win_get_colour(ANSI0 + col);
+    uchar r = red(ansii), g = green(ansii), b = blue(ansii);
+    add_style("");
+    hprintf(hb, "%scolor: #%02X%02X%02X;", pre, r, g, b);
+  }
+
+  // add style classes or resolved styles;
+  // explicit style= attributes instead of xterm-compatible classes
+  // are used for the sake of tools that do not take styles by class
+  // (Powerpoint; Word would take id= but not class=)
+  if (ca->attr & ATTR_BOLD) {
+    if (enhtml)
+      add_style("font-weight: bold;");
+    else
+      hprintf(hb, " bd");
+  }
+  if (ca->attr & ATTR_ITALIC) {
+    if (enhtml)
+      add_style("font-style: italic;");
+    else
+      hprintf(hb, " it");
+  }
+  if (!enhtml) {
+    if ((ca->attr & (ATTR_UNDER | ATTR_STRIKEOUT)) == (ATTR_UNDER | ATTR_STRIKEOUT))
+      hprintf(hb, " lu");
+    else if (ca->attr & ATTR_STRIKEOUT)
+      hprintf(hb, " st");
+    else if (ca->attr & UNDER_MASK)
+      hprintf(hb, " ul");
+  }
+  int findex = (ca->attr & FONTFAM_MASK) >> ATTR_FONTFAM_SHIFT;
+  if (findex > 10)
+    findex = 0;
+  if (findex) {
+    if (enhtml) {
+      if (*cfg.fontfams[findex].name || findex == 10) {
+        add_style("font-family: ");
+        if (*cfg.fontfams[findex].name) {
+          char * fn = cs__wcstoutf(cfg.fontfams[findex].name);
+          hprintf(hb, "\"%s\";", fn);
+          free(fn);
+        }
+        else
+          hprintf(hb, "\"F25 Blackletter Typewriter\";");
+      }
+    }
+    else
+      hprintf(hb, " font%d", findex);
+  }
+
+  // catch and verify predefined colours and apply their colour classes
+  if (fgi == FG_COLOUR_I) {
+    if ((ca->attr & ATTR_BOLD) && term->enable_bold_colour) {
+      if (fg == bold_colour) {
+        if (enhtml) {
+          add_style("color: ");
+          hprintf(hb, "#%02X%02X%02X;",
+                  red(bold_colour), green(bold_colour), blue(bold_colour));
+        }
+        else
+          hprintf(hb, " bold-color");
+        fg = (colour)-1;
+      }
+    }
+    else if (fg == fg_colour)
+      fg = (colour)-1;
+  }
+  else if (fga < 8 && cfg.bold_as_colour && (ca->attr & ATTR_BOLD)
+           && fg == win_get_colour(ANSI0 + fga + 8)
+          )
+  {
+    if (enhtml)
+      add_color("", fga + 8);
+    else
+      hprintf(hb, " fg-color%d", fga + 8);
+    fg = (colour)-1;
+  }
+  else if (fga < 16 && fg == win_get_colour(ANSI0 + fga)) {
+    if (enhtml)
+      add_color("", fga);
+    else
+      hprintf(hb, " fg-color%d", fga);
+    fg = (colour)-1;
+  }
+  if (bgi == BG_COLOUR_I && bg == bg_colour)
+    bg = (colour)-1;
+  else if (bga < 16 && bg == win_get_colour(ANSI0 + bga)) {
+    if (enhtml)
+      add_color("background-", bga);
+    else
+      hprintf(hb, " bg-color%d", bga);
+    bg = (colour)-1;
+  }
+
+  // add individual styles
+
+  // add individual colours, or fix unmatched colours
+  if (fg != (colour)-1) {
+    uchar r = red(fg), g = green(fg), b = blue(fg);
+    add_style("");
+    hprintf(hb, "color: #%02X%02X%02X;", r, g, b);
+  }
+  if (bg != (colour)-1) {
+    uchar r = red(bg), g = green(bg), b = blue(bg);
+    add_style("");
+    hprintf(hb, "background-color: #%02X%02X%02X;", r, g, b);
+  }
+
+  if (enhtml && (ca->attr & (UNDER_MASK | ATTR_STRIKEOUT | ATTR_OVERL))) {
+    // add explicit style= lining attributes for the sake of tools 
+    // that do not take styles by class (Powerpoint)
+    add_style("text-decoration:");
+    if (ca->attr & UNDER_MASK)
+      hprintf(hb, " underline");
+    if (ca->attr & ATTR_STRIKEOUT)
+      hprintf(hb, " line-through");
+    if (ca->attr & ATTR_OVERL)
+      hprintf(hb, " overline");
+    hprintf(hb, ";");
+  }
+  else if (ca->attr & ATTR_OVERL) {
+    add_style("text-decoration-line: overline");
+    if (ca->attr & ATTR_STRIKEOUT)
+      hprintf(hb, " line-through");
+    if (ca->attr & ATTR_UNDER)
+      hprintf(hb, " underline");
+    hprintf(hb, ";");
+  }
+  if (ca->attr & ATTR_BROKENUND)
+    if (ca->attr & ATTR_DOUBLYUND)
+      add_style("text-decoration-style: dashed;");
+    else
+      add_style("text-decoration-style: dotted;");
+  else if ((ca->attr & UNDER_MASK) == ATTR_CURLYUND)
+    add_style("text-decoration-style: wavy;");
+  else if ((ca->attr & UNDER_MASK) == ATTR_DOUBLYUND)
+    add_style("text-decoration-style: double;");
+
+  colour ul = (ca->attr & ATTR_ULCOLOUR) ? ca->ulcolr : cfg.underl_colour;
+  if (ul != (colour)-1 && (ca->attr & (UNDER_MASK | ATTR_STRIKEOUT | ATTR_OVERL))) {
+    uchar r = red(ul), g = green(ul), b = blue(ul);
+    add_style("");
+    hprintf(hb, "text-decoration-color: #%02X%02X%02X;", r, g, b);
+  }
+
+  if (ca->attr & ATTR_INVISIBLE)
+    add_style("visibility: hidden;");
+  else {
+    // add JavaScript triggers
+    if (ca->attr & ATTR_BLINK2)
+      hprintf(hb, "' name='rapid");
+    else if (ca->attr & ATTR_BLINK)
+      hprintf(hb, "' name='blink");
+  }
+
+  // mark cursor position
+  if (ca->attr & (TATTR_ACTCURS | TATTR_PASCURS)) {
+    hprintf(hb, "' id='cursor");
+    fg = win_get_colour(CURSOR_TEXT_COLOUR_I);
+    // more precise cursor colour adjustments could be made...
+  }
+}
+
+/*
+ * Styles of the runs in an export; each distinct attribute combination
+ * is resolved to its style text once.
+ */
+typedef struct {
+  cattr ca;
+  uint pos, len;  // style text in the table's builder
+} html_style_entry;
+
+typedef struct {
+  html_style_entry * entries;
+  uint size, count;  // size is a power of 2
+  hbuilder text;
+} html_styles;
+
+// cattr differences that do not affect the HTML rendition
+#define IGNATTR (ATTR_WIDE | TATTR_COMBINING)
+
+static bool
+html_style_equal(cattr * a, cattr * b)
+{
+  return (a->attr & ~IGNATTR) == (b->attr & ~IGNATTR)
+      && a->truefg == b->truefg
+      && a->truebg == b->truebg
+      && a->ulcolr == b->ulcolr;
+}
+
+static uint
+html_style_hash(cattr * ca)
+{
+  unsigned long long h = (ca->attr & ~IGNATTR) * 0x9E3779B97F4A7C15ull;
+  h ^= ((unsigned long long)ca->truefg << 32 | ca->truebg) * 0xC2B2AE3D27D4EB4Full;
+  h ^= ca->ulcolr * 0x165667B19E3779F9ull;
+  return h ^ h >> 29;
+}
+
+/* Write the style attributes for ca, resolving them on first use */
+static void
+html_put_style(struct term * term, html_styles * st, cattr * ca, bool enhtml,
+               hbuilder * hb)
+{
+  if (st->count * 2 >= st->size) {
+    // grow and rehash
+    uint size = st->size ? st->size * 2 : 64;
+    html_style_entry * entries = newn(html_style_entry, size);
+    for (uint i = 0; i < size; i++)
+      entries[i].len = (uint)-1;
+    for (uint i = 0; i < st->size; i++)
+      if (st->entries[i].len != (uint)-1) {
+        uint j = html_style_hash(&st->entries[i].ca) & (size - 1);
+        while (entries[j].len != (uint)-1)
+          j = (j + 1) & (size - 1);
+        entries[j] = st->entries[i];
+      }
+    free(st->entries);
+    st->entries = entries;
+    st->size = size;
+  }
+
+  uint j = html_style_hash(ca) & (st->size - 1);
+  html_style_entry * e;
+  while ((e = &st->entries[j])->len != (uint)-1 && !html_style_equal(&e->ca, ca))
+    j = (j + 1) & (st->size - 1);
+  if (e->len == (uint)-1) {
+    e->ca = *ca;
+    e->pos = st->text.len;
+    html_style(term, ca, enhtml, &st->text);
+    e->len = st->text.len - e->pos;
+    st->count++;
+  }
+  hb_put(hb, st->text.s + e->pos, e->len);
+}
+
+static char *
+term_create_html(struct term * term, FILE * hf, int level)
+{
+  hbuilder out = {hf, 0, 0, 0}, * hb = &out;
 
   pos start = term->sel_start;
   pos end = term->sel_end;
@@ -491,7 +1116,7 @@ term_create_html(struct term * term, FILE * hf, int level)
   colour fg_colour = win_get_colour(FG_COLOUR_I);
   colour bg_colour = win_get_colour(BG_COLOUR_I);
   colour bold_colour = win_get_colour(BOLD_COLOUR_I);
-  hprintf(hf,
+  hprintf(hb,
     "<head>\n"
     "  <meta name='generator' content='mintty'/>\n"
     "  <meta http-equiv='Content-Type' content='text/html; charset=UTF-8'/>\n"
@@ -503,28 +1128,28 @@ term_create_html(struct term * term, FILE * hf, int level)
     "  #vt100 pre { font-family: inherit; margin: 0; padding: 0; }\n"
     );
   if (level >= 3)
-    hprintf(hf, "  body.mintty { margin: 0; padding: 0; }\n");
-  hprintf(hf, "  #vt100 span {\n");
+    hprintf(hb, "  body.mintty { margin: 0; padding: 0; }\n");
+  hprintf(hb, "  #vt100 span {\n");
   if (level >= 2) {
     // font needed in <span> for some tools (e.g. Powerpoint)
-    hprintf(hf,
+    hprintf(hb,
       "    font-family: '%s', 'Lucida Console ', 'Consolas', monospace;\n"
                        // ? 'Lucida Sans Typewriter', 'Courier New', 'Courier'
       , font_name);
     if (cfg.underl_colour != (colour)-1)
-      hprintf(hf, "    text-decoration-color: #%02X%02X%02X;\n",
+      hprintf(hb, "    text-decoration-color: #%02X%02X%02X;\n",
               red(cfg.underl_colour), green(cfg.underl_colour), blue(cfg.underl_colour));
   }
   free(font_name);
-  hprintf(hf, "  }\n");
+  hprintf(hb, "  }\n");
 
-  hprintf(hf,
+  hprintf(hb,
     "  #vt100 {\n"
     "    border: 0px solid;\n"
     "    padding: %dpx;\n"
     , PADDING);
   if (level >= 2) {
-    hprintf(hf,
+    hprintf(hb,
       "    line-height: %d%%;\n"
       "    font-size: %dpt;\n"
       , line_scale, font_size);
@@ -546,396 +1171,151 @@ term_create_html(struct term * term, FILE * hf, int level)
       }
   
       if (alpha >= 0) {
-        hprintf(hf, "  }\n");
-        hprintf(hf, "  #vt100 pre {\n");
-        hprintf(hf, "    background-color: rgba(%d, %d, %d, %.3f);\n",
+        hprintf(hb, "  }\n");
+        hprintf(hb, "  #vt100 pre {\n");
+        hprintf(hb, "    background-color: rgba(%d, %d, %d, %.3f);\n",
                 red(bg_colour), green(bg_colour), blue(bg_colour),
                 (255.0 - alpha) / 255);
-        hprintf(hf, "  }\n");
-        hprintf(hf, "  .background {\n");
+        hprintf(hb, "  }\n");
+        hprintf(hb, "  .background {\n");
       }
   
-      hprintf(hf, "    background-image: url('%s');\n", bg);
+      hprintf(hb, "    background-image: url('%s');\n", bg);
       if (!tiled) {
-        hprintf(hf, "    background-attachment: no-repeat;\n");
-        hprintf(hf, "    background-size: 100%% 100%%;\n");
+        hprintf(hb, "    background-attachment: no-repeat;\n");
+        hprintf(hb, "    background-size: 100%% 100%%;\n");
       }
   
       free(bg);
   
       if (alpha < 0) {
-        hprintf(hf, "  }\n");
-        hprintf(hf, "  #vt100 pre {\n");
+        hprintf(hb, "  }\n");
+        hprintf(hb, "  #vt100 pre {\n");
       }
     }
     else
     {
-      hprintf(hf, "  }\n");
-      hprintf(hf, "  #vt100 pre {\n");
-      hprintf(hf, "    background-color: #%02X%02X%02X;\n",
+      hprintf(hb, "  }\n");
+      hprintf(hb, "  #vt100 pre {\n");
+      hprintf(hb, "    background-color: #%02X%02X%02X;\n",
               red(bg_colour), green(bg_colour), blue(bg_colour));
     }
     // add style for <pre>
     // default color needed here for some tools (e.g. Powerpoint)
-    hprintf(hf, "    color: #%02X%02X%02X;\n",
+    hprintf(hb, "    color: #%02X%02X%02X;\n",
             red(fg_colour), green(fg_colour), blue(fg_colour));
   }
 
   // float needed here to avoid placement left of previous text (Thunderbird)
-  hprintf(hf, "    float: left;\n");
-  hprintf(hf, "  }\n");
+  hprintf(hb, "    float: left;\n");
+  hprintf(hb, "  }\n");
   // add xterm-compatible style classes for some text attributes
-  hprintf(hf, "  .bd { font-weight: bold }\n");
-  hprintf(hf, "  .it { font-style: italic }\n");
-  hprintf(hf, "  .ul { text-decoration-line: underline }\n");
-  hprintf(hf, "  .st { text-decoration-line: line-through }\n");
-  hprintf(hf, "  .lu { text-decoration-line: line-through underline }\n");
+  hprintf(hb, "  .bd { font-weight: bold }\n");
+  hprintf(hb, "  .it { font-style: italic }\n");
+  hprintf(hb, "  .ul { text-decoration-line: underline }\n");
+  hprintf(hb, "  .st { text-decoration-line: line-through }\n");
+  hprintf(hb, "  .lu { text-decoration-line: line-through underline }\n");
   if (bold_colour != (colour)-1)
-    hprintf(hf, "  .bold-color { color: #%02X%02X%02X }\n",
+    hprintf(hb, "  .bold-color { color: #%02X%02X%02X }\n",
             red(bold_colour), green(bold_colour), blue(bold_colour));
   for (int i = 0; i < 16; i++) {
     colour ansii = win_get_colour(ANSI0 + i);
     uchar r = red(ansii), g = green(ansii), b = blue(ansii);
-    hprintf(hf, "  .fg-color%d { color: #%02X%02X%02X }"
+    hprintf(hb, "  .fg-color%d { color: #%02X%02X%02X }"
                 " .bg-color%d { background-color: #%02X%02X%02X }\n",
                 i, r, g, b, i, r, g, b);
   }
   colour cursor_colour = win_get_colour(CURSOR_COLOUR_I);
-  hprintf(hf, "  #cursor { background-color: #%02X%02X%02X }\n",
+  hprintf(hb, "  #cursor { background-color: #%02X%02X%02X }\n",
           red(cursor_colour), green(cursor_colour), blue(cursor_colour));
 
   if (level >= 2) {
     for (int i = 1; i <= 10; i++)
       if (*cfg.fontfams[i].name) {
         char * fn = cs__wcstoutf(cfg.fontfams[i].name);
-        hprintf(hf, "  .font%d { font-family: '%s' }\n", i, fn);
+        hprintf(hb, "  .font%d { font-family: '%s' }\n", i, fn);
         free(fn);
       }
     if (!*cfg.fontfams[10].name)
-      hprintf(hf, "  .font10 { font-family: 'F25 Blackletter Typewriter' }\n");
-  }
-
-  hprintf(hf, "  </style>\n");
-  hprintf(hf, "  <script>\n");
-  hprintf(hf, "  var b1 = 500; var b2 = 300;\n");
-  hprintf(hf, "  function visib (tag, state, timeout) {\n");
-  hprintf(hf, "    var bl = document.getElementsByName(tag);\n");
-  hprintf(hf, "    var vv; if (state) vv = 'visible'; else vv = 'hidden';\n");
-  hprintf(hf, "    var i;\n");
-  hprintf(hf, "    for (i = 0; i < bl.length; i++) {\n");
-  hprintf(hf, "      bl[i].style.visibility = vv;\n");
-  hprintf(hf, "    }\n");
-  hprintf(hf, "    window.setTimeout ('visib (\"' + tag + '\", ' + !state + ', ' + timeout + ')', timeout);\n");
-  hprintf(hf, "  }\n");
-  hprintf(hf, "  function setup () {\n");
-  hprintf(hf, "    window.setTimeout ('visib (\"blink\", 0, b1)', b1);\n");
-  hprintf(hf, "    window.setTimeout ('visib (\"rapid\", 0, b2)', b2);\n");
-  hprintf(hf, "  }\n");
-  hprintf(hf, "  </script>\n");
-  hprintf(hf, "</head>\n\n");
-  hprintf(hf, "<body class=fatty onload='setup();'>\n");
-  //hprintf(hf, "  <table border=0 cellpadding=0 cellspacing=0><tr><td>\n");
-  hprintf(hf, "  <div class=background id='vt100'>\n");
-  hprintf(hf, "   <pre>");
-
-  clip_workbuf * buf = get_selection(term, start, end, rect, level >= 3);
-  int i0 = 0;
-  bool odd = true;
-  for (uint i = 0; i < buf->len; i++) {
-    if (!buf->text[i] || buf->text[i] == '\r' || buf->text[i] == '\n'
-        // buf->cattrs[i] ~!= buf->cattrs[i0] ?
-        // we need to check more than termattrs_equal_fg
-        // but less than termchars_equal_override
-# define IGNATTR (ATTR_WIDE | TATTR_COMBINING)
-        || (buf->cattrs[i].attr & ~IGNATTR) != (buf->cattrs[i0].attr & ~IGNATTR)
-        || buf->cattrs[i].truefg != buf->cattrs[i0].truefg
-        || buf->cattrs[i].truebg != buf->cattrs[i0].truebg
-        || buf->cattrs[i].ulcolr != buf->cattrs[i0].ulcolr
-       )
-    {
-      // flush chunk with equal attributes
-      hprintf(hf, "<span class='%s", odd ? "od" : "ev");
-
-      cattr * ca = &buf->cattrs[i0];
-      int fgi = (ca->attr & ATTR_FGMASK) >> ATTR_FGSHIFT;
-      int bgi = (ca->attr & ATTR_BGMASK) >> ATTR_BGSHIFT;
-      bool dim = ca->attr & ATTR_DIM;
-      bool rev = ca->attr & ATTR_REVERSE;
-
-      // colour setup preparations;
-      // we could perhaps reuse apply_attr_colour here, but again 
-      // the situation is specific: some terminal handling (manual bolding) 
-      // is not applicable in HTML export, and we do not want to simply 
-      // always retrieve a plain colour value because we want to specify 
-      // colour style or class only if the respective default is overridden
-      colour fg = fgi >= TRUE_COLOUR ? ca->truefg : win_get_colour(fgi);
-      colour bg = bgi >= TRUE_COLOUR ? ca->truebg : win_get_colour(bgi);
-      // separate ANSI values subject to BoldAsColour
-      int fga = fgi >= ANSI0 ? fgi & 0xFF : 999;
-      int bga = bgi >= ANSI0 ? bgi & 0xFF : 999;
-      if ((ca->attr & ATTR_BOLD) && fga < 8 && term->enable_bold_colour && !rev) {
-        if (bold_colour != (colour)-1)
-          fg = bold_colour;
-      }
-      if (dim) {
-        fg = ((fg & 0xFEFEFEFE) >> 1)
-             // dim against terminal bg (as in apply_attr_colour)
-             + ((win_get_colour(BG_COLOUR_I) & 0xFEFEFEFE) >> 1);
-      }
-      if (rev) {
-        fgi ^= bgi; fga ^= bga; fg ^= bg;
-        bgi ^= fgi; bga ^= fga; bg ^= fg;
-        fgi ^= bgi; fga ^= bga; fg ^= bg;
-      }
-      cattr ac = apply_attr_colour(*ca, ACM_TERM);
-      fg = ac.truefg;
-      bg = ac.truebg;
-
-      // add marker classes
-      if (ca->attr & ATTR_FRAMED)
-        hprintf(hf, " emoji");  // mark emoji style
-
-      // style adding function
-      bool with_style = false;
-      void add_style(char * s) {
-        if (!with_style) {
-          hprintf(hf, "' style='%s", s);
-          with_style = true;
-        }
-        else
-          hprintf(hf, " %s", s);
-      }
-      void add_color(char * pre, int col) {
-        colour ansii = win_get_colour(ANSI0 + col);
-        uchar r = red(ansii), g = green(ansii), b = blue(ansii);
-        add_style("");
-        hprintf(hf, "%scolor: #%02X%02X%02X;", pre, r, g, b);
-      }
-
-      // add style classes or resolved styles;
-      // explicit style= attributes instead of xterm-compatible classes
-      // are used for the sake of tools that do not take styles by class
-      // (Powerpoint; Word would take id= but not class=)
-      if (ca->attr & ATTR_BOLD) {
-        if (enhtml)
-          add_style("font-weight: bold;");
-        else
-          hprintf(hf, " bd");
-      }
-      if (ca->attr & ATTR_ITALIC) {
-        if (enhtml)
-          add_style("font-style: italic;");
-        else
-          hprintf(hf, " it");
-      }
-      if (!enhtml) {
-        if ((ca->attr & (ATTR_UNDER | ATTR_STRIKEOUT)) == (ATTR_UNDER | ATTR_STRIKEOUT))
-          hprintf(hf, " lu");
-        else if (ca->attr & ATTR_STRIKEOUT)
-          hprintf(hf, " st");
-        else if (ca->attr & UNDER_MASK)
-          hprintf(hf, " ul");
-      }
-      int findex = (ca->attr & FONTFAM_MASK) >> ATTR_FONTFAM_SHIFT;
-      if (findex > 10)
-        findex = 0;
-      if (findex) {
-        if (enhtml) {
-          if (*cfg.fontfams[findex].name || findex == 10) {
-            add_style("font-family: ");
-            if (*cfg.fontfams[findex].name) {
-              char * fn = cs__wcstoutf(cfg.fontfams[findex].name);
-              hprintf(hf, "\"%s\";", fn);
-              free(fn);
-            }
-            else
-              hprintf(hf, "\"F25 Blackletter Typewriter\";");
-          }
-        }
-        else
-          hprintf(hf, " font%d", findex);
-      }
-
-      // catch and verify predefined colours and apply their colour classes
-      if (fgi == FG_COLOUR_I) {
-        if ((ca->attr & ATTR_BOLD) && term->enable_bold_colour) {
-          if (fg == bold_colour) {
-            if (enhtml) {
-              add_style("color: ");
-              hprintf(hf, "#%02X%02X%02X;",
-                      red(bold_colour), green(bold_colour), blue(bold_colour));
-            }
-            else
-              hprintf(hf, " bold-color");
-            fg = (colour)-1;
-          }
-        }
-        else if (fg == fg_colour)
-          fg = (colour)-1;
-      }
-      else if (fga < 8 && cfg.bold_as_colour && (ca->attr & ATTR_BOLD)
-               && fg == win_get_colour(ANSI0 + fga + 8)
-              )
-      {
-        if (enhtml)
-          add_color("", fga + 8);
-        else
-          hprintf(hf, " fg-color%d", fga + 8);
-        fg = (colour)-1;
-      }
-      else if (fga < 16 && fg == win_get_colour(ANSI0 + fga)) {
-        if (enhtml)
-          add_color("", fga);
-        else
-          hprintf(hf, " fg-color%d", fga);
-        fg = (colour)-1;
-      }
-      if (bgi == BG_COLOUR_I && bg == bg_colour)
-        bg = (colour)-1;
-      else if (bga < 16 && bg == win_get_colour(ANSI0 + bga)) {
-        if (enhtml)
-          add_color("background-", bga);
-        else
-          hprintf(hf, " bg-color%d", bga);
-        bg = (colour)-1;
-      }
-
-      // add individual styles
-
-      // add individual colours, or fix unmatched colours
-      if (fg != (colour)-1) {
-        uchar r = red(fg), g = green(fg), b = blue(fg);
-        add_style("");
-        hprintf(hf, "color: #%02X%02X%02X;", r, g, b);
-      }
-      if (bg != (colour)-1) {
-        uchar r = red(bg), g = green(bg), b = blue(bg);
-        add_style("");
-        hprintf(hf, "background-color: #%02X%02X%02X;", r, g, b);
-      }
-
-      if (enhtml && (ca->attr & (UNDER_MASK | ATTR_STRIKEOUT | ATTR_OVERL))) {
-        // add explicit style= lining attributes for the sake of tools 
-        // that do not take styles by class (Powerpoint)
-        add_style("text-decoration:");
-        if (ca->attr & UNDER_MASK)
-          hprintf(hf, " underline");
-        if (ca->attr & ATTR_STRIKEOUT)
-          hprintf(hf, " line-through");
-        if (ca->attr & ATTR_OVERL)
-          hprintf(hf, " overline");
-        hprintf(hf, ";");
-      }
-      else if (ca->attr & ATTR_OVERL) {
-        add_style("text-decoration-line: overline");
-        if (ca->attr & ATTR_STRIKEOUT)
-          hprintf(hf, " line-through");
-        if (ca->attr & ATTR_UNDER)
-          hprintf(hf, " underline");
-        hprintf(hf, ";");
-      }
-      if (ca->attr & ATTR_BROKENUND)
-        if (ca->attr & ATTR_DOUBLYUND)
-          add_style("text-decoration-style: dashed;");
-        else
-          add_style("text-decoration-style: dotted;");
-      else if ((ca->attr & UNDER_MASK) == ATTR_CURLYUND)
-        add_style("text-decoration-style: wavy;");
-      else if ((ca->attr & UNDER_MASK) == ATTR_DOUBLYUND)
-        add_style("text-decoration-style: double;");
-
-      colour ul = (ca->attr & ATTR_ULCOLOUR) ? ca->ulcolr : cfg.underl_colour;
-      if (ul != (colour)-1 && (ca->attr & (UNDER_MASK | ATTR_STRIKEOUT | ATTR_OVERL))) {
-        uchar r = red(ul), g = green(ul), b = blue(ul);
-        add_style("");
-        hprintf(hf, "text-decoration-color: #%02X%02X%02X;", r, g, b);
-      }
-
-      if (ca->attr & ATTR_INVISIBLE)
-        add_style("visibility: hidden;");
-      else {
-        // add JavaScript triggers
-        if (ca->attr & ATTR_BLINK2)
-          hprintf(hf, "' name='rapid");
-        else if (ca->attr & ATTR_BLINK)
-          hprintf(hf, "' name='blink");
-      }
+      hprintf(hb, "  .font10 { font-family: 'F25 Blackletter Typewriter' }\n");
+  }
 
-      // mark cursor position
-      if (ca->attr & (TATTR_ACTCURS | TATTR_PASCURS)) {
-        hprintf(hf, "' id='cursor");
-        fg = win_get_colour(CURSOR_TEXT_COLOUR_I);
-        // more precise cursor colour adjustments could be made...
-      }
+  hprintf(hb, "  </style>\n");
+  hprintf(hb, "  <script>\n");
+  hprintf(hb, "  var b1 = 500; var b2 = 300;\n");
+  hprintf(hb, "  function visib (tag, state, timeout) {\n");
+  hprintf(hb, "    var bl = document.getElementsByName(tag);\n");
+  hprintf(hb, "    var vv; if (state) vv = 'visible'; else vv = 'hidden';\n");
+  hprintf(hb, "    var i;\n");
+  hprintf(hb, "    for (i = 0; i < bl.length; i++) {\n");
+  hprintf(hb, "      bl[i].style.visibility = vv;\n");
+  hprintf(hb, "    }\n");
+  hprintf(hb, "    window.setTimeout ('visib (\"' + tag + '\", ' + !state + ', ' + timeout + ')', timeout);\n");
+  hprintf(hb, "  }\n");
+  hprintf(hb, "  function setup () {\n");
+  hprintf(hb, "    window.setTimeout ('visib (\"blink\", 0, b1)', b1);\n");
+  hprintf(hb, "    window.setTimeout ('visib (\"rapid\", 0, b2)', b2);\n");
+  hprintf(hb, "  }\n");
+  hprintf(hb, "  </script>\n");
+  hprintf(hb, "</head>\n\n");
+  hprintf(hb, "<body class=fatty onload='setup();'>\n");
+  //hprintf(hb, "  <table border=0 cellpadding=0 cellspacing=0><tr><td>\n");
+  hprintf(hb, "  <div class=background id='vt100'>\n");
+  hprintf(hb, "   <pre>");
+
+  // stream the selection line by line, in runs of equal attributes
+  html_styles styles = {0, 0, 0, {0, 0, 0, 0}};
+  clip_workbuf buf = {0, 0, 0, 0, false};
+  int old_top_x = start.x;    /* needed for rect==1 */
+  bool odd = true;
+  while (poslt(start, end)) {
+    termline *line = fetch_line(term, start.y);
+    if (start.y == term->curs.y) {
+      line->chars[term->curs.x].attr.attr |= TATTR_ACTCURS;
+    }
+    buf.len = 0;
+    get_line_selection(term, line, start, end, rect, level >= 3, &buf);
+    release_line(line);
+    start.y++;
+    start.x = rect ? old_top_x : 0;
 
-      // retrieve chunk of text from buffer
-      wchar save = buf->text[i];
-      buf->text[i] = 0;
-      char * s = cs__wcstoutf(&buf->text[i0]);
-      buf->text[i] = save;
-
-      // write chunk, apply HTML escapes
-      char * s1 = strpbrk(s, "<&");
-      if (s1) {
-        hprintf(hf, "'>");
-        char * s0 = s;
-        do {
-          if (*s0 == '<') {
-            hprintf(hf, "&lt;");
-            s0 ++;
-          }
-          else if (*s0 == '&') {
-            hprintf(hf, "&amp;");
-            s0 ++;
-          }
-          else {
-            char c = s1 ? *s1 : 0;
-            if (s1)
-              *s1 = 0;
-            hprintf(hf, "%s", s0);
-            if (s1) {
-              *s1 = c;
-              s0 = s1;
-            }
-            else
-              s0 += strlen(s0);
-          }
-          s1 = strpbrk(s0, "<&");
-        } while (*s0);
-        hprintf(hf, "</span>");
+    uint len = buf.len;
+    bool nl = len >= 2 && buf.text[len - 1] == '\n';
+    if (nl)
+      len -= 2;
+    for (uint i0 = 0, i = 1; i0 < len; i++) {
+      if (i == len || !html_style_equal(&buf.cattrs[i], &buf.cattrs[i0])) {
+        // flush chunk with equal attributes
+        hprintf(hb, "<span class='%s", odd ? "od" : "ev");
+        html_put_style(term, &styles, &buf.cattrs[i0], enhtml, hb);
+        hb_put(hb, "'>", 2);
+        hb_put_text(hb, &buf.text[i0], i - i0);
+        hb_put(hb, "</span>", 7);
+        i0 = i;
       }
-      else
-        hprintf(hf, "'>%s</span>", s);
-      free(s);
-
-      // forward chunk pointer
-      i0 = i;
     }
 
-    // forward newlines
-    if (buf->text[i] == '\r') {
-      i++;
-      i0 = i;
-    }
-    if (buf->text[i] == '\n') {
-      i++;
-      i0 = i;
+    if (nl) {
       if (enhtml)
         // <br> needed for Powerpoint
-        hprintf(hf, "<br\n>");
+        hprintf(hb, "<br\n>");
       else
-        hprintf(hf, "\n");
+        hprintf(hb, "\n");
       odd = !odd;
     }
   }
-  destroy_clip_workbuf(buf);
-
-  hprintf(hf, "</pre>\n");
-  hprintf(hf, "  </div>\n");
-  //hprintf(hf, "  </td></tr></table>\n");
-  hprintf(hf, "</body>\n");
-
-  return hbuf;
+  free(buf.text);
+  free(buf.cattrs);
+  free(styles.entries);
+  free(styles.text.s);
+
+  hprintf(hb, "</pre>\n");
+  hprintf(hb, "  </div>\n");
+  //hprintf(hb, "  </td></tr></table>\n");
+  hprintf(hb, "</body>\n");
+
+  hb_finish(hb);
+  return out.s;
 }
 
 char *
@@ -706,6 +706,26 @@ decompressline(uchar *data, int *bytes_used)
   return line;
 }
 
+/*
+ * Read the line attributes of a compressed line without decompressing it.
+ */
+ushort
+compressed_lattr(uchar *data)
+{
+  // skip the column count
+  while (*data++ & 0x80)
+    ;
+  ushort lattr = 0;
+  int shift = 0;
+  uchar byte;
+  do {
+    byte = *data++;
+    lattr |= (byte & 0x7F) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return lattr;
+}
+
 /*
  * Clear a line, throwing away any combining characters.
  */
@@ -24,33 +24,129 @@ get_char(termline *line, int x)
   return c;
 }
 
+/*
+ * Character classes for word selection and link detection,
+ * looked up directly for ASCII and through shared pages of 256
+ * characters for the rest of the BMP. They are compiled on first use
+ * after each configuration change.
+ */
+enum {
+  CC_ALNUM = 1,    // alphanumeric
+  CC_WORD = 2,     // other word characters: _#%~+-
+  CC_PATH = 4,     // word characters at the start only: .$@/ and backslash
+  CC_JOIN = 8,     // continue but do not include: &,;?!
+  CC_JOINF = 16,   // the same, only forward: =
+  CC_JOINB = 32,   // the same, only backward: :
+  CC_USER = 64,    // in WordChars
+  CC_EXCL = 128,   // in WordCharsExcl
+};
+
+static uchar cc_ascii[128];
+static uchar cc_index[256];  // page of each block of 256 characters
+static uchar (*cc_pages)[256];
+static bool cc_valid;
+
+static void
+cc_build(void)
+{
+  uchar page[256];
+  int npages = 0;
+  wchar * user = cs__mbstowcs(cfg.word_chars);
+  wchar * excl = cs__mbstowcs(cfg.word_chars_excl);
+
+  free(cc_pages);
+  cc_pages = 0;
+  for (uint hi = 0; hi < 256; hi++) {
+    for (uint lo = 0; lo < 256; lo++) {
+      wchar c = hi << 8 | lo;
+      uchar cc = 0;
+      if (iswalnum(c))
+        cc |= CC_ALNUM;
+      if (c && c < 0x80) {
+        if (strchr("_#%~+-", c))
+          cc |= CC_WORD;
+        if (strchr(".$@/\\", c))
+          cc |= CC_PATH;
+        if (strchr("&,;?!", c))
+          cc |= CC_JOIN;
+        if (c == '=')
+          cc |= CC_JOINF;
+        if (c == ':')
+          cc |= CC_JOINB;
+      }
+      page[lo] = cc;
+    }
+    // characters from the WordChars and WordCharsExcl options
+    for (wchar * s = user; *s; s++)
+      if ((*s >> 8) == hi)
+        page[*s & 0xFF] |= CC_USER;
+    for (wchar * s = excl; *s; s++)
+      if ((*s >> 8) == hi)
+        page[*s & 0xFF] |= CC_EXCL;
+
+    if (!hi)
+      memcpy(cc_ascii, page, sizeof cc_ascii);
+
+    int i = 0;
+    while (i < npages && memcmp(cc_pages[i], page, 256))
+      i++;
+    if (i == npages) {
+      cc_pages = renewn(cc_pages, ++npages);
+      memcpy(cc_pages[i], page, 256);
+    }
+    cc_index[hi] = i;
+  }
+  free(user);
+  free(excl);
+  cc_valid = true;
+}
+
+void
+term_word_chars_changed(void)
+{
+  cc_valid = false;
+}
+
+static inline uchar
+char_class(wchar c)
+{
+  return c < 0x80 ? cc_ascii[c] : cc_pages[cc_index[c >> 8]][c & 0xFF];
+}
+
 static pos
 sel_spread_word(struct term* term, pos p, bool forward)
 {
   pos ret_p = p;
   termline *line = fetch_line(term, p.y);
 
+  if (!cc_valid)
+    cc_build();
+  // user character sets do not apply to link detection
+  bool user = term->mouse_state != MS_OPENING;
+  bool user_word = user && *cfg.word_chars;
+  uchar join = CC_JOIN | (forward ? CC_JOINF : CC_JOINB);
+
   for (;;) {
     wchar c = get_char(line, p.x);
-    if (term->mouse_state != MS_OPENING && *cfg.word_chars_excl)
-      if (strchr(cfg.word_chars_excl, c))
-        break;
-    if (iswalnum(c))
+    uchar cc = char_class(c);
+    if (user && (cc & CC_EXCL))
+      break;
+    if (cc & CC_ALNUM)
       ret_p = p;
-    else if (term->mouse_state != MS_OPENING && *cfg.word_chars) {
-      if (!strchr(cfg.word_chars, c))
+    else if (user_word) {
+      if (!(cc & CC_USER))
         break;
       ret_p = p;
     }
-    else if (strchr("_#%~+-", c))
+    else if (cc & CC_WORD)
       ret_p = p;
-    else if (strchr(".$@/\\", c)) {
+    else if (cc & CC_PATH) {
       if (!forward)
         ret_p = p;
     }
     else if (c == ' ' && p.x > 0 && get_char(line, p.x - 1) == '\\')
       ret_p = p;
-    else if (!(strchr("&,;?!", c) || c == (forward ? '=' : ':')))
+    else if (!(cc & join))
       break;
 
     if (forward) {
@@ -255,9 +351,15 @@ typedef enum {
   MA_RELEASE = 3
 } mouse_action;  // values are significant, used for calculation!
 
+static void flush_mouse_move(struct term* term);
+
 static void
 send_mouse_event(struct term* term, mouse_action a, mouse_button b, mod_keys mods, pos p)
 {
+  // report motion that is still pending before any other event
+  if (a != MA_MOVE)
+    flush_mouse_move(term);
+
   if (term->mouse_mode == MM_LOCATOR) {
     // handle DECSLE: select locator events
     if ((a == MA_CLICK && term->locator_report_up)
@@ -352,6 +454,62 @@ send_mouse_event(struct term* term, mouse_action a, mouse_button b, mod_keys mod
   }
 }
 
+/*
+ * Motion reports are coalesced: one is sent at most every MOVE_FRAME
+ * ticks, and not while the pty is full or a paste is being written;
+ * meanwhile only the latest position is kept.
+ */
+#define MOVE_FRAME 16
+
+static void
+flush_mouse_move(struct term* term)
+{
+  if (!term->mouse_move_pending)
+    return;
+  term->mouse_move_pending = false;
+  // the application may have switched motion reports off meanwhile
+  if (term->mouse_mode < MM_BTN_EVENT)
+    return;
+  term->mouse_move_sent = get_tick_count();
+  send_mouse_event(term, MA_MOVE, term->mouse_move_button,
+                   term->mouse_move_mods, term->mouse_move_pos);
+}
+
+static void
+mouse_move_cb(void* data)
+{
+  struct term* term = (struct term*)data;
+  if (!term->mouse_move_pending)
+    return;
+  if (term->child->pty_fd < 0) {
+    // nobody to report to any more
+    term->mouse_move_pending = false;
+    return;
+  }
+  if (term->paste_out || !child_writable(term->child))
+    win_set_timer(mouse_move_cb, term, MOVE_FRAME);
+  else
+    flush_mouse_move(term);
+}
+
+static void
+report_mouse_move(struct term* term, mouse_button b, mod_keys mods, pos p)
+{
+  bool pending = term->mouse_move_pending;
+  term->mouse_move_pending = true;
+  term->mouse_move_button = b;
+  term->mouse_move_mods = mods;
+  term->mouse_move_pos = p;
+  if (pending)
+    return;  // timer already running
+
+  int wait = term->mouse_move_sent + MOVE_FRAME - get_tick_count();
+  if (wait <= 0 && !term->paste_out && child_writable(term->child))
+    flush_mouse_move(term);
+  else
+    win_set_timer(mouse_move_cb, term, max(wait, 1));
+}
+
 static pos
 box_pos(struct term* term, pos p)
 {
@@ -523,7 +681,7 @@ term_mouse_release(struct term* term, mouse_button b, mod_keys mods, pos p)
       termline *line = fetch_line(term, p.y);
       int urli = line->chars[p.x].attr.link;
       release_line(line);
-      char * url = geturl(urli);
+      char * url = geturl(term, urli);
       if (url)
         win_open(cs__utftowcs(url), true);  // win_open frees its argument
       else
@@ -645,11 +803,11 @@ term_mouse_move(struct term* term, mod_keys mods, pos p)
   }
   else if (term->mouse_state > 0) {
     if (term->mouse_mode >= MM_BTN_EVENT)
-      send_mouse_event(term, MA_MOVE, term->mouse_state, mods, bp);
+      report_mouse_move(term, term->mouse_state, mods, bp);
   }
   else {
     if (term->mouse_mode == MM_ANY_EVENT)
-      send_mouse_event(term, MA_MOVE, 0, mods, bp);
+      report_mouse_move(term, 0, mods, bp);
   }
 
   if (!check_app_mouse(term, &mods) && (mods & ~cfg.click_target_mod) == MDK_CTRL && term->has_focus) {
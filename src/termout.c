@@ -19,8 +19,9 @@
 
 #include <termios.h>
 
-#define TERM_CMD_BUF_INC_STEP 128
 #define TERM_CMD_BUF_MAX_SIZE (1024 * 1024)
+#define TERM_CMD_CHUNK_SIZE (64 * 1024)
+#define TERM_CLIP_MAX_SIZE (64 * 1024 * 1024)
 
 #define SUB_PARS (1 << (sizeof(*term->csi_argv) * 8 - 1))
 
@@ -49,32 +50,80 @@ static string primary_da5 = "\e[?65;1;2;4;6;9;15;21;22;28;29c";
 */
 
 
+static void term_feed_cmd(struct term* term);
+
+/*
+ * Append to the OSC or DCS string buffer.
+ * If a sink is registered for the string, the buffer is passed on
+ * whenever it has collected a chunk, so it never grows beyond that.
+ */
 static bool
-term_push_cmd(struct term* term, char c)
+term_push_cmds(struct term* term, const char * s, uint n)
 {
-  uint new_size;
+  while (n) {
+    if (term->cmd_sink && term->cmd_len >= TERM_CMD_CHUNK_SIZE) {
+      term_feed_cmd(term);
+      if (!term->cmd_sink)  // sink gave up
+        return false;
+    }
 
+    /* Need 1 more for null byte */
+    if (term->cmd_len + 1 >= term->cmd_buf_cap) {
+      if (term->cmd_buf_cap >= TERM_CMD_BUF_MAX_SIZE) {
+        /* Server sends too many cmd characters */
+        term->cmd_buf[term->cmd_len] = 0;
+        return false;
+      }
+      // grow geometrically, to keep collecting linear
+      uint new_size = term->cmd_buf_cap * 2;
+      if (new_size >= TERM_CMD_BUF_MAX_SIZE) {
+        // cosmetic limitation (relevant limitation above)
+        new_size = TERM_CMD_BUF_MAX_SIZE;
+      }
+      term->cmd_buf = renewn(term->cmd_buf, new_size);
+      term->cmd_buf_cap = new_size;
+    }
+
+    uint room = term->cmd_buf_cap - 1 - term->cmd_len;
+    if (term->cmd_sink)
+      room = min(room, TERM_CMD_CHUNK_SIZE - term->cmd_len);
+    uint k = min(room, n);
+    memcpy(term->cmd_buf + term->cmd_len, s, k);
+    term->cmd_len += k;
+    s += k;
+    n -= k;
+  }
+  term->cmd_buf[term->cmd_len] = 0;
+  return true;
+}
+
+static bool
+term_push_cmd(struct term* term, char c)
+{
   /* Need 1 more for null byte */
-  if (term->cmd_len + 1 < term->cmd_buf_cap) {
+  if (term->cmd_len + 1 < term->cmd_buf_cap && !term->cmd_sink) {
     term->cmd_buf[term->cmd_len++] = c;
     term->cmd_buf[term->cmd_len] = 0;
     return true;
   }
+  return term_push_cmds(term, &c, 1);
+}
 
-  if (term->cmd_buf_cap >= TERM_CMD_BUF_MAX_SIZE) {
-    /* Server sends too many cmd characters */
-    return false;
-  }
-  new_size = term->cmd_buf_cap + TERM_CMD_BUF_INC_STEP;
-  if (new_size >= TERM_CMD_BUF_MAX_SIZE) {
-    // cosmetic limitation (relevant limitation above)
-    new_size = TERM_CMD_BUF_MAX_SIZE;
-  }
-  term->cmd_buf = renewn(term->cmd_buf, new_size);
-  term->cmd_buf_cap = new_size;
-  term->cmd_buf[term->cmd_len++] = c;
-  term->cmd_buf[term->cmd_len] = 0;
-  return true;
+/*
+ * Return the length of the string payload starting at buf[pos],
+ * up to the next character that may end or interrupt the string.
+ */
+static uint
+cmd_span(const char * buf, uint pos, uint len, bool dcs)
+{
+  uint end = pos;
+  if (dcs)
+    while (end < len && buf[end] != '\e')
+      end++;
+  else
+    while (end < len && (uchar)buf[end] >= ' ')
+      end++;
+  return end - pos;
 }
 
 /*
@@ -531,7 +580,7 @@ sum_rect(struct term* term, short y0, short x0, short y1, short x1)
 static void
 write_bell(struct term* term)
 {
-  if (cfg.bell_flash)
+  if (cfg.bell_flash && !term->background)
     term_schedule_vbell(term, false, 0);
   win_bell(term, &cfg);
 }
@@ -1232,7 +1281,9 @@ do_esc(struct term* term, uchar c)
       term->state = OSC_START;
     when 'P':  /* DCS: device control string */
       term->state = DCS_START;
-    when '^' case_or '_' case_or 'X': /* PM, APC, SOS strings to be ignored */
+    when '_':  /* APC: application program command */
+      term->state = APC_START;
+    when '^' case_or 'X': /* PM, SOS strings to be ignored */
       term->state = IGNORE_STRING;
     when '7':  /* DECSC: save cursor */
       save_cursor(term);
@@ -2747,6 +2798,191 @@ do_csi(struct term* term, uchar c)
   }
 }
 
+/*
+ * Sixel payload sink: the image is parsed in chunks while it streams in,
+ * and finalized and displayed at the string terminator.
+ * Meanwhile, the completed cell rows are shown as a preview image,
+ * republished at most every SIXEL_PREVIEW_INTERVAL milliseconds.
+ */
+#define SIXEL_PREVIEW_INTERVAL 100
+
+static void
+sixel_drop_preview(struct term* term, bool repaint)
+{
+  if (term->imgs.preview) {
+    winimg_destroy(term->imgs.preview);
+    term->imgs.preview = NULL;
+    if (repaint)
+      win_invalidate_all(false);
+  }
+}
+
+static void
+sixel_preview(struct term* term, sixel_state_t * st)
+{
+  imglist * prev = term->imgs.preview;
+  int rows = min(st->pos_y, st->image.height) / st->grid_height;
+  if (rows <= (prev ? prev->height : 0))
+    return;
+  unsigned long now = mtime();
+  if (prev && now - term->imgs.preview_time < SIXEL_PREVIEW_INTERVAL)
+    return;
+
+  int cols = (max(st->max_x + 1, st->attributed_ph) + st->grid_width - 1)
+             / st->grid_width;
+  int pixelwidth = cols * st->grid_width;
+  int pixelheight = rows * st->grid_height;
+  unsigned char * pixels = malloc(pixelwidth * pixelheight * 4);
+  if (!pixels)
+    return;
+  sixel_parser_render(st, pixels, pixelwidth, pixelheight);
+
+  short left = term->curs.x;
+  short top = term->virtuallines + (term->sixel_display ? 0: term->curs.y);
+  imglist * img;
+  if (!winimg_new(&img, pixels, left, top, cols, rows, pixelwidth, pixelheight)) {
+    free(pixels);
+    return;
+  }
+  sixel_drop_preview(term, false);
+  term->imgs.preview = img;
+  term->imgs.preview_time = now;
+}
+
+static void
+sixel_cancel(struct term* term)
+{
+  sixel_drop_preview(term, true);
+  sixel_state_t * st = (sixel_state_t *)term->imgs.parser_state;
+  if (st) {
+    sixel_parser_deinit(st);
+    free(st);
+    term->imgs.parser_state = NULL;
+  }
+}
+
+static void
+sixel_feed(struct term* term, char * s, uint len)
+{
+  sixel_state_t * st = (sixel_state_t *)term->imgs.parser_state;
+  if (!st)
+    return;
+  int status = sixel_parser_parse(st, (unsigned char *)s, len);
+  if (status < 0) {
+    term_cancel_cmd(term);
+    term->state = DCS_IGNORE;
+  }
+  else
+    sixel_preview(term, st);
+}
+
+static void
+sixel_done(struct term* term)
+{
+  sixel_state_t * st = (sixel_state_t *)term->imgs.parser_state;
+  // the final image is painted over the preview
+  sixel_drop_preview(term, false);
+  if (!st)
+    return;
+
+  int size_pixels = st->image.width * st->image.height * 4;
+  unsigned char * pixels = (unsigned char *)malloc(size_pixels);
+  //printf("alloc pixels 1 w %d h %d (%d) -> %p\n", st->image.width, st->image.height, size_pixels, pixels);
+  if (!pixels)
+    return;
+
+  int status = sixel_parser_finalize(st, pixels);
+  sixel_parser_deinit(st);
+  if (status < 0) {
+    //printf("free state 3 %p\n", term.imgs.parser_state);
+    free(term->imgs.parser_state);
+    //printf("free pixels\n");
+    free(pixels);
+    term->imgs.parser_state = NULL;
+    return;
+  }
+
+  short left = term->curs.x;
+  short top = term->virtuallines + (term->sixel_display ? 0: term->curs.y);
+  int width = st->image.width / st->grid_width;
+  int height = st->image.height / st->grid_height;
+  int pixelwidth = st->image.width;
+  int pixelheight = st->image.height;
+
+  imglist * img;
+  if (!winimg_new(&img, pixels, left, top, width, height, pixelwidth, pixelheight) != 0) {
+    sixel_parser_deinit(st);
+    //printf("free state 4 %p\n", term.imgs.parser_state);
+    free(term->imgs.parser_state);
+    term->imgs.parser_state = NULL;
+    return;
+  }
+
+  short x0 = term->curs.x;
+  cattrflags attr0 = term->curs.attr.attr;
+
+  // fill with space characters
+  if (term->sixel_display) {  // sixel display mode
+    short y0 = term->curs.y;
+    term->curs.y = 0;
+    for (int y = 0; y < img->height && y < term->rows; ++y) {
+      term->curs.y = y;
+      term->curs.x = 0;
+      for (int x = x0; x < x0 + img->width && x < term->cols; ++x)
+        write_char(term, SIXELCH, 1);
+    }
+    term->curs.y = y0;
+    term->curs.x = x0;
+  } else {  // sixel scrolling mode
+    for (int i = 0; i < img->height; ++i) {
+      term->curs.x = x0;
+      for (int x = x0; x < x0 + img->width && x < term->cols; ++x)
+        write_char(term, SIXELCH, 1);
+      if (i == img->height - 1) {  // in the last line
+        if (!term->sixel_scrolls_right) {
+          write_linefeed(term);
+          term->curs.x = term->sixel_scrolls_left ? 0: x0;
+        }
+      } else {
+        write_linefeed(term);
+      }
+    }
+  }
+
+  term->curs.attr.attr = attr0;
+
+#ifdef handle_overlay_images
+#warning this creates some crash conditions...
+  // try some optimization: replace existing images if overwritten
+  for (imglist * cur = term->imgs.first; cur; cur = cur->next) {
+    if (cur->pixelwidth == cur->width * st->grid_width &&
+        cur->pixelheight == cur->height * st->grid_height)
+    {
+      // if new image within area of previous image, ...
+      if (img->top >= cur->top && img->left >= cur->left &&
+          img->left + img->width <= cur->left + cur->width &&
+          img->top + img->height <= cur->top + cur->height)
+      {
+        // inject new img into old structure;
+        // copy img data in stripes, for unknown reason
+        // (would need to unshare cur->data first)
+        for (y = 0; y < img->pixelheight; ++y) {
+          memcpy(cur->data->pixels +
+                   ((img->top - cur->top) * st->grid_height + y) * cur->pixelwidth * 4 +
+                   (img->left - cur->left) * st->grid_width * 4,
+                 img->data->pixels + y * img->pixelwidth * 4,
+                 img->pixelwidth * 4);
+        }
+        winimg_destroy(img);
+        return;
+      }
+    }
+  }
+#endif
+  // append image to list, replacing an image of the same size
+  winimg_add(term, img);
+}
+
 static void
 do_dcs(struct term* term)
 {
@@ -2778,144 +3014,13 @@ do_dcs(struct term* term)
     }
 
   when 'q': {
+   // the payload is passed to sixel_feed and sixel_done by the sink
    sixel_state_t * st = (sixel_state_t *)term->imgs.parser_state;
    int status = -1;
 
    switch (term->state) {
-    when DCS_PASSTHROUGH:
-      if (!st)
-        return;
-      status = sixel_parser_parse(st, (unsigned char *)s, term->cmd_len);
-      if (status < 0) {
-        sixel_parser_deinit(st);
-        //printf("free state 1 %p\n", term.imgs.parser_state);
-        free(term->imgs.parser_state);
-        term->imgs.parser_state = NULL;
-        term->state = DCS_IGNORE;
-        return;
-      }
-
-    when DCS_ESCAPE:
-      if (!st)
-        return;
-      status = sixel_parser_parse(st, (unsigned char *)s, term->cmd_len);
-      if (status < 0) {
-        sixel_parser_deinit(st);
-        //printf("free state 2 %p\n", term.imgs.parser_state);
-        free(term->imgs.parser_state);
-        term->imgs.parser_state = NULL;
-        return;
-      }
-
-      int size_pixels = st->image.width * st->image.height * 4;
-      unsigned char * pixels = (unsigned char *)malloc(size_pixels);
-      //printf("alloc pixels 1 w %d h %d (%d) -> %p\n", st->image.width, st->image.height, size_pixels, pixels);
-      if (!pixels)
-        return;
-
-      status = sixel_parser_finalize(st, pixels);
-      sixel_parser_deinit(st);
-      if (status < 0) {
-        //printf("free state 3 %p\n", term.imgs.parser_state);
-        free(term->imgs.parser_state);
-        //printf("free pixels\n");
-        free(pixels);
-        term->imgs.parser_state = NULL;
-        return;
-      }
-
-      short left = term->curs.x;
-      short top = term->virtuallines + (term->sixel_display ? 0: term->curs.y);
-      int width = st->image.width / st->grid_width;
-      int height = st->image.height / st->grid_height;
-      int pixelwidth = st->image.width;
-      int pixelheight = st->image.height;
-
-      imglist * img;
-      if (!winimg_new(&img, pixels, left, top, width, height, pixelwidth, pixelheight) != 0) {
-        sixel_parser_deinit(st);
-        //printf("free state 4 %p\n", term.imgs.parser_state);
-        free(term->imgs.parser_state);
-        term->imgs.parser_state = NULL;
-        return;
-      }
-
-      short x0 = term->curs.x;
-      cattrflags attr0 = term->curs.attr.attr;
-
-      // fill with space characters
-      if (term->sixel_display) {  // sixel display mode
-        short y0 = term->curs.y;
-        term->curs.y = 0;
-        for (int y = 0; y < img->height && y < term->rows; ++y) {
-          term->curs.y = y;
-          term->curs.x = 0;
-          for (int x = x0; x < x0 + img->width && x < term->cols; ++x)
-            write_char(term, SIXELCH, 1);
-        }
-        term->curs.y = y0;
-        term->curs.x = x0;
-      } else {  // sixel scrolling mode
-        for (int i = 0; i < img->height; ++i) {
-          term->curs.x = x0;
-          for (int x = x0; x < x0 + img->width && x < term->cols; ++x)
-            write_char(term, SIXELCH, 1);
-          if (i == img->height - 1) {  // in the last line
-            if (!term->sixel_scrolls_right) {
-              write_linefeed(term);
-              term->curs.x = term->sixel_scrolls_left ? 0: x0;
-            }
-          } else {
-            write_linefeed(term);
-          }
-        }
-      }
-
-      term->curs.attr.attr = attr0;
-
-      if (term->imgs.first == NULL) {
-        term->imgs.first = term->imgs.last = img;
-      } else {
-        // try some optimization: replace existing images if overwritten
-        for (imglist * cur = term->imgs.first; cur; cur = cur->next) {
-          if (cur->pixelwidth == cur->width * st->grid_width &&
-              cur->pixelheight == cur->height * st->grid_height)
-          {
-            // if same size, replace
-            if (img->top == cur->top && img->left == cur->left &&
-                img->width == cur->width &&
-                img->height == cur->height)
-            {
-              memcpy(cur->pixels, img->pixels, img->pixelwidth * img->pixelheight * 4);
-              winimg_destroy(img);
-              return;
-            }
-            // if new image within area of previous image, ...
-#ifdef handle_overlay_images
-#warning this creates some crash conditions...
-            if (img->top >= cur->top && img->left >= cur->left &&
-                img->left + img->width <= cur->left + cur->width &&
-                img->top + img->height <= cur->top + cur->height)
-            {
-              // inject new img into old structure;
-              // copy img data in stripes, for unknown reason
-              for (y = 0; y < img->pixelheight; ++y) {
-                memcpy(cur->pixels +
-                         ((img->top - cur->top) * st->grid_height + y) * cur->pixelwidth * 4 +
-                         (img->left - cur->left) * st->grid_width * 4,
-                       img->pixels + y * img->pixelwidth * 4,
-                       img->pixelwidth * 4);
-              }
-              winimg_destroy(img);
-              return;
-            }
-#endif
-          }
-        }
-        // append image to list
-        term->imgs.last->next = img;
-        term->imgs.last = img;
-      }
+    when DCS_PASSTHROUGH case_or DCS_ESCAPE:
+      return;
 
     otherwise: {
       /* parser status initialization */
@@ -3104,45 +3209,586 @@ do_colour_osc(struct term* term, bool has_index_arg, uint i, bool reset)
     win_set_colour(i, c);
 }
 
+/*
+ * OSC 0/2: set window title.
+ * Titles are taken from the first chunk of the payload only.
+ */
+static void
+title_feed(struct term* term, char * s, uint len)
+{
+  if (!term->cmd_sink_state)
+    term->cmd_sink_state = strndup(s, len);
+}
+
+static void
+title_done(struct term* term)
+{
+  char * s = term->cmd_sink_state ?: "";
+  wchar * ws = cs__mbstowcs(s);
+  win_tab_set_title(term, ws);  // ignore icon title
+  free(ws);
+  free(term->cmd_sink_state);
+  term->cmd_sink_state = 0;
+}
+
+static void
+sink_free(struct term* term)
+{
+  free(term->cmd_sink_state);
+  term->cmd_sink_state = 0;
+}
+
 /*
  * OSC52: \e]52;[cp0-6];?|base64-string\07"
  * Only system clipboard is supported now.
  */
-static void do_clipboard(struct term* term)
+typedef struct {
+  bool in_data;   /* selection parameter skipped */
+  bool ignore;
+  base64_decoder dec;
+  char * data;    /* decoded so far */
+  uint len, size;
+} clip_sink;
+
+static void
+clip_open(struct term* term)
 {
-  char *s = term->cmd_buf;
-  char *output;
-  int len;
-  int ret;
+  if (cfg.allow_set_selection) {
+    clip_sink * cs = calloc(1, sizeof(clip_sink));
+    base64_decode_begin(&cs->dec);
+    term->cmd_sink_state = cs;
+  }
+}
+
+static void
+clip_feed(struct term* term, char * s, uint len)
+{
+  clip_sink * cs = term->cmd_sink_state;
+  if (!cs || cs->ignore)
+    return;
+
+  if (!cs->in_data) {
+    char * sep = memchr(s, ';', len);
+    if (!sep)
+      return;
+    len -= sep + 1 - s;
+    s = sep + 1;
+    cs->in_data = true;
+    if (len && *s == '?') {
+      /* Reading from clipboard is unsupported */
+      cs->ignore = true;
+      return;
+    }
+  }
+  if (!len)
+    return;
+
+  // decode while the payload streams in; keep room for a final NUL
+  uint space = BASE64_DECODE_SPACE(len);
+  if (cs->len + space + 1 > cs->size) {
+    if (cs->len + space + 1 > TERM_CLIP_MAX_SIZE) {
+      cs->ignore = true;
+      return;
+    }
+    cs->size = max(cs->size * 2, cs->len + space + 1);
+    cs->data = renewn(cs->data, cs->size);
+  }
+  int ret = base64_decode_update(&cs->dec, s, len, cs->data + cs->len, space);
+  if (ret < 0)
+    cs->ignore = true;
+  else
+    cs->len += ret;
+}
+
+static void
+clip_cancel(struct term* term)
+{
+  clip_sink * cs = term->cmd_sink_state;
+  if (cs)
+    free(cs->data);
+  sink_free(term);
+}
 
-  if (!cfg.allow_set_selection) {
+static void
+clip_done(struct term* term)
+{
+  clip_sink * cs = term->cmd_sink_state;
+  if (cs && !cs->ignore && cs->len) {
+    cs->data[cs->len] = '\0';
+    win_copy_text(cs->data);
+  }
+  clip_cancel(term);
+}
+
+/*
+ * Graphics protocol (kitty), direct transmission subset:
+ *   APC G <key>=<value>,... [; <base64 payload>] ST
+ * Raw RGB or RGBA pixels (f=24/32) are transmitted (a=t), displayed
+ * (a=T), or both; a payload may be split into chunks sent as separate
+ * APC strings with m=1, except for the last one.  Images transmitted
+ * with an id (i) can be placed again (a=p) without retransmission, and
+ * deleted (a=d).  The payload is decoded while it streams in.
+ */
+#define GRAPHICS_MAX_BYTES (4096 * 4096 * 4)
+#define GRAPHICS_MAX_IDS 256
+
+typedef struct {
+  char action;        /* a */
+  char del;           /* d */
+  int format;         /* f */
+  int width, height;  /* s, v: pixels */
+  uint id;            /* i */
+  int cols, rows;     /* c, r: display area */
+  int quiet;          /* q */
+  bool more;          /* m */
+  bool stay;          /* C: do not move the cursor */
+  bool control;       /* any keys other than m and q */
+} graphics_cmd;
+
+typedef struct {
+  graphics_cmd cmd;   /* keys of the first chunk */
+  base64_decoder dec;
+  unsigned char * data;
+  uint len, size;
+  bool failed;
+} graphics_upload;
+
+typedef struct {
+  struct {
+    uint id;
+    imgdata * data;
+  } images[GRAPHICS_MAX_IDS];  /* oldest first */
+  int n;
+  graphics_upload * upload;    /* chunked transmission in progress */
+} graphics_state;
+
+typedef struct {
+  char keys[128];
+  uint klen;
+  bool in_payload;
+  graphics_cmd cmd;
+} graphics_sink;
+
+static graphics_state *
+graphics(struct term* term)
+{
+  if (!term->imgs.graphics)
+    term->imgs.graphics = calloc(1, sizeof(graphics_state));
+  return term->imgs.graphics;
+}
+
+static void
+graphics_drop_upload(graphics_state * gs)
+{
+  if (gs->upload) {
+    free(gs->upload->data);
+    free(gs->upload);
+    gs->upload = 0;
+  }
+}
+
+void
+term_graphics_clear(struct term* term)
+{
+  graphics_state * gs = term->imgs.graphics;
+  if (gs) {
+    graphics_drop_upload(gs);
+    for (int i = 0; i < gs->n; i++)
+      winimg_data_release(gs->images[i].data);
+    free(gs);
+    term->imgs.graphics = 0;
+  }
+}
+
+static int
+graphics_find(graphics_state * gs, uint id)
+{
+  for (int i = 0; i < gs->n; i++)
+    if (gs->images[i].id == id)
+      return i;
+  return -1;
+}
+
+static void
+graphics_forget(graphics_state * gs, int i)
+{
+  winimg_data_release(gs->images[i].data);
+  gs->n--;
+  memmove(&gs->images[i], &gs->images[i + 1], (gs->n - i) * sizeof(gs->images[0]));
+}
+
+/* keep a picture under its id, taking over the reference */
+static void
+graphics_keep(graphics_state * gs, uint id, imgdata * data)
+{
+  int i = graphics_find(gs, id);
+  if (i >= 0)
+    graphics_forget(gs, i);
+  else if (gs->n == GRAPHICS_MAX_IDS)
+    graphics_forget(gs, 0);
+  gs->images[gs->n].id = id;
+  gs->images[gs->n].data = data;
+  gs->n++;
+}
+
+static void
+graphics_parse(graphics_cmd * cmd, char * keys)
+{
+  *cmd = (graphics_cmd){.action = 't', .format = 32};
+  for (char * p = keys; *p; ) {
+    char key = *p++;
+    if (*p++ != '=')
+      break;
+    char * v = p;
+    char val = *v;
+    int num = strtol(v, &p, 10);
+    if (p == v && *p)
+      p++;  /* single character value */
+    if (key != 'm' && key != 'q')
+      cmd->control = true;
+    switch (key) {
+      when 'a': cmd->action = val;
+      when 'd': cmd->del = val;
+      when 'f': cmd->format = num;
+      when 's': cmd->width = num;
+      when 'v': cmd->height = num;
+      when 'i': cmd->id = num;
+      when 'c': cmd->cols = num;
+      when 'r': cmd->rows = num;
+      when 'q': cmd->quiet = num;
+      when 'm': cmd->more = num;
+      when 'C': cmd->stay = num;
+    }
+    while (*p && *p != ',')
+      p++;
+    if (*p)
+      p++;
+  }
+}
+
+static void
+graphics_reply(struct term* term, graphics_cmd * cmd, char * err)
+{
+  if (cmd->id && cmd->quiet < (err ? 2 : 1))
+    child_printf(term->child, "\e_Gi=%u;%s\e\\", cmd->id, err ?: "OK");
+}
+
+/* show a picture at the cursor position */
+static void
+graphics_place(struct term* term, graphics_cmd * cmd, imgdata * data)
+{
+  int cols = (data->pixelwidth + cell_width - 1) / cell_width;
+  int rows = (data->pixelheight + cell_height - 1) / cell_height;
+  // scale to a given area, but not beyond the screen width or height
+  if (cmd->cols > 0)
+    cols = min(cmd->cols, term->cols);
+  if (cmd->rows > 0)
+    rows = min(cmd->rows, term->rows);
+  short x0 = term->curs.x;
+  short y0 = term->curs.y;
+  int lines0 = term->virtuallines;
+  imglist * img;
+  if (!winimg_place(&img, data, x0, term->virtuallines + y0, cols, rows))
     return;
+  img->graphics = true;
+
+  // fill with placeholder characters, scrolling as needed
+  cattrflags attr0 = term->curs.attr.attr;
+  for (int i = 0; i < rows; ++i) {
+    term->curs.x = x0;
+    for (int x = x0; x < x0 + cols && x < term->cols; ++x)
+      write_char(term, SIXELCH, 1);
+    if (i < rows - 1)
+      write_linefeed(term);
+  }
+  term->curs.attr.attr = attr0;
+  if (cmd->stay) {
+    term->curs.x = x0;
+    term->curs.y = max(0, y0 - (term->virtuallines - lines0));
   }
 
-  while (*s != ';' && *s != '\0') {
-    s += 1;
+  winimg_add(term, img);
+}
+
+static void
+graphics_finish(struct term* term, graphics_upload * up)
+{
+  graphics_cmd * cmd = &up->cmd;
+  int bpp = cmd->format / 8;
+  if (cmd->format != 24 && cmd->format != 32) {
+    graphics_reply(term, cmd, "EINVAL:unsupported format");
+    return;
   }
-  if (*s != ';') {
+  if (up->failed || cmd->width <= 0 || cmd->height <= 0
+      || (unsigned long long)cmd->width * cmd->height * 4 > GRAPHICS_MAX_BYTES
+      || up->len != (uint)cmd->width * cmd->height * bpp) {
+    graphics_reply(term, cmd, "EINVAL:bad image data");
     return;
   }
-  s += 1;
-  if (*s == '?') {
-    /* Reading from clipboard is unsupported */
+  if (cmd->action == 'q') {
+    graphics_reply(term, cmd, 0);
     return;
   }
-  len = strlen(s);
 
-  output = malloc(len + 1);
-  if (output == NULL) {
+  // convert to the pixel layout of winimg, blending with the background
+  uint n = cmd->width * cmd->height;
+  unsigned char * pixels = malloc(n * 4);
+  if (!pixels) {
+    graphics_reply(term, cmd, "ENOMEM:out of memory");
     return;
   }
+  colour bg = win_get_colour(BG_COLOUR_I);
+  uint bgr = red(bg), bgg = green(bg), bgb = blue(bg);
+  unsigned char * src = up->data, * dst = pixels;
+  for (uint i = 0; i < n; i++, src += bpp, dst += 4) {
+    if (bpp == 4 && src[3] != 255) {
+      uint a = src[3];
+      dst[0] = (src[2] * a + bgb * (255 - a) + 127) / 255;
+      dst[1] = (src[1] * a + bgg * (255 - a) + 127) / 255;
+      dst[2] = (src[0] * a + bgr * (255 - a) + 127) / 255;
+    }
+    else {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+    }
+    dst[3] = 0;
+  }
 
-  ret = base64_decode_clip(s, len, output, len);
-  if (ret > 0) {
-    output[ret] = '\0';
-    win_copy_text(output);
+  imgdata * data = winimg_data(pixels, cmd->width, cmd->height);
+  if (!data) {
+    free(pixels);
+    graphics_reply(term, cmd, "ENOMEM:out of memory");
+    return;
   }
-  free(output);
+  if (cmd->action == 'T')
+    graphics_place(term, cmd, data);
+  if (cmd->id)
+    graphics_keep(graphics(term), cmd->id, data);
+  else
+    winimg_data_release(data);
+  graphics_reply(term, cmd, 0);
+}
+
+/* the keys are complete: start or continue a transmission */
+static void
+graphics_keys(struct term* term, graphics_sink * gsk)
+{
+  graphics_state * gs = graphics(term);
+  gsk->keys[gsk->klen] = 0;
+  graphics_parse(&gsk->cmd, gsk->keys);
+  if (gs->upload) {
+    // a further chunk has only m and q, or the id of the transmission;
+    // any other command abandons it
+    if (!gsk->cmd.control || (gsk->cmd.id && gsk->cmd.id == gs->upload->cmd.id))
+      return;
+    graphics_drop_upload(gs);
+  }
+
+  switch (gsk->cmd.action) {
+    when 't' case_or 'T' case_or 'q': {
+      graphics_upload * up = calloc(1, sizeof(graphics_upload));
+      up->cmd = gsk->cmd;
+      base64_decode_begin(&up->dec);
+      gs->upload = up;
+    }
+  }
+}
+
+static void
+graphics_open(struct term* term)
+{
+  term->cmd_sink_state = calloc(1, sizeof(graphics_sink));
+}
+
+static void
+graphics_feed(struct term* term, char * s, uint len)
+{
+  graphics_sink * gsk = term->cmd_sink_state;
+  if (!gsk)
+    return;
+
+  if (!gsk->in_payload) {
+    char * sep = memchr(s, ';', len);
+    uint n = sep ? (uint)(sep - s) : len;
+    n = min(n, sizeof gsk->keys - 1 - gsk->klen);
+    memcpy(gsk->keys + gsk->klen, s, n);
+    gsk->klen += n;
+    if (!sep)
+      return;
+    gsk->in_payload = true;
+    graphics_keys(term, gsk);
+    len -= sep + 1 - s;
+    s = sep + 1;
+  }
+
+  graphics_upload * up = graphics(term)->upload;
+  if (!up || up->failed || !len)
+    return;
+
+  // decode while the payload streams in
+  uint space = BASE64_DECODE_SPACE(len);
+  if (up->len + space > up->size) {
+    uint expected = (uint)max(up->cmd.width, 0) * max(up->cmd.height, 0)
+                    * (up->cmd.format / 8);
+    uint size = max(max(up->size * 2, up->len + space), min(expected, GRAPHICS_MAX_BYTES));
+    if (up->len + space > GRAPHICS_MAX_BYTES + 3) {
+      up->failed = true;
+      return;
+    }
+    up->data = renewn(up->data, size);
+    up->size = size;
+  }
+  int ret = base64_decode_update(&up->dec, s, len, (char *)up->data + up->len, space);
+  if (ret < 0)
+    up->failed = true;
+  else
+    up->len += ret;
+}
+
+static void
+graphics_cancel(struct term* term)
+{
+  // a transmission cannot continue after a broken chunk
+  if (term->imgs.graphics)
+    graphics_drop_upload(term->imgs.graphics);
+  sink_free(term);
+}
+
+static void
+graphics_done(struct term* term)
+{
+  graphics_sink * gsk = term->cmd_sink_state;
+  if (!gsk)
+    return;
+  if (!gsk->in_payload)
+    graphics_keys(term, gsk);
+
+  graphics_state * gs = graphics(term);
+  graphics_cmd * cmd = &gsk->cmd;
+  graphics_upload * up = gs->upload;
+  if (up) {
+    if (!cmd->more) {
+      gs->upload = 0;
+      graphics_finish(term, up);
+      free(up->data);
+      free(up);
+    }
+  }
+  else if (cmd->action == 'p') {
+    int i = graphics_find(gs, cmd->id);
+    if (i >= 0 && gs->images[i].data->lost) {
+      // dropped from the image store for lack of space
+      graphics_forget(gs, i);
+      i = -1;
+    }
+    if (i < 0)
+      graphics_reply(term, cmd, "ENOENT:image not found");
+    else {
+      graphics_place(term, cmd, gs->images[i].data);
+      graphics_reply(term, cmd, 0);
+    }
+  }
+  else if (cmd->action == 'd') {
+    // lower case: delete placements, upper case: also forget the image
+    switch (cmd->del) {
+      when 0 case_or 'a' case_or 'A':
+        winimg_remove(term, 0);
+        if (cmd->del == 'A')
+          while (gs->n)
+            graphics_forget(gs, gs->n - 1);
+      when 'i' case_or 'I': {
+        int i = graphics_find(gs, cmd->id);
+        if (i >= 0) {
+          winimg_remove(term, gs->images[i].data);
+          if (cmd->del == 'I')
+            graphics_forget(gs, i);
+        }
+      }
+    }
+  }
+  sink_free(term);
+}
+
+/*
+ * Streaming payload sinks.
+ * The payload of OSC and DCS strings listed here is not collected
+ * in cmd_buf as a whole; it is passed to the sink in chunks of
+ * TERM_CMD_CHUNK_SIZE bytes as it arrives, so its size is not limited
+ * by TERM_CMD_BUF_MAX_SIZE.
+ */
+struct cmd_sink {
+  int osc;   /* OSC number, or -1 */
+  int dcs;   /* DCS command (dcs_cmd), or 0 */
+  void (*open)(struct term*);
+  void (*feed)(struct term*, char * s, uint len);
+  void (*done)(struct term*);    /* string terminated, all payload fed */
+  void (*cancel)(struct term*);  /* string aborted */
+  bool progressive;  /* also fed what arrived by the end of each write */
+};
+
+static const struct cmd_sink cmd_sinks[] = {
+  {0, 0, 0, title_feed, title_done, sink_free, false},
+  {2, 0, 0, title_feed, title_done, sink_free, false},
+  {52, 0, clip_open, clip_feed, clip_done, clip_cancel, false},
+  {-1, 'q', 0, sixel_feed, sixel_done, sixel_cancel, true},
+  {-1, CPAIR('_', 'G'), graphics_open, graphics_feed, graphics_done, graphics_cancel, false},
+};
+
+/* Drop the sink of an aborted string */
+void
+term_cancel_cmd(struct term* term)
+{
+  const struct cmd_sink * sink = term->cmd_sink;
+  term->cmd_sink = 0;
+  if (sink)
+    sink->cancel(term);
+}
+
+/* Register the sink for the OSC or DCS string being started, if any */
+static void
+term_open_cmd(struct term* term)
+{
+  term_cancel_cmd(term);
+  for (uint i = 0; i < lengthof(cmd_sinks); i++) {
+    const struct cmd_sink * sink = &cmd_sinks[i];
+    if (term->cmd_num >= 0 ? sink->osc == term->cmd_num
+                           : sink->dcs == term->dcs_cmd) {
+      if (term->cmd_num >= 0 && *cfg.suppress_osc
+          && contains(cfg.suppress_osc, term->cmd_num))
+        return;
+      term->cmd_sink = sink;
+      if (sink->open)
+        sink->open(term);
+      return;
+    }
+  }
+}
+
+/* Pass the collected payload chunk to the sink */
+static void
+term_feed_cmd(struct term* term)
+{
+  if (term->cmd_len) {
+    term->cmd_buf[term->cmd_len] = 0;
+    uint len = term->cmd_len;
+    term->cmd_len = 0;
+    term->cmd_sink->feed(term, term->cmd_buf, len);
+  }
+}
+
+/* At the string terminator, pass the rest of the payload to the sink */
+static bool
+term_finish_cmd(struct term* term)
+{
+  if (!term->cmd_sink)
+    return false;
+  term_feed_cmd(term);
+  const struct cmd_sink * sink = term->cmd_sink;
+  term->cmd_sink = 0;
+  if (sink)
+    sink->done(term);
+  return true;
 }
 
 /*
@@ -3151,6 +3797,9 @@ static void do_clipboard(struct term* term)
 static void
 do_cmd(struct term* term)
 {
+  if (term_finish_cmd(term))
+    return;
+
   char *s = term->cmd_buf;
   s[term->cmd_len] = 0;
   //printf("OSC %d <%s>\n", term.cmd_num, s);
@@ -3160,11 +3809,7 @@ do_cmd(struct term* term)
     return;
 
   switch (term->cmd_num) {
-    when 0 case_or 2: {
-	  wchar *ws = cs__mbstowcs(s);
-	  win_tab_set_title(term, ws);  // ignore icon title
-	  free(ws);
-    }
+    // 0, 2 (title) and 52 (clipboard) are handled by their cmd_sinks
     when 4:   do_colour_osc(term, true, 4, false);
     when 5:   do_colour_osc(term, true, 5, false);
     when 6 case_or 106: {
@@ -3279,7 +3924,6 @@ do_cmd(struct term* term)
       if (what & 2)
         term->wide_extra = true;
     }
-    when 52: do_clipboard(term);
     when 50: {
       uint ff = (term->curs.attr.attr & FONTFAM_MASK) >> ATTR_FONTFAM_SHIFT;
       if (!strcmp(s, "?")) {
@@ -3298,7 +3942,7 @@ do_cmd(struct term* term)
       char * link = s;
       char * url = strchr(s, ';');
       if (url++ && *url) {
-        term->curs.attr.link = putlink(link);
+        term->curs.attr.link = putlink(term, link);
       }
       else
         term->curs.attr.link = -1;
@@ -3322,9 +3966,15 @@ term_print_finish(struct term* term)
 static void
 term_do_write(struct term* term, const char *buf, uint len)
 {
+  if (term->hibernated)
+    term_rehydrate(term);
+  term->idle_since = get_tick_count();
+
   // Reset cursor blinking.
-  term->cblinker = 1;
-  term_schedule_cblink(term);
+  if (!term->background) {
+    term->cblinker = 1;
+    term_schedule_cblink(term);
+  }
 
   short oldy = term->curs.y;
 
@@ -3727,9 +4377,19 @@ term_do_write(struct term* term, const char *buf, uint len)
       when ESCAPE case_or CMD_ESCAPE:
         if (term->vt52_mode)
           do_vt52(term, c);
-        else if (c < 0x20)
+        else if (c < 0x20) {
+          if (term->state == CMD_ESCAPE) {
+            // the string is aborted, like in DCS_ESCAPE
+            term_cancel_cmd(term);
+            term->state = NORMAL;
+          }
           do_ctrl(term, c);
+        }
         else if (c < 0x30) {
+          if (term->state == CMD_ESCAPE) {
+            term_cancel_cmd(term);
+            term->state = ESCAPE;
+          }
           //term.esc_mod = term.esc_mod ? 0xFF : c;
           if (term->esc_mod) {
             esc_mod0 = term->esc_mod;
@@ -3748,6 +4408,8 @@ term_do_write(struct term* term, const char *buf, uint len)
           term->state = NORMAL;
         }
         else {
+          if (term->state == CMD_ESCAPE)
+            term_cancel_cmd(term);
           do_esc(term, c);
           // term.state: NORMAL/CSI_ARGS/OSC_START/DCS_START/IGNORE_STRING
         }
@@ -3796,6 +4458,7 @@ term_do_write(struct term* term, const char *buf, uint len)
 
       when OSC_START:
         term->cmd_len = 0;
+        term_cancel_cmd(term);
         switch (c) {
           when 'P':  /* Linux palette sequence */
             term->state = OSC_PALETTE;
@@ -3817,6 +4480,7 @@ term_do_write(struct term* term, const char *buf, uint len)
           when ';':
             term->cmd_num = 0;
             term->state = CMD_STRING;
+            term_open_cmd(term);
           when '\a' case_or '\n' case_or '\r':
             term->state = NORMAL;
           when '\e':
@@ -3833,6 +4497,7 @@ term_do_write(struct term* term, const char *buf, uint len)
               term->cmd_num = -99;  // prevent wrong valid param
           when ';':
             term->state = CMD_STRING;
+            term_open_cmd(term);
           when '\a':
             do_cmd(term);
             term->state = NORMAL;
@@ -3869,6 +4534,7 @@ term_do_write(struct term* term, const char *buf, uint len)
       when CMD_STRING:
         switch (c) {
           when '\n' case_or '\r':
+            term_cancel_cmd(term);
             term->state = NORMAL;
           when '\a':
             do_cmd(term);
@@ -3876,7 +4542,14 @@ term_do_write(struct term* term, const char *buf, uint len)
           when '\e':
             term->state = CMD_ESCAPE;
           otherwise:
-            term_push_cmd(term, c);
+            if (c < ' ')
+              term_push_cmd(term, c);
+            else {
+              // collect the string up to the next control character at once
+              uint n = 1 + cmd_span(buf, pos, len, false);
+              term_push_cmds(term, buf + pos - 1, n);
+              pos += n - 1;
+            }
         }
 
       when IGNORE_STRING:
@@ -3891,9 +4564,11 @@ term_do_write(struct term* term, const char *buf, uint len)
         term->cmd_num = -1;
         term->cmd_len = 0;
         term->dcs_cmd = 0;
+        term_cancel_cmd(term);
         switch (c) {
           when '@' ... '~':  /* DCS cmd final byte */
             term->dcs_cmd = c;
+            term_open_cmd(term);
             do_dcs(term);
             term->state = DCS_PASSTHROUGH;
           when '\e':
@@ -3914,10 +4589,28 @@ term_do_write(struct term* term, const char *buf, uint len)
             term->state = DCS_IGNORE;
         }
 
+      when APC_START:
+        term->cmd_num = -1;
+        term->cmd_len = 0;
+        term->dcs_cmd = 0;
+        term_cancel_cmd(term);
+        switch (c) {
+          when 'G':  /* graphics protocol */
+            // the string is passed to its sink like a DCS string
+            term->dcs_cmd = CPAIR('_', 'G');
+            term_open_cmd(term);
+            term->state = DCS_PASSTHROUGH;
+          when '\e':
+            term->state = ESCAPE;
+          otherwise:
+            term->state = IGNORE_STRING;
+        }
+
       when DCS_PARAM:
         switch (c) {
           when '@' ... '~':  /* DCS cmd final byte */
             term->dcs_cmd = term->dcs_cmd << 8 | c;
+            term_open_cmd(term);
             do_dcs(term);
             term->state = DCS_PASSTHROUGH;
           when '\e':
@@ -3939,6 +4632,7 @@ term_do_write(struct term* term, const char *buf, uint len)
         switch (c) {
           when '@' ... '~':  /* DCS cmd final byte */
             term->dcs_cmd = term->dcs_cmd << 8 | c;
+            term_open_cmd(term);
             do_dcs(term);
             term->state = DCS_PASSTHROUGH;
           when '\e':
@@ -3958,7 +4652,13 @@ term_do_write(struct term* term, const char *buf, uint len)
             term->state = DCS_ESCAPE;
             term->esc_mod = 0;
           otherwise:
-            if (!term_push_cmd(term, c)) {
+            if (term->cmd_sink) {
+              // collect the payload up to the next ESC at once
+              uint n = 1 + cmd_span(buf, pos, len, true);
+              term_push_cmds(term, buf + pos - 1, n);
+              pos += n - 1;
+            }
+            else if (!term_push_cmd(term, c)) {
               do_dcs(term);
               term->cmd_buf[0] = c;
               term->cmd_len = 1;
@@ -3974,23 +4674,36 @@ term_do_write(struct term* term, const char *buf, uint len)
 
       when DCS_ESCAPE:
         if (c < 0x20) {
+          term_cancel_cmd(term);
           do_ctrl(term, c);
           term->state = NORMAL;
         } else if (c < 0x30) {
+          term_cancel_cmd(term);
           term->esc_mod = term->esc_mod ? 0xFF : c;
           term->state = ESCAPE;
         } else if (c == '\\') {
           /* Process DCS sequence if we see ST. */
-          do_dcs(term);
+          if (!term_finish_cmd(term))
+            do_dcs(term);
           term->state = NORMAL;
         } else {
+          term_cancel_cmd(term);
           term->state = ESCAPE;
-          term->imgs.parser_state = NULL;
           do_esc(term, c);
         }
     }
   }
 
+  // in the background, leave display work until the tab is shown
+  if (term->background) {
+    term->bg_stale = true;
+    return;
+  }
+
+  // let a progressive sink show the payload received so far
+  if (term->cmd_sink && term->cmd_sink->progressive)
+    term_feed_cmd(term);
+
   if (cfg.ligatures_support > 1) {
     // refresh ligature rendering in old cursor line
     term_invalidate(term, 0, oldy, term->cols - 1, oldy);
@@ -4021,6 +4734,16 @@ term_flush(struct term* term)
     term->suspbuf_pos = 0;
     term->suspbuf_size = 0;
   }
+  // release output held back by the pty reader
+  child_wakeup();
+}
+
+/* Output size that may be held back while selecting, 0 if none */
+uint
+term_suspend_size(struct term* term)
+{
+  return term_selecting(term) && !term->suspbuf && cfg.suspbuf_max > 0
+         ? (uint)cfg.suspbuf_max : 0;
 }
 
 void
@@ -20,6 +20,8 @@
 #define posPle(p1,p2) ((p1).y <= (p2).y && (p1).x <= (p2).x)
 
 extern void term_print_finish(struct term* term);
+extern void term_cancel_cmd(struct term* term);
+extern void term_graphics_clear(struct term* term);
 
 extern void term_schedule_cblink(struct term* term);
 extern void term_schedule_vbell(struct term* term, int already_started, int startpoint);
@@ -53,6 +55,7 @@ extern void clear_cc(termline *, int col);
 
 extern uchar * compressline(termline *);
 extern termline * decompressline(uchar *, int * bytes_used);
+extern ushort compressed_lattr(uchar *);
 
 extern termchar * term_bidi_line(struct term* term, termline *, int scr_y);
 
@@ -60,7 +63,7 @@ extern void term_export_html(bool do_open);
 extern char * term_get_html(int level);
 extern void print_screen(void);
 
-extern int putlink(char * link);
-extern char * geturl(int n);
+extern int putlink(struct term* term, char * link);
+extern char * geturl(struct term* term, int n);
 
 #endif
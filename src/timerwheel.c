@@ -0,0 +1,231 @@
+// timerwheel.c (part of fatty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+#include "timerwheel.h"
+
+#define TW_MASK	(TW_SLOTS - 1)
+/* Ticks covered by the wheel; later expiry times are parked at the end */
+#define TW_SPAN	(1u << (TW_BITS * TW_LEVELS))
+
+static inline uint
+slot_shift(int level)
+{
+  return TW_BITS * level;
+}
+
+static inline uint64_t
+rotr(uint64_t x, uint n)
+{
+  n &= 63;
+  return n ? x >> n | x << (64 - n) : x;
+}
+
+void
+tw_init(twheel *w, uint now)
+{
+  w->now = now;
+  w->count = 0;
+  for (int level = 0; level < TW_LEVELS; level++) {
+    w->occupied[level] = 0;
+    for (int i = 0; i < TW_SLOTS; i++) {
+      twtimer *head = &w->slots[level][i];
+      head->next = head->prev = head;
+    }
+  }
+}
+
+static void
+slot_add(twheel *w, twtimer *t)
+{
+  uint delta = t->expires - w->now;
+  uint pos = t->expires;
+  int level = 0;
+  if ((int)delta <= 0)
+    pos = w->now;  // due at the tick being run
+  else if (delta >= TW_SPAN) {
+    level = TW_LEVELS - 1;
+    pos = w->now + TW_SPAN - 1;
+  }
+  else
+    while (delta >> slot_shift(level + 1))
+      level++;
+
+  uint i = (pos >> slot_shift(level)) & TW_MASK;
+  twtimer *head = &w->slots[level][i];
+  t->slot = level * TW_SLOTS + i;
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+  w->occupied[level] |= (uint64_t)1 << i;
+}
+
+static void
+slot_remove(twheel *w, twtimer *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = 0;
+  uint level = t->slot / TW_SLOTS, i = t->slot % TW_SLOTS;
+  twtimer *head = &w->slots[level][i];
+  if (head->next == head)
+    w->occupied[level] &= ~((uint64_t)1 << i);
+}
+
+void
+tw_arm(twheel *w, twtimer *t, uint expires)
+{
+  if (t->next)
+    slot_remove(w, t);
+  else
+    w->count++;
+  // the slot of the current tick has been run already
+  t->expires = (int)(expires - w->now) > 0 ? expires : w->now + 1;
+  slot_add(w, t);
+}
+
+void
+tw_cancel(twheel *w, twtimer *t)
+{
+  if (t->next) {
+    slot_remove(w, t);
+    w->count--;
+  }
+}
+
+/* Redistribute a slot of an upper level, now that its time has come */
+static void
+cascade(twheel *w, int level)
+{
+  twtimer *head = &w->slots[level][(w->now >> slot_shift(level)) & TW_MASK];
+  while (head->next != head) {
+    twtimer *t = head->next;
+    slot_remove(w, t);
+    slot_add(w, t);
+  }
+}
+
+void
+tw_advance(twheel *w, uint now, void (*expire)(twtimer *))
+{
+  while ((int)(now - w->now) > 0) {
+    if (!w->count) {
+      w->now = now;
+      break;
+    }
+
+    // skip to the next occupied slot or the next cascade
+    uint i = w->now & TW_MASK;
+    uint64_t ahead = i == TW_MASK ? 0 : w->occupied[0] >> (i + 1);
+    uint next = ahead ? w->now + 1 + __builtin_ctzll(ahead)
+                      : (w->now | TW_MASK) + 1;
+    if ((int)(next - now) > 0)
+      next = now;
+    w->now = next;
+
+    for (int level = 1; level < TW_LEVELS; level++) {
+      if (next & ((1u << slot_shift(level)) - 1))
+        break;
+      cascade(w, level);
+    }
+
+    twtimer *head = &w->slots[0][next & TW_MASK];
+    while (head->next != head) {
+      twtimer *t = head->next;
+      slot_remove(w, t);
+      w->count--;
+      expire(t);
+    }
+  }
+}
+
+int
+tw_next(twheel *w)
+{
+  if (!w->count)
+    return -1;
+
+  uint next = TW_SPAN;
+  for (int level = 0; level < TW_LEVELS; level++) {
+    if (!w->occupied[level])
+      continue;
+    // first occupied slot after the current one, wrapping around
+    uint shift = slot_shift(level);
+    uint block = w->now >> shift;
+    uint64_t ahead = rotr(w->occupied[level], (block + 1) & TW_MASK);
+    uint at = ((block + 1 + __builtin_ctzll(ahead)) << shift) - w->now;
+    if (at < next)
+      next = at;
+  }
+  return next;
+}
+
+
+#ifdef TIMERWHEEL_TEST
+
+#include <assert.h>
+
+#define N 500
+
+static twheel wheel;
+static twtimer timers[N];
+static bool armed[N];
+static uint fired;
+
+static void
+expire(twtimer *t)
+{
+  int n = t - timers;
+  assert(armed[n]);
+  assert(wheel.now == t->expires);
+  armed[n] = false;
+  fired++;
+  // re-arm from the callback, as blinking does
+  if (rand() % 4 == 0) {
+    tw_arm(&wheel, t, wheel.now + rand() % 1000);
+    armed[n] = true;
+  }
+}
+
+int
+main(void)
+{
+  srand(1);
+  // start close to the wrap-around of the tick count
+  tw_init(&wheel, 0xFFFF0000u);
+  uint now = wheel.now;
+  for (int round = 0; round < 200000; round++) {
+    int n = rand() % N;
+    switch (rand() % 4) {
+      when 0: {
+        // mostly short timers, some beyond the wheel span
+        uint ticks = rand() % 8 == 0 ? (uint)rand() % (2 * TW_SPAN) : (uint)rand() % 5000;
+        tw_arm(&wheel, &timers[n], now + ticks);
+        armed[n] = true;
+      }
+      when 1:
+        tw_cancel(&wheel, &timers[n]);
+        armed[n] = false;
+      otherwise: {
+        // expiry times must all be at or after the next advance
+        int next = tw_next(&wheel);
+        uint count = 0;
+        for (int i = 0; i < N; i++)
+          if (armed[i]) {
+            count++;
+            assert((int)(timers[i].expires - wheel.now) >= next);
+          }
+        assert(count == wheel.count && (next < 0) == !count);
+        now += rand() % 8 ? rand() % 100 : rand() % 100000;
+        tw_advance(&wheel, now, expire);
+        assert(wheel.now == now);
+        for (int i = 0; i < N; i++)
+          assert(!armed[i] || (int)(timers[i].expires - now) > 0);
+      }
+    }
+  }
+  printf("ok, %u fired\n", fired);
+  return 0;
+}
+
+#endif
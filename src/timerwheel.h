@@ -0,0 +1,45 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+/*
+   Hierarchical timer wheel with millisecond ticks.
+   Level n has 64 slots of 64^n ticks each, so that four levels cover
+   about 4.6 hours; later timers are parked in the top level and
+   cascade down as time advances. Arming, re-arming and cancelling a
+   timer take constant time.
+   The wheel has no clock of its own: the owner advances it to the
+   current time, and asks when next to do so.
+ */
+
+#define TW_BITS	6
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_LEVELS	4
+
+typedef struct twtimer {
+  struct twtimer *next, *prev;  /* slot list, next is 0 while not armed */
+  unsigned int expires;
+  unsigned int slot;  /* level * TW_SLOTS + index */
+  /* for the owner's use */
+  void (*cb)(void *);
+  void *data;
+} twtimer;
+
+typedef struct {
+  unsigned int now;   /* time the wheel has been advanced to */
+  unsigned int count; /* armed timers */
+  uint64_t occupied[TW_LEVELS];  /* non-empty slots */
+  twtimer slots[TW_LEVELS][TW_SLOTS];  /* list heads */
+} twheel;
+
+extern void tw_init(twheel *w, unsigned int now);
+/* Arm or re-arm a timer; expiry times not after now fire on the next tick */
+extern void tw_arm(twheel *w, twtimer *t, unsigned int expires);
+extern void tw_cancel(twheel *w, twtimer *t);
+/* Expire timers up to now; expire may arm, cancel or free any timer */
+extern void tw_advance(twheel *w, unsigned int now, void (*expire)(twtimer *));
+/* Ticks after w->now when the wheel needs advancing, or -1 if idle */
+extern int tw_next(twheel *w);
+
+#endif
@@ -70,8 +70,12 @@ extern wchar win_combine_chars(wchar bc, wchar cc, cattrflags attr);
 extern void win_open(wstring path, bool adjust_dir);
 extern void win_copy(const wchar *data, cattr *cattrs, int len);
 extern void win_copy_as(const wchar *data, cattr *cattrs, int len, char what);
+extern void win_copy_text_begin(void);
+extern void win_copy_text_add(const wchar *text, int len);
+extern void win_copy_text_end(void);
 extern void win_paste(void);
 extern void win_paste_path(void);
+extern void win_show_paste_progress(int percent);
 
 extern void win_set_timer(void (*cb)(void*), void* data, uint ticks);
 
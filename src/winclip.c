@@ -764,6 +764,82 @@ win_copy_as(const wchar *data, cattr *cattrs, int len, char what)
   }
 }
 
+/*
+ * Large text is copied in pieces straight into clipboard memory,
+ * and only as CF_UNICODETEXT, which Windows converts on demand.
+ */
+static HGLOBAL copy_data;
+static wchar * copy_text;
+static size_t copy_len, copy_size;
+
+static bool
+copy_text_reserve(size_t len)
+{
+  if (copy_len + len <= copy_size)
+    return true;
+  size_t size = max(copy_size * 2, copy_len + len);
+  HGLOBAL data;
+  if (copy_data) {
+    GlobalUnlock(copy_data);
+    data = GlobalReAlloc(copy_data, size * sizeof(wchar), GMEM_MOVEABLE);
+  }
+  else
+    data = GlobalAlloc(GMEM_DDESHARE | GMEM_MOVEABLE, size * sizeof(wchar));
+  if (!data) {
+    // out of memory: drop the copy
+    copy_text = 0;
+    return false;
+  }
+  copy_data = data;
+  copy_text = GlobalLock(copy_data);
+  copy_size = size;
+  return copy_text;
+}
+
+void
+win_copy_text_begin(void)
+{
+  copy_len = copy_size = 0;
+  copy_data = 0;
+  copy_text_reserve(1 << 20);
+}
+
+void
+win_copy_text_add(const wchar *text, int len)
+{
+  if (copy_text && copy_text_reserve(len)) {
+    memcpy(copy_text + copy_len, text, len * sizeof(wchar));
+    copy_len += len;
+  }
+}
+
+void
+win_copy_text_end(void)
+{
+  if (!copy_data)
+    return;
+  bool ok = copy_text && copy_text_reserve(1);
+  if (ok) {
+    copy_text[copy_len++] = 0;
+    GlobalUnlock(copy_data);
+    // give back what was reserved ahead
+    HGLOBAL data = GlobalReAlloc(copy_data, copy_len * sizeof(wchar), GMEM_MOVEABLE);
+    if (data)
+      copy_data = data;
+  }
+
+  if (ok && OpenClipboard(wnd)) {
+    clipboard_token = true;
+    EmptyClipboard();
+    SetClipboardData(CF_UNICODETEXT, copy_data);
+    CloseClipboard();
+  }
+  else
+    GlobalFree(copy_data);
+  copy_data = 0;
+  copy_text = 0;
+}
+
 static char *
 matchconf(char * conf, char * item)
 {
@@ -1023,10 +1099,12 @@ paste_text(HANDLE data)
 {
   char *cs = GlobalLock(data);
   uint l = MultiByteToWideChar(CP_ACP, 0, cs, -1, 0, 0) - 1;
-  wchar s[l];
+  // large clipboard contents would not fit on the stack
+  wchar *s = newn(wchar, l + 1);
   MultiByteToWideChar(CP_ACP, 0, cs, -1, s, l);
   GlobalUnlock(data);
   term_paste(win_active_terminal(), s, l, (GetKeyState(VK_CONTROL) & 0x80) != 0);
+  free(s);
 }
 
 static void
@@ -13,170 +13,500 @@
 #include "winimg.h"
 #include "sixel.h"
 
-// tempfile_t manipulation
+// Image store
+//
+// Decoded images are kept in memory as DIB sections. When the pixels in
+// memory exceed the configured ImageMemory budget, the images painted
+// least recently are evicted into the store: file-backed segments,
+// bounded by the ImageDiskCache budget. Space freed in a segment is
+// reused; when the store is full, the pictures stored least recently
+// are dropped, and so are the images showing them.
+// Pixels are stored run-length compressed if that pays off, which it
+// does for typical plots; they are then unpacked straight from the
+// mapped segment into a new DIB section. Uncompressed pixels are paged
+// in without copying, by creating the DIB section on the segment itself.
+//
+// The pixels are content-addressed: an image identical to one already
+// known shares its pixel data, so redrawing the same picture again and
+// again costs neither memory nor store space.
+
+typedef struct {
+  size_t pos;
+  size_t len;
+} imghole;
+
+typedef struct imgseg {
+  struct imgseg *next;
+  HANDLE file;
+  HANDLE map;
+  unsigned char *view;
+  size_t size;
+  imghole *holes;  // free space, by position
+  uint nholes, holecap;
+} imgseg;
+
+#define IMGSEG_SIZE (16 * 1024 * 1024)
+// keep offsets aligned as required for DIB sections
+#define IMGSEG_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+static imgseg *segs = NULL;
+static size_t store_disk = 0;      // bytes in segments
+static size_t store_resident = 0;  // bytes of pixels in memory
 
-static tempfile_t *tempfile_current = NULL;
-static size_t tempfile_num = 0;
-static size_t const TEMPFILE_MAX_SIZE = 1024 * 1024 * 16;  /* 16MB */
-static size_t const TEMPFILE_MAX_NUM = 16;
+typedef struct {
+  imgdata *first, *last;
+} datalist;
 
-static tempfile_t *
-tempfile_new(void)
+// image data in memory, least recently painted first,
+// and image data only in the store, least recently stored first
+static datalist resident_lru, stored_lru;
+static unsigned long paint_stamp = 0;
+// pictures dropped so far, so that terminals collect their images
+static unsigned long data_lost = 0;
+
+// all image data, by content hash
+#define IMGDATA_BUCKETS 1024
+static imgdata *data_buckets[IMGDATA_BUCKETS];
+
+static size_t
+data_size(imgdata *data)
 {
-  tempfile_t *tempfile;
-  FILE *fp;
+  return (size_t)data->pixelwidth * data->pixelheight * 4;
+}
 
-  fp = tmpfile();
-  if (!fp)
+static imgseg *
+seg_new(size_t size)
+{
+  wchar dir[MAX_PATH], path[MAX_PATH];
+  if (!GetTempPathW(MAX_PATH, dir) || !GetTempFileNameW(dir, W("img"), 0, path))
     return NULL;
 
-  tempfile = malloc(sizeof(tempfile_t));
-  //printf("tempfile alloc %d -> %p\n", (int)sizeof(tempfile_t), tempfile);
-  if (!tempfile)
+  HANDLE file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                            CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                            NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    DeleteFileW(path);
     return NULL;
+  }
+  HANDLE map = CreateFileMappingW(file, NULL, PAGE_READWRITE, 0, size, NULL);
+  unsigned char *view = map ? MapViewOfFile(map, FILE_MAP_WRITE, 0, 0, size) : NULL;
+  imgseg *seg = view ? malloc(sizeof(imgseg)) : NULL;
+  imghole *holes = seg ? malloc(sizeof(imghole)) : NULL;
+  if (!holes) {
+    free(seg);
+    if (view)
+      UnmapViewOfFile(view);
+    if (map)
+      CloseHandle(map);
+    CloseHandle(file);
+    return NULL;
+  }
 
-  tempfile->fp = fp;
-  tempfile->ref_counter = 1;
-
-  tempfile_num++;
-
-  return tempfile;
+  seg->file = file;
+  seg->map = map;
+  seg->view = view;
+  seg->size = size;
+  seg->holes = holes;
+  seg->holes[0] = (imghole){0, size};
+  seg->nholes = seg->holecap = 1;
+  seg->next = segs;
+  segs = seg;
+  store_disk += size;
+  return seg;
 }
 
 static void
-tempfile_destroy(tempfile_t *tempfile)
+seg_delete(imgseg *seg)
 {
-  if (tempfile == tempfile_current)
-    tempfile_current = NULL;
-  fclose(tempfile->fp);
-  //printf("free tempfile %p\n", tempfile);
-  free(tempfile);
-  tempfile_num--;
+  imgseg **pp = &segs;
+  while (*pp != seg)
+    pp = &(*pp)->next;
+  *pp = seg->next;
+
+  UnmapViewOfFile(seg->view);
+  CloseHandle(seg->map);
+  CloseHandle(seg->file);  // deletes the file
+  store_disk -= seg->size;
+  free(seg->holes);
+  free(seg);
 }
 
-static void
-tempfile_ref(tempfile_t *tempfile)
+// take len bytes from the first hole that fits
+static bool
+seg_alloc(imgseg *seg, size_t len, size_t *pos)
 {
-  tempfile->ref_counter++;
+  for (uint i = 0; i < seg->nholes; i++) {
+    imghole *hole = &seg->holes[i];
+    if (hole->len >= len) {
+      *pos = hole->pos;
+      hole->pos += len;
+      hole->len -= len;
+      if (!hole->len) {
+        seg->nholes--;
+        memmove(hole, hole + 1, (seg->nholes - i) * sizeof(imghole));
+      }
+      return true;
+    }
+  }
+  return false;
 }
 
+// give len bytes at pos back to the segment, deleting it when empty
 static void
-tempfile_deref(tempfile_t *tempfile)
+seg_free(imgseg *seg, size_t pos, size_t len)
 {
-  if (--tempfile->ref_counter == 0)
-    tempfile_destroy(tempfile);
+  uint i = 0;
+  while (i < seg->nholes && seg->holes[i].pos < pos)
+    i++;
+  imghole *prev = i ? &seg->holes[i - 1] : NULL;
+  imghole *next = i < seg->nholes ? &seg->holes[i] : NULL;
+  bool join_prev = prev && prev->pos + prev->len == pos;
+  bool join_next = next && pos + len == next->pos;
+
+  if (join_prev && join_next) {
+    prev->len += len + next->len;
+    seg->nholes--;
+    memmove(next, next + 1, (seg->nholes - i) * sizeof(imghole));
+  }
+  else if (join_prev)
+    prev->len += len;
+  else if (join_next) {
+    next->pos = pos;
+    next->len += len;
+  }
+  else {
+    if (seg->nholes == seg->holecap) {
+      seg->holecap *= 2;
+      seg->holes = renewn(seg->holes, seg->holecap);
+    }
+    memmove(seg->holes + i + 1, seg->holes + i,
+            (seg->nholes - i) * sizeof(imghole));
+    seg->holes[i] = (imghole){pos, len};
+    seg->nholes++;
+  }
+
+  if (seg->nholes == 1 && seg->holes[0].len == seg->size)
+    seg_delete(seg);
 }
 
+// Run-length compression of pixels: a positive count is followed by as
+// many literal pixels, a negative count by one pixel to be repeated.
+// The output is at most 4 bytes longer than the input.
 static size_t
-tempfile_size(tempfile_t *tempfile)
+rle_pack(const uint *src, size_t n, uint *dst)
 {
-  fpos_t fsize = 0;
-
-  fseek(tempfile->fp, 0L, SEEK_END);
-  fgetpos(tempfile->fp, &fsize);
-
-  return (size_t)fsize;
+  uint *out = dst;
+  size_t lit = 0;
+
+  for (size_t i = 0; i < n; ) {
+    size_t run = 1;
+    while (i + run < n && src[i + run] == src[i])
+      run++;
+    if (run >= 3) {
+      if (lit < i) {
+        *out++ = i - lit;
+        memcpy(out, src + lit, (i - lit) * 4);
+        out += i - lit;
+      }
+      *out++ = - (int)run;
+      *out++ = src[i];
+      lit = i + run;
+    }
+    i += run;
+  }
+  if (lit < n) {
+    *out++ = n - lit;
+    memcpy(out, src + lit, (n - lit) * 4);
+    out += n - lit;
+  }
+  return (out - dst) * 4;
 }
 
-static tempfile_t *
-tempfile_get(void)
+static bool
+rle_unpack(const uint *src, size_t len, uint *dst, size_t n)
 {
-  size_t size;
+  const uint *end = src + len / 4;
+  uint *out = dst, *out_end = dst + n;
+
+  while (src < end) {
+    int count = (int)*src++;
+    if (count > 0) {
+      if (count > end - src || count > out_end - out)
+        return false;
+      memcpy(out, src, count * 4);
+      src += count;
+      out += count;
+    }
+    else {
+      if (src >= end || -count > out_end - out)
+        return false;
+      for (uint c = *src++; count < 0; count++)
+        *out++ = c;
+    }
+  }
+  return out == out_end;
+}
 
-  if (!tempfile_current) {
-    tempfile_current = tempfile_new();
-    return tempfile_current;
+static bool
+rle_match(const uint *src, size_t len, const uint *pixels, size_t n)
+{
+  const uint *end = src + len / 4;
+  const uint *p = pixels, *p_end = pixels + n;
+
+  while (src < end) {
+    int count = (int)*src++;
+    if (count > 0) {
+      if (count > end - src || count > p_end - p
+          || memcmp(p, src, count * 4))
+        return false;
+      src += count;
+      p += count;
+    }
+    else {
+      if (src >= end || -count > p_end - p)
+        return false;
+      for (uint c = *src++; count < 0; count++)
+        if (*p++ != c)
+          return false;
+    }
   }
+  return p == p_end;
+}
 
-  /* get file size */
-  size = tempfile_size(tempfile_current);
+static void
+list_unlink(datalist *list, imgdata *data)
+{
+  if (data->lru_prev)
+    data->lru_prev->lru_next = data->lru_next;
+  else
+    list->first = data->lru_next;
+  if (data->lru_next)
+    data->lru_next->lru_prev = data->lru_prev;
+  else
+    list->last = data->lru_prev;
+  data->lru_prev = data->lru_next = NULL;
+}
 
-  /* if the file size reaches TEMPFILE_MAX_SIZE, return new temporary file */
-  if (size > TEMPFILE_MAX_SIZE) {
-    tempfile_current = tempfile_new();
-    return tempfile_current;
-  }
+static void
+list_append(datalist *list, imgdata *data)
+{
+  data->lru_prev = list->last;
+  data->lru_next = NULL;
+  if (list->last)
+    list->last->lru_next = data;
+  else
+    list->first = data;
+  list->last = data;
+}
 
-  /* increment reference counter */
-  tempfile_ref(tempfile_current);
+static void
+data_unhash(imgdata *data)
+{
+  imgdata **pp = &data_buckets[data->hash % IMGDATA_BUCKETS];
+  while (*pp != data)
+    pp = &(*pp)->hnext;
+  *pp = data->hnext;
+}
 
-  return tempfile_current;
+// drop the pixels of a picture for lack of space;
+// the images showing it go when their terminal is painted next
+static void
+data_lose(imgdata *data)
+{
+  if (data->hdc) {
+    DeleteDC(data->hdc);
+    DeleteObject(data->hbmp);
+    data->hdc = NULL;
+    data->hbmp = NULL;
+    store_resident -= data_size(data);
+    list_unlink(&resident_lru, data);
+  }
+  else if (data->seg)
+    list_unlink(&stored_lru, data);
+  if (data->seg) {
+    seg_free(data->seg, data->segpos, IMGSEG_ALIGN(data->seglen));
+    data->seg = NULL;
+  }
+  data->pixels = NULL;
+  // an identical picture will be new image data
+  data_unhash(data);
+  data->lost = true;
+  data_lost++;
 }
 
+// drop the picture stored least recently, of any tab
 static bool
-tempfile_write(tempfile_t *tempfile, unsigned char *p, size_t pos, size_t size)
+store_evict(void)
 {
-  size_t nbytes;
-
-  fseek((FILE *)tempfile->fp, pos, SEEK_SET);
-  nbytes = fwrite(p, 1, size, tempfile->fp);
-  if (nbytes != size)
+  if (!stored_lru.first)
     return false;
-
+  data_lose(stored_lru.first);
   return true;
 }
 
+// store the pixels of an image, compressed if worthwhile,
+// making room by dropping the pictures stored least recently
 static bool
-tempfile_read(tempfile_t *tempfile, unsigned char *p, size_t pos, size_t size)
+store_put(imgdata *data)
 {
-  size_t nbytes;
+  size_t size = data_size(data);
+  size_t room = IMGSEG_ALIGN(size + 8);
+  size_t budget = (size_t)cfg.image_disk * 1024 * 1024;
+  imgseg *seg;
+  size_t pos;
 
-  fflush((FILE *)tempfile->fp);
-  fseek((FILE *)tempfile->fp, pos, SEEK_SET);
-  nbytes = fread(p, 1, size, (FILE *)tempfile->fp);
-  if (nbytes != size)
+  if (room > budget)
     return false;
+  for (;;) {
+    for (seg = segs; seg; seg = seg->next)
+      if (seg_alloc(seg, room, &pos))
+        break;
+    if (seg)
+      break;
+
+    size_t segsize = max(room, (size_t)IMGSEG_SIZE);
+    if (store_disk + segsize <= budget) {
+      seg = seg_new(segsize);
+      if (!seg)
+        return false;
+      seg_alloc(seg, room, &pos);
+      break;
+    }
+    if (!store_evict())
+      return false;
+  }
+
+  unsigned char *dst = seg->view + pos;
+  size_t len = rle_pack((uint *)data->pixels, size / 4, (uint *)dst);
+  data->packed = len < size / 4 * 3;
+  if (!data->packed) {
+    memcpy(dst, data->pixels, size);
+    len = size;
+  }
+  // give back what the compressed pixels do not need
+  if (IMGSEG_ALIGN(len) < room)
+    seg_free(seg, pos + IMGSEG_ALIGN(len), room - IMGSEG_ALIGN(len));
 
+  data->seg = seg;
+  data->segpos = pos;
+  data->seglen = len;
   return true;
 }
 
-// temp_strage_t implementation
-
-static temp_strage_t *
-strage_create(void)
+static uint
+pixels_hash(const unsigned char *p, size_t size)
 {
-  temp_strage_t *strage;
-  tempfile_t *tempfile;
+  unsigned long long h = 0xcbf29ce484222325ULL ^ size;
+  unsigned long long w;
+  size_t i = 0;
+
+  for (; i + 8 <= size; i += 8) {
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0x100000001b3ULL;
+    h ^= h >> 32;
+  }
+  for (; i < size; i++)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  return (uint)(h ^ h >> 32);
+}
 
-  tempfile = tempfile_get();
-  if (!tempfile)
-    return NULL;
+static bool
+data_matches(imgdata *data, uint hash, const unsigned char *pixels,
+             int pixelwidth, int pixelheight)
+{
+  if (data->hash != hash || data->pixelwidth != pixelwidth
+      || data->pixelheight != pixelheight)
+    return false;
 
-  strage = malloc(sizeof(temp_strage_t));
-  //printf("strage alloc %d -> %p\n", (int)sizeof(temp_strage_t), strage);
-  if (!strage)
-    return NULL;
+  size_t size = data_size(data);
+  if (data->pixels)
+    return !memcmp(data->pixels, pixels, size);
+  else if (!data->packed)
+    return !memcmp(data->seg->view + data->segpos, pixels, size);
+  else
+    return rle_match((uint *)(data->seg->view + data->segpos), data->seglen,
+                     (const uint *)pixels, size / 4);
+}
 
-  strage->tempfile = tempfile;
-  strage->position = tempfile_size(strage->tempfile);
+// find or add the image data for the given pixels, taking ownership
+static imgdata *
+data_get(unsigned char *pixels, int pixelwidth, int pixelheight)
+{
+  uint hash = pixels_hash(pixels, (size_t)pixelwidth * pixelheight * 4);
+  imgdata **bucket = &data_buckets[hash % IMGDATA_BUCKETS];
+
+  for (imgdata *data = *bucket; data; data = data->hnext)
+    if (data_matches(data, hash, pixels, pixelwidth, pixelheight)) {
+      free(pixels);
+      data->refs++;
+      return data;
+    }
 
-  return strage;
+  imgdata *data = malloc(sizeof(imgdata));
+  if (!data)
+    return NULL;
+  data->pixels = pixels;
+  data->hdc = NULL;
+  data->hbmp = NULL;
+  data->seg = NULL;
+  data->segpos = 0;
+  data->seglen = 0;
+  data->packed = false;
+  data->lost = false;
+  data->pixelwidth = pixelwidth;
+  data->pixelheight = pixelheight;
+  data->hash = hash;
+  data->refs = 1;
+  data->hnext = *bucket;
+  *bucket = data;
+  data->lru_prev = data->lru_next = NULL;
+  data->lru_stamp = 0;
+  return data;
 }
 
 static void
-strage_destroy(temp_strage_t *strage)
+data_deref(imgdata *data)
 {
-  tempfile_deref(strage->tempfile);
-  //printf("free strage %p\n", strage);
-  free(strage);
+  if (--data->refs)
+    return;
+
+  if (!data->lost)
+    data_unhash(data);
+
+  if (data->hdc) {
+    DeleteDC(data->hdc);
+    DeleteObject(data->hbmp);
+    store_resident -= data_size(data);
+    list_unlink(&resident_lru, data);
+  } else if (data->pixels) {
+    //printf("winimg_destroy free pixels %p\n", data->pixels);
+    free(data->pixels);
+  } else if (data->seg)
+    list_unlink(&stored_lru, data);
+  if (data->seg)
+    seg_free(data->seg, data->segpos, IMGSEG_ALIGN(data->seglen));
+  free(data);
 }
 
-static bool
-strage_write(temp_strage_t *strage, unsigned char *p, size_t size)
+// the picture for the given pixels, shared with identical ones;
+// takes ownership of the pixels, and returns a reference
+imgdata *
+winimg_data(unsigned char *pixels, int pixelwidth, int pixelheight)
 {
-  return tempfile_write(strage->tempfile, p, strage->position, size);
+  return data_get(pixels, pixelwidth, pixelheight);
 }
 
-static bool
-strage_read(temp_strage_t *strage, unsigned char *p, size_t size)
+void
+winimg_data_release(imgdata *data)
 {
-  return tempfile_read(strage->tempfile, p, strage->position, size);
+  data_deref(data);
 }
 
+// an image showing a picture, which gets another reference
 bool
-winimg_new(imglist **ppimg, unsigned char *pixels,
-           int left, int top, int width, int height,
-           int pixelwidth, int pixelheight)
+winimg_place(imglist **ppimg, imgdata *data,
+             int left, int top, int width, int height)
 {
   imglist *img;
 
@@ -185,116 +515,159 @@ winimg_new(imglist **ppimg, unsigned char *pixels,
   if (!img)
     return false;
 
-  img->pixels = pixels;
-  img->hdc = NULL;
-  img->hbmp = NULL;
+  data->refs++;
+  img->data = data;
   img->left = left;
   img->top = top;
   img->width = width;
   img->height = height;
-  img->pixelwidth = pixelwidth;
-  img->pixelheight = pixelheight;
+  img->pixelwidth = data->pixelwidth;
+  img->pixelheight = data->pixelheight;
+  img->graphics = false;
   img->next = NULL;
-  img->strage = NULL;
 
   *ppimg = img;
 
   return true;
 }
 
+bool
+winimg_new(imglist **ppimg, unsigned char *pixels,
+           int left, int top, int width, int height,
+           int pixelwidth, int pixelheight)
+{
+  imgdata *data = data_get(pixels, pixelwidth, pixelheight);
+  if (!data)
+    return false;
+
+  bool ok = winimg_place(ppimg, data, left, top, width, height);
+  data_deref(data);
+  return ok;
+}
+
 // create DC handle if it is not initialized, or resume from hibernate
 void
 winimg_lazyinit(imglist *img)
 {
+  imgdata *data = img->data;
   BITMAPINFO bmpinfo;
   unsigned char *pixels;
   HDC dc;
   size_t size;
 
-  if (img->hdc)
+  if (data->hdc || data->lost)
     return;
 
-  size = img->pixelwidth * img->pixelheight * 4;
+  size = data_size(data);
+  if (data->seg)
+    list_unlink(&stored_lru, data);
 
   dc = GetDC(wnd);
 
   bmpinfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-  bmpinfo.bmiHeader.biWidth = img->pixelwidth;
-  bmpinfo.bmiHeader.biHeight = - img->pixelheight;
+  bmpinfo.bmiHeader.biWidth = data->pixelwidth;
+  bmpinfo.bmiHeader.biHeight = - data->pixelheight;
   bmpinfo.bmiHeader.biPlanes = 1;
   bmpinfo.bmiHeader.biBitCount = 32;
   bmpinfo.bmiHeader.biCompression = BI_RGB;
   bmpinfo.bmiHeader.biSizeImage = 0;
-  img->hdc = CreateCompatibleDC(dc);
-  img->hbmp = CreateDIBSection(dc, &bmpinfo, DIB_RGB_COLORS, (void*)&pixels, NULL, 0);
-  /*HGDIOBJ res =*/ SelectObject(img->hdc, img->hbmp);
-  if (img->pixels) {
-    CopyMemory(pixels, img->pixels, size);
-    //printf("winimg_lazyinit free pixels %p\n", img->pixels); fflush(stdout);
-    free(img->pixels);
+  data->hdc = CreateCompatibleDC(dc);
+  if (data->pixels) {
+    data->hbmp = CreateDIBSection(dc, &bmpinfo, DIB_RGB_COLORS, (void*)&pixels, NULL, 0);
+    CopyMemory(pixels, data->pixels, size);
+    //printf("winimg_lazyinit free pixels %p\n", data->pixels); fflush(stdout);
+    free(data->pixels);
+  } else if (!data->packed) {
+    // resume from hibernation: map the stored pixels
+    assert(data->seg);
+    data->hbmp = CreateDIBSection(dc, &bmpinfo, DIB_RGB_COLORS, (void*)&pixels,
+                                  data->seg->map, data->segpos);
   } else {
-    // resume from hibernation
-    assert(img->strage);
-    strage_read(img->strage, pixels, size);
+    // resume from hibernation: unpack the stored pixels,
+    // keeping them stored as image data is never modified
+    assert(data->seg);
+    data->hbmp = CreateDIBSection(dc, &bmpinfo, DIB_RGB_COLORS, (void*)&pixels, NULL, 0);
+    if (!rle_unpack((uint *)(data->seg->view + data->segpos), data->seglen,
+                    (uint *)pixels, size / 4))
+      memset(pixels, 0, size);
   }
-  img->pixels = pixels;
+  /*HGDIOBJ res =*/ SelectObject(data->hdc, data->hbmp);
+  data->pixels = pixels;
+  store_resident += size;
+  list_append(&resident_lru, data);
 
   ReleaseDC(wnd, dc);
 }
 
-// serialize an image into a temp file to save the memory
-static void
-winimg_hibernate(imglist *img)
+// evict image data from memory into the store
+static bool
+winimg_hibernate(imgdata *data)
 {
-  size_t size;
-  temp_strage_t *strage;
-
-  size = img->pixelwidth * img->pixelheight * 4;
-
-  if (!img->hdc)
-    return;
-
-  strage = strage_create();
-  if (!strage)
-    return;
+  if (!data->hdc)
+    return true;
 
-  if (!strage_write(strage, img->pixels, size)) {
-    strage_destroy(strage);
-    return;
-  }
+  // image data paged in from the store is still there
+  if (!data->seg && !store_put(data))
+    return false;
 
   // delete allocated DIB section.
-  DeleteDC(img->hdc);
-  DeleteObject(img->hbmp);
-  img->pixels = NULL;
-  img->hdc = NULL;
-  img->hbmp = NULL;
+  DeleteDC(data->hdc);
+  DeleteObject(data->hbmp);
+  data->pixels = NULL;
+  data->hdc = NULL;
+  data->hbmp = NULL;
+  store_resident -= data_size(data);
+  list_unlink(&resident_lru, data);
+  list_append(&stored_lru, data);
 
-  img->strage = strage;
+  return true;
 }
 
 void
 winimg_destroy(imglist *img)
 {
-  if (img->hdc) {
-    DeleteDC(img->hdc);
-    DeleteObject(img->hbmp);
-  } else if (img->pixels) {
-    //printf("winimg_destroy free pixels %p\n", img->pixels);
-    free(img->pixels);
-  } else {
-    strage_destroy(img->strage);
-  }
+  data_deref(img->data);
   //printf("winimg_destroy free img %p\n", img);
   free(img);
 }
 
+// take over the picture of img, which is destroyed
+void
+winimg_replace(imglist *cur, imglist *img)
+{
+  imgdata *data = cur->data;
+  cur->data = img->data;
+  cur->pixelwidth = img->pixelwidth;
+  cur->pixelheight = img->pixelheight;
+  cur->graphics = img->graphics;
+  img->data = data;
+  winimg_destroy(img);
+}
+
+// mark image data as just painted
+static void
+winimg_touch(imgdata *data)
+{
+  data->lru_stamp = paint_stamp;
+  if (data != resident_lru.last) {
+    list_unlink(&resident_lru, data);
+    list_append(&resident_lru, data);
+  }
+}
+
 void
 winimgs_clear(struct term* term)
 {
   imglist *img, *prev;
 
-  // clear parser state
+  // drop pictures kept for the graphics protocol
+  term_graphics_clear(term);
+
+  // clear parser state and the image being received
+  if (term->imgs.preview) {
+    winimg_destroy(term->imgs.preview);
+    term->imgs.preview = NULL;
+  }
   sixel_parser_deinit(term->imgs.parser_state);
   //printf("winimgs_clear free state %p\n", term.imgs.parser_state);
   free(term->imgs.parser_state);
@@ -318,13 +691,176 @@ winimgs_clear(struct term* term)
   term->imgs.last = NULL;
   term->imgs.altfirst = NULL;
   term->imgs.altlast = NULL;
+  free(term->imgs.index);
+  term->imgs.index = NULL;
+  term->imgs.nindex = 0;
+  term->imgs.indexcap = 0;
+  term->imgs.maxheight = 0;
+}
+
+// page out the pictures of a hibernating terminal
+void
+winimgs_hibernate(struct term* term)
+{
+  for (imglist *img = term->imgs.first; img; img = img->next)
+    winimg_hibernate(img->data);
+  for (imglist *img = term->imgs.altfirst; img; img = img->next)
+    winimg_hibernate(img->data);
+}
+
+// order images by top line, then by age
+static int
+img_cmp(const void *a, const void *b)
+{
+  const imglist *i = *(imglist * const *)a, *j = *(imglist * const *)b;
+  if (i->top != j->top)
+    return i->top < j->top ? -1 : 1;
+  return i->seq < j->seq ? -1 : i->seq > j->seq;
+}
+
+// order images by age, which is the painting order
+static int
+img_age_cmp(const void *a, const void *b)
+{
+  const imglist *i = *(imglist * const *)a, *j = *(imglist * const *)b;
+  return i->seq < j->seq ? -1 : i->seq > j->seq;
+}
+
+static void
+index_add(termimgs *imgs, imglist *img)
+{
+  if (imgs->nindex == imgs->indexcap) {
+    imgs->indexcap = max(16, imgs->indexcap * 2);
+    imgs->index = renewn(imgs->index, imgs->indexcap);
+  }
+  imgs->index[imgs->nindex++] = img;
+  imgs->maxheight = max(imgs->maxheight, img->height);
+}
+
+static void
+index_rebuild(termimgs *imgs)
+{
+  imgs->nindex = 0;
+  imgs->maxheight = 0;
+  for (imglist *img = imgs->first; img; img = img->next)
+    index_add(imgs, img);
+  qsort(imgs->index, imgs->nindex, sizeof(imglist *), img_cmp);
+}
+
+// append an image to the current screen,
+// replacing an earlier one covering exactly the same cells
+void
+winimg_add(struct term* term, imglist *img)
+{
+  termimgs *imgs = &term->imgs;
+
+  if (imgs->nindex < 0)
+    index_rebuild(imgs);
+
+  int lo = 0, hi = imgs->nindex;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (imgs->index[mid]->top < img->top)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (int i = lo; i < imgs->nindex && imgs->index[i]->top == img->top; i++) {
+    imglist *cur = imgs->index[i];
+    if (cur->left == img->left && cur->width == img->width
+        && cur->height == img->height) {
+      winimg_replace(cur, img);
+      return;
+    }
+  }
+
+  img->seq = ++imgs->seq;
+  if (imgs->last)
+    imgs->last->next = img;
+  else
+    imgs->first = img;
+  imgs->last = img;
+
+  // images mostly arrive top down; otherwise, sort them again on demand
+  if (imgs->nindex && imgs->index[imgs->nindex - 1]->top > img->top)
+    imgs->nindex = -1;
+  else
+    index_add(imgs, img);
+}
+
+// remove the images placed through the graphics protocol
+// that show a picture, or all of them; sixel images stay
+void
+winimg_remove(struct term* term, imgdata *data)
+{
+  termimgs *imgs = &term->imgs;
+  imglist *prev = NULL;
+  bool any = false;
+
+  for (imglist *img = imgs->first; img; ) {
+    imglist *next = img->next;
+    if (img->graphics && (!data || img->data == data)) {
+      if (prev)
+        prev->next = next;
+      else
+        imgs->first = next;
+      if (img == imgs->last)
+        imgs->last = prev;
+      winimg_destroy(img);
+      any = true;
+    } else
+      prev = img;
+    img = next;
+  }
+  if (any) {
+    imgs->nindex = -1;
+    win_invalidate_all(false);
+  }
+}
+
+// collect images that have left the scrollback,
+// and images whose picture was dropped
+static void
+collect_images(struct term* term)
+{
+  termimgs *imgs = &term->imgs;
+  int gone = term->virtuallines - term->sblines;
+  // look for images of dropped pictures only once after a drop
+  bool any = imgs->lost_seen != data_lost;
+  imgs->lost_seen = data_lost;
+
+  for (int i = 0; !any && i < imgs->nindex && imgs->index[i]->top < gone; i++)
+    if (imgs->index[i]->top + imgs->index[i]->height < gone)
+      any = true;
+  if (!any)
+    return;
+
+  imglist *prev = NULL;
+  bool removed = false;
+  for (imglist *img = imgs->first; img; ) {
+    imglist *next = img->next;
+    if (img->top + img->height < gone || img->data->lost) {
+      if (prev)
+        prev->next = next;
+      else
+        imgs->first = next;
+      if (img == imgs->last)
+        imgs->last = prev;
+      winimg_destroy(img);
+      removed = true;
+    } else
+      prev = img;
+    img = next;
+  }
+  if (removed)
+    index_rebuild(imgs);
 }
 
 void
 winimg_paint(struct term* term)
 {
+  termimgs *imgs = &term->imgs;
   imglist *img;
-  imglist *prev = NULL;
   int left, top;
   int x, y;
   termchar *dchar;
@@ -332,12 +868,43 @@ winimg_paint(struct term* term)
   HDC dc;
   RECT rc;
 
-  /* free disk space if number of tempfile exceeds TEMPFILE_MAX_NUM */
-  while (tempfile_num > TEMPFILE_MAX_NUM && term->imgs.first) {
-    img = term->imgs.first;
-    term->imgs.first = term->imgs.first->next;
-    winimg_destroy(img);
+  // free disk space if the store exceeds its budget (which may have
+  // been reduced), dropping the pictures stored least recently
+  while (store_disk > (size_t)cfg.image_disk * 1024 * 1024 && store_evict())
+    ;
+
+  if (imgs->nindex < 0)
+    index_rebuild(imgs);
+  collect_images(term);
+
+  paint_stamp++;
+
+  // find the images on the screen, from the index:
+  // the first one that may reach the top of the screen ...
+  int vtop = term->virtuallines + term->disptop;
+  int lo = 0, hi = imgs->nindex;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (imgs->index[mid]->top <= vtop - imgs->maxheight)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  // ... up to the last one starting on the screen
+  static imglist **visible = NULL;
+  static int visible_cap = 0;
+  int nvisible = 0;
+  for (int i = lo; i < imgs->nindex && imgs->index[i]->top < vtop + term->rows; i++) {
+    img = imgs->index[i];
+    if (img->top + img->height > vtop) {
+      if (nvisible == visible_cap) {
+        visible_cap = max(16, visible_cap * 2);
+        visible = renewn(visible, visible_cap);
+      }
+      visible[nvisible++] = img;
+    }
   }
+  qsort(visible, nvisible, sizeof(imglist *), img_age_cmp);
 
   dc = GetDC(wnd);
 
@@ -345,64 +912,106 @@ winimg_paint(struct term* term)
   IntersectClipRect(dc, rc.left + PADDING, rc.top + PADDING,
                     rc.left + PADDING + term->cols * cell_width,
                     rc.top + PADDING + term->rows * cell_height);
-  for (img = term->imgs.first; img;) {
-    // if the image is out of scrollback, collect it
-    if (img->top + img->height - term->virtuallines < - term->sblines) {
-      if (img == term->imgs.first)
-        term->imgs.first = img->next;
-      if (img == term->imgs.last)
-        term->imgs.last = prev;
-      if (prev)
-        prev->next = img->next;
-      prev = img;
-      img = img->next;
-      winimg_destroy(prev);
-    } else {
-      // if the image is scrolled out, serialize it into a temp file.
-      left = img->left;
-      top = img->top - term->virtuallines - term->disptop;
-      if (top + img->height < 0 || top > term->rows) {
-        winimg_hibernate(img);
-      } else {
-        // create DC handle if it is not initialized, or resume from hibernate
-        winimg_lazyinit(img);
-        for (y = max(0, top); y < min(top + img->height, term->rows); ++y) {
-          int wide_factor = (term->displines[y]->lattr & LATTR_MODE) == LATTR_NORM ? 1: 2;
-          for (x = left; x < min(left + img->width, term->cols); ++x) {
-            dchar = &term->displines[y]->chars[x];
-
-            // if sixel image is overwirtten by characters,
-            // exclude the area from the clipping rect.
-            update_flag = false;
-            if (dchar->chr != SIXELCH)
-              update_flag = true;
-            if (dchar->attr.attr & (TATTR_RESULT | TATTR_CURRESULT | TATTR_MARKED | TATTR_CURMARKED))
-              update_flag = true;
-            if (term->selected && !update_flag) {
-              pos scrpos = {y + term->disptop, x, false};
-              update_flag = term->sel_rect
-                  ? posPle(term->sel_start, scrpos) && posPlt(scrpos, term->sel_end)
-                  : posle(term->sel_start, scrpos) && poslt(scrpos, term->sel_end);
-            }
-            if (update_flag)
-              ExcludeClipRect(dc,
-                              x * wide_factor * cell_width + PADDING,
-                              y * cell_height + PADDING,
-                              (x + 1) * wide_factor * cell_width + PADDING,
-                              (y + 1) * cell_height + PADDING);
-          }
+
+  // the columns covered by images, per screen line
+  static short *span = NULL;
+  static int span_rows = 0;
+  if (nvisible && span_rows < term->rows) {
+    span_rows = term->rows;
+    span = renewn(span, 2 * span_rows);
+  }
+  if (nvisible)
+    for (y = 0; y < term->rows; y++) {
+      span[2 * y] = term->cols;
+      span[2 * y + 1] = 0;
+    }
+  for (int i = 0; i < nvisible; i++) {
+    img = visible[i];
+    top = img->top - vtop;
+    for (y = max(0, top); y < min(top + img->height, term->rows); ++y) {
+      span[2 * y] = min(span[2 * y], img->left);
+      span[2 * y + 1] = max(span[2 * y + 1], min(img->left + img->width, term->cols));
+    }
+  }
+
+  // if sixel images are overwritten by characters,
+  // exclude those areas from the clipping rect, per run of cells
+  for (y = 0; nvisible && y < term->rows; y++) {
+    int wide_factor = (term->displines[y]->lattr & LATTR_MODE) == LATTR_NORM ? 1: 2;
+    int run = -1;
+    for (x = span[2 * y]; x <= span[2 * y + 1]; ++x) {
+      update_flag = false;
+      if (x < span[2 * y + 1]) {
+        dchar = &term->displines[y]->chars[x];
+        if (dchar->chr != SIXELCH)
+          update_flag = true;
+        if (dchar->attr.attr & (TATTR_RESULT | TATTR_CURRESULT | TATTR_MARKED | TATTR_CURMARKED))
+          update_flag = true;
+        if (term->selected && !update_flag) {
+          pos scrpos = {y + term->disptop, x, false};
+          update_flag = term->sel_rect
+              ? posPle(term->sel_start, scrpos) && posPlt(scrpos, term->sel_end)
+              : posle(term->sel_start, scrpos) && poslt(scrpos, term->sel_end);
         }
-        StretchBlt(dc, left * cell_width + PADDING, top * cell_height + PADDING,
-                   img->width * cell_width, img->height * cell_height, img->hdc,
-                   0, 0, img->pixelwidth, img->pixelheight, SRCCOPY);
       }
-      prev = img;
-      img = img->next;
+      if (update_flag && run < 0)
+        run = x;
+      else if (!update_flag && run >= 0) {
+        ExcludeClipRect(dc,
+                        run * wide_factor * cell_width + PADDING,
+                        y * cell_height + PADDING,
+                        x * wide_factor * cell_width + PADDING,
+                        (y + 1) * cell_height + PADDING);
+        run = -1;
+      }
+    }
+  }
+
+  for (int i = 0; i < nvisible; i++) {
+    img = visible[i];
+    left = img->left;
+    top = img->top - vtop;
+    // create DC handle if it is not initialized, or resume from hibernate
+    winimg_lazyinit(img);
+    if (!img->data->hdc)
+      continue;
+    winimg_touch(img->data);
+    StretchBlt(dc, left * cell_width + PADDING, top * cell_height + PADDING,
+               img->width * cell_width, img->height * cell_height, img->data->hdc,
+               0, 0, img->pixelwidth, img->pixelheight, SRCCOPY);
+  }
+
+  // the image still being received is painted over the text it will
+  // replace, so reset the clipping excluded for other images
+  img = imgs->preview;
+  if (img && !img->data->lost) {
+    top = img->top - vtop;
+    if (top + img->height > 0 && top < term->rows) {
+      SelectClipRgn(dc, NULL);
+      IntersectClipRect(dc, rc.left + PADDING, rc.top + PADDING,
+                        rc.left + PADDING + term->cols * cell_width,
+                        rc.top + PADDING + term->rows * cell_height);
+      winimg_lazyinit(img);
+      winimg_touch(img->data);
+      StretchBlt(dc, img->left * cell_width + PADDING, top * cell_height + PADDING,
+                 img->width * cell_width, img->height * cell_height, img->data->hdc,
+                 0, 0, img->pixelwidth, img->pixelheight, SRCCOPY);
     }
   }
+
   ReleaseDC(wnd, dc);
-}
 
+  // evict the images painted least recently (of any tab)
+  // while the memory budget is exceeded;
+  // if the store cannot take them, drop them
+  while (store_resident > (size_t)cfg.image_memory * 1024 * 1024
+         && resident_lru.first
+         && resident_lru.first->lru_stamp != paint_stamp) {
+    imgdata *data = resident_lru.first;
+    if (!winimg_hibernate(data))
+      data_lose(data);
+  }
+}
 
 #if CYGWIN_VERSION_API_MINOR >= 74
 
@@ -6,10 +6,18 @@
 extern bool winimg_new(imglist **ppimg, unsigned char *pixels,
                        int top, int left, int width, int height,
                        int pixelwidth, int pixelheight);
+extern imgdata * winimg_data(unsigned char *pixels, int pixelwidth, int pixelheight);
+extern void winimg_data_release(imgdata *data);
+extern bool winimg_place(imglist **ppimg, imgdata *data,
+                         int left, int top, int width, int height);
 extern void winimg_destroy(imglist *img);
+extern void winimg_replace(imglist *cur, imglist *img);
+extern void winimg_add(struct term* term, imglist *img);
+extern void winimg_remove(struct term* term, imgdata *data);
 extern void winimg_lazyinit(imglist *img);
 extern void winimg_paint(struct term* term);
 extern void winimgs_clear(struct term* term);
+extern void winimgs_hibernate(struct term* term);
 
 extern void win_emoji_show(int x, int y, wchar * efn, int elen, ushort lattr);
 
@@ -1626,11 +1626,20 @@ win_bell(struct term* term, config * conf)
     win_tab_attention(term);
 }
 
+static void
+paint_shown(struct term* term)
+{
+  if (term->background)
+    term->bg_stale = true;
+  else
+    term_paint(term);
+}
+
 void
 win_invalidate_all(bool clearbg)
 {
   InvalidateRect(wnd, null, true);
-  win_for_each_term(term_paint);
+  win_for_each_term(paint_shown);
   win_flush_background(clearbg);
 }
 
@@ -2007,6 +2016,7 @@ win_reconfig(void)
   copy_config("win_reconfig", &cfg, &new_cfg);
 
   font_cs_reconfig(font_changed);
+  term_word_chars_changed();
 }
 
 static bool
@@ -3860,6 +3870,7 @@ main(int argc, char *argv[])
   main_argv = argv;
   main_argc = argc;
   fatty_debug = getenv("FATTY_DEBUG") ?: "";
+  child_startup_mark("launch");
 #ifdef debuglog
   mtlog = fopen("/tmp/mtlog", "a");
   {
@@ -4292,6 +4303,7 @@ main(int argc, char *argv[])
   }
 
   finish_config();
+  child_startup_mark("config");
 
   int term_rows = cfg.rows;
   int term_cols = cfg.cols;
@@ -4594,6 +4606,7 @@ main(int argc, char *argv[])
   // the locale/charset settings have been loaded, and the font width has
   // been determined.
   cs_reconfig();
+  child_startup_mark("fonts");
 
   // Determine window sizes.
 #if 0
@@ -4638,6 +4651,7 @@ main(int argc, char *argv[])
                           0, 0, width, win_tab_height(), 
                           wnd, NULL, inst, NULL);
   TabCtrl_SetMinTabWidth(tab_wnd, 100);
+  child_startup_mark("window");
 
   // Adapt window position (and maybe size) to special parameters
   // also select monitor if requested
@@ -4862,6 +4876,7 @@ main(int argc, char *argv[])
   }
 
   term_initialized = 1;
+  child_startup_mark("tabs");
 
   setenv("CHERE_INVOKING", "1", false);
   
@@ -4919,6 +4934,7 @@ main(int argc, char *argv[])
   // Finally show the window.
   ShowWindow(wnd, show_cmd);
   SetFocus(wnd);
+  child_startup_mark("shown");
 
   // Set up clipboard notifications.
   HRESULT (WINAPI * pAddClipboardFormatListener)(HWND) =
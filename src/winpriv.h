@@ -142,7 +142,7 @@ void win_for_each_term_bool(void (*cb)(struct term* term, bool param), bool para
 bool win_should_die();
 extern void win_close(void);
 
-extern char * geturl(int n);
+extern char * geturl(struct term* term, int n);
 
 extern unsigned long mtime(void);
 
@@ -10,9 +10,11 @@
 #include "charset.h"  // wcscpy, wcsncat, combiningdouble
 #include "config.h"
 #include "winimg.h"  // winimg_paint
+#include "child.h"  // child_paint_timing
 
 #include <winnls.h>
 #include <usp10.h>  // Uniscribe
+#include <pthread.h>
 
 
 #define dont_debug_bold 1
@@ -127,17 +129,18 @@ struct fontfam {
   int descent;
   // VT100 linedraw character mappings for current font:
   wchar win_linedraw_chars[LDRAW_CHAR_NUM];
+  bool ready;  // fonts created; see fontfam
 } fontfamilies[11];
 
+static struct fontfam * fontfam(int findex);
+
 int line_scale;
 
 wchar
 win_linedraw_char(int i)
 {
   int findex = (win_active_terminal()->curs.attr.attr & FONTFAM_MASK) >> ATTR_FONTFAM_SHIFT;
-  if (findex > 10)
-    findex = 0;
-  struct fontfam * ff = &fontfamilies[findex];
+  struct fontfam * ff = fontfam(findex);
   return ff->win_linedraw_chars[i];
 }
 
@@ -522,6 +525,7 @@ win_init_fontfamily(HDC dc, int findex)
 
   trace_resize(("--- init_fontfamily\n"));
   TEXTMETRIC tm;
+  ff->ready = true;
 
   for (uint i = 0; i < FONT_BOLDITAL; i++) {
     if (ff->fonts[i])
@@ -808,6 +812,16 @@ wcscasestr(wstring in, wstring find)
 static void
 findFraktur(wstring * fnp)
 {
+  // enumerating all fonts is slow, so do it once
+  static wstring found = 0;
+  static bool searched = false;
+  if (searched) {
+    if (found)
+      *fnp = found;
+    return;
+  }
+  searched = true;
+
   LOGFONTW lf;
   wcscpy(lf.lfFaceName, W(""));
   lf.lfPitchAndFamily = 0;
@@ -840,8 +854,10 @@ findFraktur(wstring * fnp)
   }
 
   HDC dc = GetDC(0);
-  EnumFontFamiliesExW(dc, 0, enum_fonts, (LPARAM)fnp, 0);
+  EnumFontFamiliesExW(dc, 0, enum_fonts, (LPARAM)&found, 0);
   ReleaseDC(0, dc);
+  if (found)
+    *fnp = found;
 }
 
 /*
@@ -879,23 +895,44 @@ win_init_fonts(int size)
       fontfamilies[fi].weight = cfg.fontfams[fi].weight;
       fontfamilies[fi].isbold = false;
     }
-    if (fi == 20 - 10 && !*(fontfamilies[fi].name))
-      findFraktur(&fontfamilies[fi].name);
     if (initinit)
       fontfamilies[fi].name_reported = null;
 
-    win_init_fontfamily(dc, fi);
+    // alternative fonts (SGR 11..20) are set up when first used
+    if (fi)
+      fontfamilies[fi].ready = false;
+    else
+      win_init_fontfamily(dc, fi);
   }
   initinit = false;
 
   ReleaseDC(wnd, dc);
 }
 
+/*
+ * Font family with the given index, creating its fonts on first use.
+ */
+static struct fontfam *
+fontfam(int findex)
+{
+  if (findex > 10)
+    findex = 0;
+  struct fontfam * ff = &fontfamilies[findex];
+  if (!ff->ready) {
+    if (findex == 20 - 10 && !*ff->name)
+      findFraktur(&ff->name);
+    HDC dc = GetDC(wnd);
+    win_init_fontfamily(dc, findex);
+    ReleaseDC(wnd, dc);
+  }
+  return ff;
+}
+
 wstring
 win_get_font(uint fi)
 {
   if (fi < lengthof(fontfamilies))
-    return fontfamilies[fi].name;
+    return fontfam(fi)->name;
   else
     return null;
 }
@@ -959,72 +996,133 @@ static struct charnameentry {
 static int charnametable_len = 0;
 static int charnametable_alloced = 0;
 static bool charnametable_init = false;
+static bool charnametable_ready = false;  // set by the loader thread
 
 static void
-init_charnametable()
+add_charname(uint cc, char * cn)
 {
-  if (charnametable_init)
-    return;
-  charnametable_init = true;
+  if (charnametable_len >= charnametable_alloced) {
+    charnametable_alloced += 999;
+    if (!charnametable)
+      charnametable = newn(struct charnameentry, charnametable_alloced);
+    else
+      charnametable = renewn(charnametable, charnametable_alloced);
+  }
 
-  void add_charname(uint cc, char * cn) {
-    if (charnametable_len >= charnametable_alloced) {
-      charnametable_alloced += 999;
-      if (!charnametable)
-        charnametable = newn(struct charnameentry, charnametable_alloced);
-      else
-        charnametable = renewn(charnametable, charnametable_alloced);
-    }
+  charnametable[charnametable_len].uc = cc;
+  charnametable[charnametable_len].un = cn;
+  charnametable_len++;
+}
 
-    charnametable[charnametable_len].uc = cc;
-    charnametable[charnametable_len].un = strdup(cn);
-    charnametable_len++;
+/*
+   Load charnames.txt, lines of "<hex> <NAME>", in one go;
+   the names stay in the file buffer.
+ */
+static bool
+load_charnames(char * cnfn)
+{
+  FILE * cnf = cnfn ? fopen(cnfn, "r") : 0;
+  if (!cnf)
+    return false;
+  fseek(cnf, 0, SEEK_END);
+  long size = ftell(cnf);
+  rewind(cnf);
+  char * buf = newn(char, size + 1);
+  size = fread(buf, 1, size, cnf);
+  fclose(cnf);
+  buf[size] = 0;
+
+  int lines = 0;
+  for (char * p = buf; (p = strchr(p, '\n')); p++)
+    lines++;
+  charnametable_alloced = lines + 1;
+  charnametable = newn(struct charnameentry, charnametable_alloced);
+
+  char * p = buf;
+  for (;;) {
+    char * end;
+    uint cc = strtoul(p, &end, 16);
+    if (end == p)
+      break;
+    p = end;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    char * cn = p;
+    while ((*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')
+           || *p == ' ' || *p == '-')
+      p++;
+    if (p == cn)
+      break;
+    char * eol = strchr(p, '\n');
+    *p = 0;
+    add_charname(cc, cn);
+    if (!eol)
+      break;
+    p = eol + 1;
   }
+  return true;
+}
 
-  char * cnfn = get_resource_file(W("info"), W("charnames.txt"), false);
-  FILE * cnf = fopen(cnfn, "r");
-  if (cnf) {
-    uint cc;
-    char cn[100];
-    while (fscanf(cnf, "%X %[- A-Z0-9]", &cc, cn) == 2) {
-      add_charname(cc, cn);
-    }
-    fclose(cnf);
-  }
-  else {
-    cnf = fopen("/usr/share/unicode/ucd/UnicodeData.txt", "r");
-    if (!cnf)
-      return;
-    FILE * crf = fopen("/usr/share/unicode/ucd/NameAliases.txt", "r");
-    uint ccorr = 0;
-    char buf[100];
-    char nbuf[100];
-    while (fgets(buf, sizeof(buf), cnf)) {
-      uint cc;
-      char cn[99];
-      if (sscanf(buf, "%X;%[- A-Z0-9];", &cc, cn) == 2) {
-        //0020;SPACE;Zs;0;WS;;;;;N;;;;;
-        if (crf) {
-          while (ccorr < cc && fgets(nbuf, sizeof(nbuf), crf)) {
-            sscanf(nbuf, "%X;", &ccorr);
-          }
-          if (ccorr == cc && strstr(nbuf, ";correction")) {
-            //2118;WEIERSTRASS ELLIPTIC FUNCTION;correction
-            sscanf(nbuf, "%X;%[- A-Z0-9];", &ccorr, cn);
+static void *
+charnametable_loader(void * cnfn)
+{
+  if (!load_charnames(cnfn)) {
+    FILE * cnf = fopen("/usr/share/unicode/ucd/UnicodeData.txt", "r");
+    if (cnf) {
+      FILE * crf = fopen("/usr/share/unicode/ucd/NameAliases.txt", "r");
+      uint ccorr = 0;
+      char buf[100];
+      char nbuf[100];
+      while (fgets(buf, sizeof(buf), cnf)) {
+        uint cc;
+        char cn[99];
+        if (sscanf(buf, "%X;%[- A-Z0-9];", &cc, cn) == 2) {
+          //0020;SPACE;Zs;0;WS;;;;;N;;;;;
+          if (crf) {
+            while (ccorr < cc && fgets(nbuf, sizeof(nbuf), crf)) {
+              sscanf(nbuf, "%X;", &ccorr);
+            }
+            if (ccorr == cc && strstr(nbuf, ";correction")) {
+              //2118;WEIERSTRASS ELLIPTIC FUNCTION;correction
+              sscanf(nbuf, "%X;%[- A-Z0-9];", &ccorr, cn);
+            }
           }
+          add_charname(cc, strdup(cn));
         }
-        add_charname(cc, cn);
       }
+      fclose(cnf);
+      if (crf)
+        fclose(crf);
     }
-    fclose(cnf);
-    if (crf)
-      fclose(crf);
   }
+  free(cnfn);
+  __atomic_store_n(&charnametable_ready, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Start loading character names in the background */
+static void
+init_charnametable()
+{
+  if (charnametable_init)
+    return;
+  charnametable_init = true;
+
+  char * cnfn = get_resource_file(W("info"), W("charnames.txt"), false);
+  pthread_t thread;
+  if (pthread_create(&thread, 0, charnametable_loader, cnfn))
+    charnametable_loader(cnfn);
+  else
+    pthread_detach(thread);
 }
 
 static char *
 charname(xchar ucs)
 {
+  // names show up once the table is loaded
+  if (!__atomic_load_n(&charnametable_ready, __ATOMIC_ACQUIRE))
+    return "";
+
   // binary search in table
   int min = 0;
   int max = charnametable_len - 1;
@@ -1210,8 +1308,10 @@ do_update(void)
   win_paint_exclude_search(dc);
   term_update_search(term);
 
+  unsigned long long paint_start = child_clock();
   term_paint(term);
   winimg_paint(term);
+  child_paint_timing(child_clock() - paint_start);
 
   ReleaseDC(wnd, dc);
 
@@ -1310,12 +1410,14 @@ show_link(void)
   struct term* term = win_active_terminal();
 
   static int lasthoverlink = -1;
+  static struct term* lastterm = 0;
 
   int hoverlink = term->hovering ? term->hoverlink : -1;
-  if (hoverlink != lasthoverlink) {
+  if (hoverlink != lasthoverlink || term != lastterm) {
     lasthoverlink = hoverlink;
+    lastterm = term;
 
-    char * url = geturl(hoverlink) ?: "";
+    char * url = geturl(term, hoverlink) ?: "";
 
     if (nonascii(url)) {
       wchar * wcs = cs__utftowcs(url);
@@ -2651,7 +2753,7 @@ win_text(int tx, int ty, wchar *text, int len, cattr attr, cattr *textattr, usho
     else
       graph |= 0xE0;
   }
-  struct fontfam * ff = &fontfamilies[findex];
+  struct fontfam * ff = fontfam(findex);
 
   trace_line("win_text:");
 
@@ -3789,9 +3891,7 @@ void
 win_check_glyphs(wchar *wcs, uint num, cattrflags attr)
 {
   int findex = (attr & FONTFAM_MASK) >> ATTR_FONTFAM_SHIFT;
-  if (findex > 10)
-    findex = 0;
-  struct fontfam * ff = &fontfamilies[findex];
+  struct fontfam * ff = fontfam(findex);
 
   HFONT f = font4(ff, attr);
 
@@ -3844,9 +3944,7 @@ int
 win_char_width(xchar c, cattrflags attr)
 {
   int findex = (attr & FONTFAM_MASK) >> ATTR_FONTFAM_SHIFT;
-  if (findex > 10)
-    findex = 0;
-  struct fontfam * ff = &fontfamilies[findex];
+  struct fontfam * ff = fontfam(findex);
 
 #define measure_width
 
@@ -4057,9 +4155,7 @@ win_combine_chars(wchar c, wchar cc, cattrflags attr)
   int len = FoldStringW(MAP_PRECOMPOSED, (wchar[]){c, cc}, 2, cs, 2);
   if (len == 1) {  // check whether the combined glyph exists
     int findex = (attr & FONTFAM_MASK) >> ATTR_FONTFAM_SHIFT;
-    if (findex > 10)
-      findex = 0;
-    struct fontfam * ff = &fontfamilies[findex];
+    struct fontfam * ff = fontfam(findex);
 
     HFONT f = font4(ff, attr);
 
@@ -4252,8 +4348,10 @@ win_paint(void)
 
   //if (kb_trace) printf("[%ld] win_paint state %d (idl/blk/pnd)\n", mtime(), update_state);
   if (update_state != UPDATE_PENDING) {
+    unsigned long long paint_start = child_clock();
     term_paint(term);
     winimg_paint(term);
+    child_paint_timing(child_clock() - paint_start);
   }
 
   win_paint_tabs(0, p.rcPaint.right - p.rcPaint.left);
@@ -73,8 +73,8 @@ tip_proc(HWND hWnd, UINT nMsg, WPARAM wParam, LPARAM lParam)
   return DefWindowProc(hWnd, nMsg, wParam, lParam);
 }
 
-void
-win_show_tip(int x, int y, int cols, int rows)
+static void
+show_tip(int x, int y)
 {
   if (!tip_wnd) {
     NONCLIENTMETRICS nci;
@@ -114,12 +114,32 @@ win_show_tip(int x, int y, int cols, int rows)
                  SWP_NOZORDER | SWP_NOSIZE | SWP_NOACTIVATE);
   }
 
-  sprintf(sizetip, "%dx%d", cols, rows);
   // even if this text is not used anymore, 
   // apparently the call is needed to trigger WM_PAINT:
   SetWindowTextA(tip_wnd, sizetip);
 }
 
+void
+win_show_tip(int x, int y, int cols, int rows)
+{
+  sprintf(sizetip, "%dx%d", cols, rows);
+  show_tip(x, y);
+}
+
+/* Show how far a long paste has got at the top left, or remove it with -1 */
+void
+win_show_paste_progress(int percent)
+{
+  if (percent < 0) {
+    win_destroy_tip();
+    return;
+  }
+  POINT p = {PADDING, PADDING};
+  ClientToScreen(wnd, &p);
+  snprintf(sizetip, sizeof sizetip, "%s %d%%", _("Pasting"), percent);
+  show_tip(p.x, p.y);
+}
+
 void
 win_destroy_tip(void)
 {
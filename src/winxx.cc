@@ -1,5 +1,6 @@
 #include <windows.h>
-#include <set>
+#include <unordered_map>
+#include <functional>
 #include <tuple>
 #include <vector>
 #include <algorithm>
@@ -19,6 +20,7 @@
 extern "C" {
 #include "winpriv.h"
 #include "winsearch.h"
+#include "timerwheel.h"
 
 extern wchar * cs__mbstowcs(const char * s);
 }
@@ -30,9 +32,22 @@ using std::get;
 
 typedef void (*CallbackFn)(void*);
 typedef tuple<CallbackFn, void*> Callback;
-typedef std::set<Callback> CallbackSet;
+struct CallbackHash {
+    size_t operator()(const Callback& c) const {
+        return std::hash<void*>()(reinterpret_cast<void*>(get<0>(c)))
+             ^ std::hash<void*>()(get<1>(c)) * 31;
+    }
+};
+// timers stay at their address while armed
+typedef std::unordered_map<Callback, twtimer, CallbackHash> CallbackMap;
+
+// all callbacks run from a timer wheel behind a single window timer
+static const UINT_PTR wheel_timer_id = 1;
+static twheel wheel;
+static bool wheel_timer_set = false;
+static unsigned int wheel_timer_due;
 
-static CallbackSet callbacks;
+static CallbackMap callbacks;
 static std::vector<Tab> tabs;
 static unsigned int active_tab = 0;
 
@@ -77,20 +92,46 @@ Tab& Tab::operator=(Tab&& t) {
 
 extern "C" {
 
+// set the window timer for a wheel event due at the given tick count
+static void set_wheel_timer(unsigned int due) {
+    int delay = due - GetTickCount();
+    SetTimer(wnd, wheel_timer_id, std::max(delay, 0), NULL);
+    wheel_timer_set = true;
+    wheel_timer_due = due;
+}
+
 void win_set_timer(CallbackFn cb, void* data, uint ticks) {
-    auto result = callbacks.insert(std::make_tuple(cb, data));
-    CallbackSet::iterator iter = result.first;
-    SetTimer(wnd, reinterpret_cast<UINT_PTR>(&*iter), ticks, NULL);
+    if (callbacks.empty())
+        tw_init(&wheel, GetTickCount());
+
+    // re-arming a pending callback just moves it in the wheel
+    twtimer& timer = callbacks[std::make_tuple(cb, data)];
+    timer.cb = cb;
+    timer.data = data;
+    unsigned int due = GetTickCount() + ticks;
+    tw_arm(&wheel, &timer, due);
+
+    if (!wheel_timer_set || int(due - wheel_timer_due) < 0)
+        set_wheel_timer(due);
+}
+
+static void expire_timer(twtimer* timer) {
+    CallbackFn cb = timer->cb;
+    void* data = timer->data;
+    // the callback may set its timer again
+    callbacks.erase(std::make_tuple(cb, data));
+    cb(data);
 }
 
 void win_process_timer_message(WPARAM message) {
-    void* pointer = reinterpret_cast<void*>(message);
-    auto callback = *reinterpret_cast<Callback*>(pointer);
-    callbacks.erase(callback);
     KillTimer(wnd, message);
+    wheel_timer_set = false;
 
-    // call the callback
-    get<0>(callback)( get<1>(callback) );
+    tw_advance(&wheel, GetTickCount(), expire_timer);
+
+    int next = tw_next(&wheel);
+    if (next >= 0)
+        set_wheel_timer(wheel.now + next);
 }
 
 static void invalidate_tabs() {
@@ -115,11 +156,12 @@ static void update_window_state() {
 
 static void set_active_tab(unsigned int index) {
     active_tab = index;
-    SendMessage(tab_wnd, TCM_SETCURSEL, index, 0);
     Tab* active = &tabs.at(active_tab);
     for (auto& tab : tabs) {
+        term_set_background(tab.terminal.get(), &tab != active);
         term_set_focus(tab.terminal.get(), &tab == active, false);
     }
+    SendMessage(tab_wnd, TCM_SETCURSEL, index, 0);
     active->info.attention = false;
     SetFocus(wnd);
     
@@ -229,12 +271,13 @@ void win_tab_clean() {
                 return x.chld->pid == 0; });
         if (it == tabs.end()) break;
         invalidate = true;
-        for (;;) {
-          auto cb = std::find_if(callbacks.begin(), callbacks.end(), [&it](Callback x) {
-            return ((term *)(get<1>(x)) == (*it).terminal.get()); });
-          if (cb == callbacks.end()) break;
-          KillTimer(wnd, reinterpret_cast<UINT_PTR>(&*cb));
-          callbacks.erase(cb);
+        for (auto cb = callbacks.begin(); cb != callbacks.end();) {
+          if ((term *)(get<1>(cb->first)) == (*it).terminal.get()) {
+            tw_cancel(&wheel, &cb->second);
+            cb = callbacks.erase(cb);
+          }
+          else
+            ++cb;
         }
         SendMessage(tab_wnd, TCM_DELETEITEM, (*it).info.idx, 0);
         tabs.erase(it);